@@ -6,11 +6,17 @@ have_func('munmap', 'sys/mman.h') or abort 'munmap() not found'
 
 $CPPFLAGS += " -D_GNU_SOURCE "
 have_func('mremap', 'sys/mman.h')
+have_func('sched_getcpu', 'sched.h')
 
 $CPPFLAGS += " -D_BSD_SOURCE "
 have_func("getpagesize", "unistd.h")
 have_func('rb_thread_blocking_region')
 have_func('rb_thread_io_blocking_region')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_gc_adjust_memory_usage')
+have_header('linux/unix_diag.h')
+have_header('sys/timerfd.h')
+have_type('st_index_t', 'ruby/st.h')
 
 checking_for "GCC 4+ atomic builtins" do
   src = <<SRC
@@ -0,0 +1,508 @@
+#include <ruby.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include "histogram.h"
+
+static VALUE sym_bits;
+static size_t page_size;
+
+#define HIST_DEFAULT_BITS 5
+
+static size_t data_len(size_t nr_buckets)
+{
+	size_t len = offsetof(struct rd_hist_data, buckets);
+
+	len += nr_buckets * sizeof(unsigned long);
+
+	return (len + page_size - 1) & ~(page_size - 1);
+}
+
+/* called by GC */
+static void gcfree(void *ptr)
+{
+	struct rd_hist *h = ptr;
+
+	if (h->data != MAP_FAILED) {
+		int rv = munmap(h->data, h->len);
+		if (rv != 0)
+			rb_bug("munmap failed in gc: %s", strerror(errno));
+	}
+
+	xfree(ptr);
+}
+
+/* automatically called at creation (before initialize) */
+static VALUE alloc(VALUE klass)
+{
+	struct rd_hist *h;
+	VALUE rv = Data_Make_Struct(klass, struct rd_hist, NULL, gcfree, h);
+
+	h->data = MAP_FAILED;
+	return rv;
+}
+
+struct rd_hist *rd_hist_get(VALUE self)
+{
+	struct rd_hist *h;
+
+	Data_Get_Struct(self, struct rd_hist, h);
+
+	if (h->data == MAP_FAILED)
+		rb_raise(rb_eStandardError, "invalid or freed Histogram");
+
+	return h;
+}
+
+static void hist_init(struct rd_hist *h, unsigned bits)
+{
+	int tries = 1;
+
+	if (h->data != MAP_FAILED)
+		rb_raise(rb_eRuntimeError, "already initialized");
+	if (bits < 1 || bits > RD_HIST_BITS_MAX)
+		rb_raise(rb_eArgError, "bits must be between 1 and %d",
+		         RD_HIST_BITS_MAX);
+
+	h->bits = bits;
+	h->nr_buckets = rd_hist_nr_buckets(bits);
+	h->len = data_len(h->nr_buckets);
+retry:
+	h->data = mmap(NULL, h->len,
+	               PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+	if (h->data == MAP_FAILED) {
+		if ((errno == EAGAIN || errno == ENOMEM) && tries-- > 0) {
+			rb_gc();
+			goto retry;
+		}
+		rb_sys_fail("mmap");
+	}
+	h->data->min = ULONG_MAX;
+}
+
+/*
+ * call-seq:
+ *	Raindrops::Histogram.new([options])	-> histogram
+ *
+ * Creates a new histogram in shared memory.  Like Raindrops objects,
+ * it is shared with all processes forked afterwards, and any of
+ * them may record into it or read from it without locking.
+ *
+ * +options+ is a hash that accepts the following keys:
+ *
+ * * :bits - precision of the buckets (default: 5).  Values below
+ *   2**bits are recorded exactly, larger values have a relative
+ *   error of at most 2**(1 - bits).  Higher precision uses more
+ *   memory and makes reads slower.
+ */
+static VALUE init(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts, tmp;
+	unsigned bits = HIST_DEFAULT_BITS;
+
+	rb_scan_args(argc, argv, "01", &opts);
+	if (!NIL_P(opts)) {
+		Check_Type(opts, T_HASH);
+		tmp = rb_hash_aref(opts, sym_bits);
+		if (!NIL_P(tmp))
+			bits = NUM2UINT(tmp);
+	}
+	hist_init(DATA_PTR(self), bits);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.dup	-> hist_copy
+ *
+ * Duplicates and snapshots the current state of a Histogram object.
+ */
+static VALUE init_copy(VALUE dest, VALUE source)
+{
+	struct rd_hist *dst = DATA_PTR(dest);
+	struct rd_hist *src = rd_hist_get(source);
+
+	hist_init(dst, src->bits);
+	memcpy(dst->data, src->data, src->len);
+
+	return dest;
+}
+
+static unsigned long value_arg(VALUE val)
+{
+	if (FIXNUM_P(val) ? FIX2LONG(val) < 0 :
+	    rb_funcall(val, '<', 1, INT2FIX(0)) == Qtrue)
+		rb_raise(rb_eArgError, "value must not be negative");
+
+	return NUM2ULONG(val);
+}
+
+/*
+ * call-seq:
+ *	hist.record(value[, count])	-> hist
+ *	hist << value			-> hist
+ *
+ * Records +count+ (default: 1) occurrences of a non-negative Integer
+ * +value+.  This only uses atomic operations and is safe to call
+ * from any process sharing the histogram.
+ */
+static VALUE record(int argc, VALUE *argv, VALUE self)
+{
+	VALUE val, n;
+
+	rb_scan_args(argc, argv, "11", &val, &n);
+	rd_hist_record(rd_hist_get(self), value_arg(val),
+	               NIL_P(n) ? 1 : NUM2ULONG(n));
+
+	return self;
+}
+
+static VALUE append(VALUE self, VALUE val)
+{
+	rd_hist_record(rd_hist_get(self), value_arg(val), 1);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.count	-> Integer
+ *
+ * Returns the number of values recorded
+ */
+static VALUE count(VALUE self)
+{
+	return ULONG2NUM(rd_hist_get(self)->data->count);
+}
+
+/*
+ * call-seq:
+ *	hist.sum	-> Integer
+ *
+ * Returns the sum of all values recorded, this wraps around at
+ * Raindrops::MAX
+ */
+static VALUE sum(VALUE self)
+{
+	return ULONG2NUM(rd_hist_get(self)->data->sum);
+}
+
+/*
+ * call-seq:
+ *	hist.min	-> Integer or nil
+ *
+ * Returns the lowest value recorded, +nil+ if nothing was recorded
+ */
+static VALUE min(VALUE self)
+{
+	struct rd_hist_data *d = rd_hist_get(self)->data;
+
+	return d->count ? ULONG2NUM(d->min) : Qnil;
+}
+
+/*
+ * call-seq:
+ *	hist.max	-> Integer or nil
+ *
+ * Returns the highest value recorded, +nil+ if nothing was recorded
+ */
+static VALUE max(VALUE self)
+{
+	struct rd_hist_data *d = rd_hist_get(self)->data;
+
+	return d->count ? ULONG2NUM(d->max) : Qnil;
+}
+
+/*
+ * call-seq:
+ *	hist.mean	-> Float or nil
+ *
+ * Returns the mean of all values recorded, +nil+ if nothing was recorded
+ */
+static VALUE mean(VALUE self)
+{
+	struct rd_hist_data *d = rd_hist_get(self)->data;
+	unsigned long n = d->count;
+
+	return n ? rb_float_new((double)d->sum / (double)n) : Qnil;
+}
+
+/*
+ * call-seq:
+ *	hist.percentile(p)	-> Integer or nil
+ *
+ * Returns the value below which +p+ percent (0.0 - 100.0) of the
+ * recorded values fall.  The result is the upper bound of the bucket
+ * the percentile falls in, capped by +max+.  This is O(buckets) and
+ * does not need any locking.  Returns +nil+ if nothing was recorded.
+ */
+static VALUE percentile(VALUE self, VALUE p)
+{
+	struct rd_hist *h = rd_hist_get(self);
+	double pct = NUM2DBL(p);
+	unsigned long total = 0, want, seen = 0, lo, hi, max;
+	size_t i;
+
+	if (pct < 0.0 || pct > 100.0)
+		rb_raise(rb_eArgError, "percentile must be between 0 and 100");
+
+	/* buckets may be updated while we read, so count them ourselves */
+	for (i = 0; i < h->nr_buckets; i++)
+		total += h->data->buckets[i];
+	if (total == 0)
+		return Qnil;
+
+	want = (unsigned long)(pct / 100.0 * (double)total + 0.5);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < h->nr_buckets; i++) {
+		seen += h->data->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == h->nr_buckets)
+		i--;
+
+	rd_hist_bounds(h->bits, i, &lo, &hi);
+	max = h->data->max;
+
+	return ULONG2NUM(hi > max ? max : hi);
+}
+
+/*
+ * call-seq:
+ *	hist.each_nonzero { |lower, upper, count| ... }	-> hist
+ *
+ * Yields the inclusive bounds and count of every non-empty bucket
+ * in ascending order.
+ */
+static VALUE each_nonzero(VALUE self)
+{
+	struct rd_hist *h = rd_hist_get(self);
+	size_t i;
+
+	for (i = 0; i < h->nr_buckets; i++) {
+		unsigned long n = h->data->buckets[i];
+		unsigned long lo, hi;
+
+		if (n == 0)
+			continue;
+		rd_hist_bounds(h->bits, i, &lo, &hi);
+		rb_yield_values(3, ULONG2NUM(lo), ULONG2NUM(hi), ULONG2NUM(n));
+	}
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.reset!	-> hist
+ *
+ * Clears all recorded values.  This is not atomic with respect to
+ * other processes recording at the same time.
+ */
+static VALUE reset_bang(VALUE self)
+{
+	struct rd_hist *h = rd_hist_get(self);
+
+	memset(h->data, 0, h->len);
+	h->data->min = ULONG_MAX;
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.merge!(other)	-> hist
+ *
+ * Adds all values recorded in +other+ to +hist+, as if they had been
+ * recorded in +hist+ in the first place.  Both histograms must have
+ * been created with the same +bits+.  Like +record+, this only uses
+ * atomic operations on +hist+, and +other+ may be recorded into while
+ * it is merged.
+ */
+static VALUE merge_bang(VALUE self, VALUE other)
+{
+	struct rd_hist *dst = rd_hist_get(self);
+	struct rd_hist *src = rd_hist_get(other);
+	struct rd_hist_data *d = dst->data;
+	struct rd_hist_data *s = src->data;
+	size_t i;
+
+	if (dst->bits != src->bits)
+		rb_raise(rb_eArgError, "bits mismatch (%u != %u)",
+		         dst->bits, src->bits);
+
+	for (i = 0; i < src->nr_buckets; i++) {
+		unsigned long n = s->buckets[i];
+
+		if (n)
+			__sync_add_and_fetch(&d->buckets[i], n);
+	}
+	__sync_add_and_fetch(&d->count, s->count);
+	__sync_add_and_fetch(&d->sum, s->sum);
+	if (s->count) {
+		rd_atomic_min(&d->min, s->min);
+		rd_atomic_max(&d->max, s->max);
+	}
+
+	return self;
+}
+
+/*
+ * parses the value of a request start header such as X-Request-Start
+ * into microseconds since the Epoch, returns 0 if it is not valid.
+ * Values may have a "t=" prefix and are seconds, milliseconds or
+ * microseconds which are told apart by the magnitude of their integer
+ * part, any of them may have a fraction (nginx: "t=${msec}").
+ *
+ * At most 19 integer digits are accepted and the unit is chosen so
+ * that whole * unit stays below 10**18, so nothing here can overflow.
+ */
+static unsigned long long parse_request_start(const char *p, const char *end)
+{
+	unsigned long long whole = 0, frac = 0, unit, scale;
+	int digits = 0;
+
+	if (end - p >= 2 && p[0] == 't' && p[1] == '=')
+		p += 2;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+		if (digits >= 19)
+			return 0;
+		whole = whole * 10 + (unsigned long long)(*p - '0');
+	}
+	if (digits == 0)
+		return 0;
+
+	if (whole >= 1000000000000000ULL) /* microseconds */
+		unit = 1;
+	else if (whole >= 1000000000000ULL) /* milliseconds */
+		unit = 1000;
+	else /* seconds */
+		unit = 1000000;
+
+	if (p < end && *p == '.') {
+		/* digits beyond a microsecond are ignored */
+		for (scale = unit, p++; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (scale > 1) {
+				scale /= 10;
+				frac += (unsigned long long)(*p - '0') * scale;
+			}
+		}
+	}
+	if (p != end)
+		return 0;
+
+	return whole * unit + frac;
+}
+
+/*
+ * call-seq:
+ *	hist.record_request_start(value[, now])	-> Integer or nil
+ *
+ * Parses +value+ of a request start header set by a proxy in front of
+ * the application (e.g. X-Request-Start set by nginx with
+ * <tt>proxy_set_header X-Request-Start "t=${msec}";</tt>) and records
+ * the time the request spent queued since then, in microseconds.
+ * Returns the recorded value, or +nil+ if +value+ is +nil+ or could
+ * not be parsed.
+ *
+ * The following formats are understood, with an optional "t=" prefix
+ * and an optional fraction:
+ *
+ * * seconds since the Epoch
+ * * milliseconds or microseconds since the Epoch, told apart from
+ *   seconds by their magnitude
+ *
+ * Times in the future (clock skew between hosts) are recorded as zero.
+ * +now+ defaults to the current time in seconds since the Epoch.
+ * Parsing and recording happen without allocating Ruby objects.
+ */
+static VALUE record_request_start(int argc, VALUE *argv, VALUE self)
+{
+	VALUE val, now;
+	unsigned long long start, cur;
+	unsigned long age;
+
+	rb_scan_args(argc, argv, "11", &val, &now);
+	if (NIL_P(val))
+		return Qnil;
+	StringValue(val);
+	start = parse_request_start(RSTRING_PTR(val),
+	                            RSTRING_PTR(val) + RSTRING_LEN(val));
+	if (start == 0)
+		return Qnil;
+	if (NIL_P(now)) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		cur = (unsigned long long)tv.tv_sec * 1000000 +
+		      (unsigned long long)tv.tv_usec;
+	} else {
+		cur = (unsigned long long)(NUM2DBL(now) * 1000000.0 + 0.5);
+	}
+	age = cur > start ? (unsigned long)(cur - start) : 0;
+	rd_hist_record(rd_hist_get(self), age, 1);
+
+	return ULONG2NUM(age);
+}
+
+/*
+ * call-seq:
+ *	hist.bits	-> Integer
+ *
+ * Returns the precision this histogram was created with
+ */
+static VALUE bits(VALUE self)
+{
+	return UINT2NUM(rd_hist_get(self)->bits);
+}
+
+void Init_raindrops_histogram(void)
+{
+	VALUE cRaindrops = rb_const_get(rb_cObject, rb_intern("Raindrops"));
+	VALUE cHistogram;
+
+	page_size = getpagesize();
+	sym_bits = ID2SYM(rb_intern("bits"));
+
+	/*
+	 * Document-class: Raindrops::Histogram
+	 *
+	 * A histogram with log-linear buckets stored in shared memory.
+	 * Like the core Raindrops class, any process forked after
+	 * creation may record values using atomic operations, and any of
+	 * them may read the count, min, max, mean and percentiles
+	 * without locking, IPC or serialization.
+	 *
+	 *   hist = Raindrops::Histogram.new
+	 *   hist << 5
+	 *   hist << 300
+	 *   hist.percentile(99)	-> 300
+	 *
+	 * It is duck-type compatible with the +<<+ method of \Aggregate.
+	 */
+	cHistogram = rb_define_class_under(cRaindrops, "Histogram", rb_cObject);
+	rb_define_alloc_func(cHistogram, alloc);
+
+	rb_define_method(cHistogram, "initialize", init, -1);
+	rb_define_method(cHistogram, "initialize_copy", init_copy, 1);
+	rb_define_method(cHistogram, "record", record, -1);
+	rb_define_method(cHistogram, "<<", append, 1);
+	rb_define_method(cHistogram, "count", count, 0);
+	rb_define_method(cHistogram, "sum", sum, 0);
+	rb_define_method(cHistogram, "min", min, 0);
+	rb_define_method(cHistogram, "max", max, 0);
+	rb_define_method(cHistogram, "mean", mean, 0);
+	rb_define_method(cHistogram, "percentile", percentile, 1);
+	rb_define_method(cHistogram, "each_nonzero", each_nonzero, 0);
+	rb_define_method(cHistogram, "reset!", reset_bang, 0);
+	rb_define_method(cHistogram, "merge!", merge_bang, 1);
+	rb_define_method(cHistogram, "record_request_start",
+	                 record_request_start, -1);
+	rb_define_method(cHistogram, "bits", bits, 0);
+}
@@ -0,0 +1,92 @@
+/*
+ * log-linear histogram stored in shared memory, used by
+ * Raindrops::Histogram and by other parts of the extension which
+ * record values without going through Ruby method dispatch.
+ *
+ * Values below 2**bits each get their own bucket.  Above that, every
+ * power-of-two range is split into 2**(bits - 1) equally-sized
+ * buckets, so the relative error of any bucket is at most 2**(1 - bits).
+ */
+#include <ruby.h>
+#include <limits.h>
+#include "raindrops_atomic.h"
+
+#define RD_HIST_LONG_BIT (sizeof(unsigned long) * CHAR_BIT)
+#define RD_HIST_BITS_MAX 10
+
+/* everything here lives in a MAP_SHARED region */
+struct rd_hist_data {
+	unsigned long count;
+	unsigned long sum;
+	unsigned long min; /* ULONG_MAX if empty */
+	unsigned long max;
+	unsigned long buckets[1]; /* actually rd_hist->nr_buckets */
+};
+
+struct rd_hist {
+	unsigned bits;
+	size_t nr_buckets;
+	size_t len; /* bytes mapped at data */
+	struct rd_hist_data *data;
+};
+
+/* Raindrops::Histogram => struct rd_hist, raises if freed */
+struct rd_hist *rd_hist_get(VALUE self);
+
+static inline size_t rd_hist_nr_buckets(unsigned bits)
+{
+	return (RD_HIST_LONG_BIT + 2 - bits) << (bits - 1);
+}
+
+static inline unsigned rd_hist_msb(unsigned long v)
+{
+#ifdef __GNUC__
+	return RD_HIST_LONG_BIT - 1 - __builtin_clzl(v);
+#else
+	unsigned rv = 0;
+
+	while (v >>= 1)
+		rv++;
+	return rv;
+#endif
+}
+
+static inline size_t rd_hist_index(unsigned bits, unsigned long v)
+{
+	unsigned shift;
+
+	if (v < (1UL << bits))
+		return (size_t)v;
+
+	shift = rd_hist_msb(v) - bits + 1;
+	return ((size_t)shift << (bits - 1)) + (size_t)(v >> shift);
+}
+
+/* stores the smallest and largest values bucket +idx+ may hold */
+static inline void
+rd_hist_bounds(unsigned bits, size_t idx, unsigned long *lo, unsigned long *hi)
+{
+	size_t half = (size_t)1 << (bits - 1);
+	unsigned shift;
+
+	if (idx < ((size_t)1 << bits)) {
+		*lo = *hi = (unsigned long)idx;
+		return;
+	}
+	shift = (unsigned)(idx / half - 1);
+	*lo = (unsigned long)(idx - shift * half) << shift;
+	*hi = *lo + ((1UL << shift) - 1);
+}
+
+/* records +n+ occurrences of +v+, safe to call from any process */
+static inline void
+rd_hist_record(struct rd_hist *h, unsigned long v, unsigned long n)
+{
+	struct rd_hist_data *d = h->data;
+
+	__sync_add_and_fetch(&d->buckets[rd_hist_index(h->bits, v)], n);
+	__sync_add_and_fetch(&d->count, n);
+	__sync_add_and_fetch(&d->sum, v * n);
+	rd_atomic_min(&d->min, v);
+	rd_atomic_max(&d->max, v);
+}
@@ -0,0 +1,350 @@
+#include <ruby.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <string.h>
+#include "raindrops_atomic.h"
+#include "history.h"
+
+#ifndef SIZET2NUM
+#  define SIZET2NUM(x) ULONG2NUM(x)
+#endif
+#ifndef NUM2SIZET
+#  define NUM2SIZET(x) NUM2ULONG(x)
+#endif
+#ifndef RB_GC_GUARD
+#  define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+static VALUE sym_since, sym_until;
+static ID id_to_f;
+static size_t page_size;
+
+void rd_history_unmap(struct rd_history *h)
+{
+	if (h->data != MAP_FAILED) {
+		int rv = munmap(h->data, h->len);
+		if (rv != 0)
+			rb_bug("munmap failed in gc: %s", strerror(errno));
+		h->data = MAP_FAILED;
+	}
+}
+
+/* called by GC */
+static void gcfree(void *ptr)
+{
+	rd_history_unmap(ptr);
+	xfree(ptr);
+}
+
+/* automatically called at creation (before initialize) */
+static VALUE alloc(VALUE klass)
+{
+	struct rd_history *h;
+	VALUE rv = Data_Make_Struct(klass, struct rd_history, NULL, gcfree, h);
+
+	h->data = MAP_FAILED;
+	return rv;
+}
+
+static struct rd_history *get(VALUE self)
+{
+	struct rd_history *h;
+
+	Data_Get_Struct(self, struct rd_history, h);
+
+	if (h->data == MAP_FAILED)
+		rb_raise(rb_eStandardError, "invalid or freed History");
+
+	return h;
+}
+
+void rd_history_map(struct rd_history *h, size_t capa)
+{
+	int tries = 1;
+	size_t len = offsetof(struct rd_history_data, recs);
+
+	if (capa == 0 || capa > (SIZE_MAX - len) / sizeof(struct rd_history_rec))
+		rb_raise(rb_eArgError, "invalid capacity: %lu",
+		         (unsigned long)capa);
+
+	len += capa * sizeof(struct rd_history_rec);
+	h->capa = capa;
+	h->len = (len + page_size - 1) & ~(page_size - 1);
+retry:
+	h->data = mmap(NULL, h->len,
+	               PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+	if (h->data == MAP_FAILED) {
+		if ((errno == EAGAIN || errno == ENOMEM) && tries-- > 0) {
+			rb_gc();
+			goto retry;
+		}
+		rb_sys_fail("mmap");
+	}
+}
+
+static void history_init(struct rd_history *h, size_t capa)
+{
+	if (h->data != MAP_FAILED)
+		rb_raise(rb_eRuntimeError, "already initialized");
+	rd_history_map(h, capa);
+}
+
+/*
+ * call-seq:
+ *	Raindrops::History.new(capacity)	-> history
+ *
+ * Creates a ring buffer in shared memory holding the last +capacity+
+ * samples.  Each sample takes 16 bytes, so 15 minutes of samples
+ * taken every 100 milliseconds (9000 samples) take about 144K.  Like
+ * Raindrops objects, it is shared with all processes forked afterwards.
+ */
+static VALUE init(VALUE self, VALUE capa)
+{
+	history_init(DATA_PTR(self), NUM2SIZET(capa));
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.dup	-> hist_copy
+ *
+ * Duplicates and snapshots the current state of a History object.
+ */
+static VALUE init_copy(VALUE dest, VALUE source)
+{
+	struct rd_history *dst = DATA_PTR(dest);
+	struct rd_history *src = get(source);
+
+	history_init(dst, src->capa);
+	memcpy(dst->data, src->data, src->len);
+
+	return dest;
+}
+
+/* Time or Numeric seconds => milliseconds since the Epoch */
+static uint64_t msec_arg(VALUE t)
+{
+	double sec;
+
+	if (rb_obj_is_kind_of(t, rb_cTime))
+		t = rb_funcall(t, id_to_f, 0);
+	sec = NUM2DBL(t);
+	if (sec < 0)
+		rb_raise(rb_eArgError, "time must not be before the Epoch");
+
+	return (uint64_t)(sec * 1000.0 + 0.5);
+}
+
+/*
+ * call-seq:
+ *	hist.record(active, queued[, time])	-> hist
+ *
+ * Appends a sample taken at +time+ (a Time or seconds since the Epoch,
+ * default: now), overwriting the oldest sample once the buffer is
+ * full.  This never blocks readers, but only one thread or process
+ * may record into a History at a time.
+ */
+static VALUE record(int argc, VALUE *argv, VALUE self)
+{
+	struct rd_history *h = get(self);
+	VALUE active, queued, t;
+	uint64_t msec;
+	uint32_t a, q;
+
+	rb_scan_args(argc, argv, "21", &active, &queued, &t);
+	msec = NIL_P(t) ? rd_history_now() : msec_arg(t);
+	a = NUM2UINT(active);
+	q = NUM2UINT(queued);
+	rd_history_record(h, msec, a, q);
+
+	return self;
+}
+
+/*
+ * copies the records taken in [since, until] into a new String.
+ * Records which may have been overwritten while they were being
+ * copied are dropped instead of retrying.
+ */
+static VALUE dump_range(struct rd_history *h, uint64_t since, uint64_t until)
+{
+	struct rd_history_rec *tmp, *dst;
+	unsigned long head, first, start, i;
+	VALUE buf;
+
+	head = h->data->head;
+	__sync_synchronize();
+	first = head > h->capa ? head - h->capa : 0;
+	buf = rb_str_new(NULL, (head - first) * sizeof(struct rd_history_rec));
+	tmp = (struct rd_history_rec *)RSTRING_PTR(buf);
+	for (i = first; i < head; i++)
+		tmp[i - first] = h->data->recs[i % h->capa];
+	__sync_synchronize();
+
+	/* writing record N overwrites record (N - capa) */
+	start = h->data->claimed;
+	start = start > h->capa ? start - h->capa : 0;
+	if (start < first)
+		start = first;
+
+	dst = tmp;
+	for (i = start; i < head; i++) {
+		const struct rd_history_rec *rec = &tmp[i - first];
+
+		if (rec->msec >= since && rec->msec <= until)
+			*dst++ = *rec;
+	}
+	rb_str_set_len(buf, (char *)dst - RSTRING_PTR(buf));
+
+	return buf;
+}
+
+/*
+ * call-seq:
+ *	hist.dump([options])	-> String
+ *
+ * Returns the samples currently in the buffer, oldest first, as a
+ * binary String of 16-byte records in native byte order:
+ *
+ *	uint64_t msec;   milliseconds since the Epoch
+ *	uint32_t active;
+ *	uint32_t queued;
+ *
+ * which may be unpacked with <tt>unpack("QLL" * n)</tt>.  +options+ is
+ * a hash that accepts the following keys:
+ *
+ * * :since - only return samples taken at or after this Time
+ * * :until - only return samples taken at or before this Time
+ *
+ * Both may also be given as seconds since the Epoch.  This does not
+ * lock out writers, samples overwritten while they were being read
+ * are left out of the result.
+ */
+static VALUE dump(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts;
+
+	rb_scan_args(argc, argv, "01", &opts);
+
+	return rd_history_dump(get(self), opts);
+}
+
+VALUE rd_history_dump(struct rd_history *h, VALUE opts)
+{
+	uint64_t since = 0, until = UINT64_MAX;
+	VALUE tmp;
+
+	if (!NIL_P(opts)) {
+		Check_Type(opts, T_HASH);
+		tmp = rb_hash_aref(opts, sym_since);
+		if (!NIL_P(tmp))
+			since = msec_arg(tmp);
+		tmp = rb_hash_aref(opts, sym_until);
+		if (!NIL_P(tmp))
+			until = msec_arg(tmp);
+	}
+
+	return dump_range(h, since, until);
+}
+
+/*
+ * call-seq:
+ *	hist.each([options]) { |time, active, queued| ... }	-> hist
+ *
+ * Yields every sample returned by +dump+ with +options+, +time+ is
+ * a Float of seconds since the Epoch.
+ */
+static VALUE each(int argc, VALUE *argv, VALUE self)
+{
+	VALUE buf = dump(argc, argv, self);
+	const struct rd_history_rec *rec, *end;
+
+	rec = (const struct rd_history_rec *)RSTRING_PTR(buf);
+	end = rec + RSTRING_LEN(buf) / sizeof(struct rd_history_rec);
+	for (; rec < end; rec++)
+		rb_yield_values(3, rb_float_new((double)rec->msec / 1000.0),
+		                UINT2NUM(rec->active), UINT2NUM(rec->queued));
+	RB_GC_GUARD(buf);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	hist.capacity	-> Integer
+ *
+ * Returns the maximum number of samples kept
+ */
+static VALUE capacity(VALUE self)
+{
+	return SIZET2NUM(get(self)->capa);
+}
+
+/*
+ * call-seq:
+ *	hist.size	-> Integer
+ *
+ * Returns the number of samples currently in the buffer
+ */
+static VALUE size(VALUE self)
+{
+	struct rd_history *h = get(self);
+	unsigned long head = h->data->head;
+
+	return ULONG2NUM(head > h->capa ? h->capa : head);
+}
+
+/*
+ * call-seq:
+ *	hist.count	-> Integer
+ *
+ * Returns the number of samples ever recorded, including the ones
+ * which were overwritten
+ */
+static VALUE count(VALUE self)
+{
+	return ULONG2NUM(get(self)->data->head);
+}
+
+void Init_raindrops_history(void)
+{
+	VALUE cRaindrops = rb_const_get(rb_cObject, rb_intern("Raindrops"));
+	VALUE cHistory;
+
+	page_size = getpagesize();
+	sym_since = ID2SYM(rb_intern("since"));
+	sym_until = ID2SYM(rb_intern("until"));
+	id_to_f = rb_intern("to_f");
+
+	/*
+	 * Document-class: Raindrops::History
+	 *
+	 * A fixed-size ring buffer of timestamped (active, queued)
+	 * samples stored in shared memory.  One writer appends samples
+	 * without locking and any number of readers in any process
+	 * sharing it may query time ranges without blocking the writer.
+	 *
+	 *   hist = Raindrops::History.new(9000)
+	 *   hist.record(stats.active, stats.queued)
+	 *   hist.each(:since => Time.now - 30) { |time, active, queued| }
+	 *
+	 * Raindrops::Watcher keeps one for every listener and serves
+	 * them at "/history/$LISTENER.csv".
+	 */
+	cHistory = rb_define_class_under(cRaindrops, "History", rb_cObject);
+	rb_define_alloc_func(cHistory, alloc);
+
+	/* size of each record returned by Raindrops::History#dump */
+	rb_define_const(cHistory, "RECORD_SIZE",
+	                SIZET2NUM(sizeof(struct rd_history_rec)));
+
+	rb_define_method(cHistory, "initialize", init, 1);
+	rb_define_method(cHistory, "initialize_copy", init_copy, 1);
+	rb_define_method(cHistory, "record", record, -1);
+	rb_define_method(cHistory, "dump", dump, -1);
+	rb_define_method(cHistory, "each", each, -1);
+	rb_define_method(cHistory, "capacity", capacity, 0);
+	rb_define_method(cHistory, "size", size, 0);
+	rb_define_method(cHistory, "count", count, 0);
+}
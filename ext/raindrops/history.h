@@ -0,0 +1,71 @@
+/*
+ * ring buffer of (time, active, queued) samples stored in shared
+ * memory, used by Raindrops::History and by Raindrops::Linux::Sampler
+ * which records into it from a thread that never takes the GVL.
+ */
+#include <ruby.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* one sample, this is also the format returned by History#dump */
+struct rd_history_rec {
+	uint64_t msec; /* milliseconds since the Epoch */
+	uint32_t active;
+	uint32_t queued;
+};
+
+/* everything here lives in a MAP_SHARED region */
+struct rd_history_data {
+	unsigned long head; /* number of records ever written */
+	unsigned long claimed; /* head + 1 while a record is being written */
+	struct rd_history_rec recs[1]; /* actually rd_history->capa */
+};
+
+struct rd_history {
+	size_t capa;
+	size_t len; /* bytes mapped at data */
+	struct rd_history_data *data; /* MAP_FAILED if unmapped */
+};
+
+/* maps room for +capa+ records at h->data, raises on failure */
+void rd_history_map(struct rd_history *h, size_t capa);
+
+/* unmaps h->data, if it is mapped */
+void rd_history_unmap(struct rd_history *h);
+
+/* History#dump for +h+, +opts+ may be nil */
+VALUE rd_history_dump(struct rd_history *h, VALUE opts);
+
+static inline uint64_t rd_history_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000 + (uint64_t)(tv.tv_usec / 1000);
+}
+
+/*
+ * appends a sample, overwriting the oldest one once the buffer is full.
+ * Readers are never blocked, but there may only be one writer at a time.
+ * This does not touch any Ruby objects and may be called without the GVL.
+ */
+static inline void
+rd_history_record(struct rd_history *h, uint64_t msec,
+                  uint32_t active, uint32_t queued)
+{
+	unsigned long head = h->data->head;
+	struct rd_history_rec *rec;
+
+	h->data->claimed = head + 1;
+	__sync_synchronize();
+	rec = &h->data->recs[head % h->capa];
+	rec->msec = msec;
+	rec->active = active;
+	rec->queued = queued;
+
+	/* publish the record only after it is completely written */
+	__sync_synchronize();
+	h->data->head = head + 1;
+}
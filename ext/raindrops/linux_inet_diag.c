@@ -6,11 +6,25 @@
 #endif
 #include "my_fileno.h"
 #ifdef __linux__
+#include "histogram.h"
+#include "history.h"
 
 /* Ruby 1.8.6+ macros (for compatibility with Ruby 1.9) */
 #ifndef RSTRING_LEN
 #  define RSTRING_LEN(s) (RSTRING(s)->len)
 #endif
+#ifndef SIZET2NUM
+#  define SIZET2NUM(x) ULONG2NUM(x)
+#endif
+#ifndef NUM2SIZET
+#  define NUM2SIZET(x) NUM2ULONG(x)
+#endif
+#ifndef RB_GC_GUARD
+#  define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+#ifndef HAVE_TYPE_ST_INDEX_T
+typedef int st_index_t;
+#endif
 
 /* partial emulation of the 1.9 rb_thread_blocking_region under 1.8 */
 #ifndef HAVE_RB_THREAD_BLOCKING_REGION
@@ -40,6 +54,8 @@ rb_thread_blocking_region(
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -53,6 +69,21 @@ rb_thread_blocking_region(
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/inet_diag.h>
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+#  include <sys/un.h>
+#  include <sys/stat.h>
+#  include <sys/sysmacros.h>
+#  include <linux/sock_diag.h>
+#  include <linux/unix_diag.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#  include <stddef.h>
+#  include <pthread.h>
+#  include <sched.h>
+#  include <signal.h>
+#  include <sys/mman.h>
+#  include <sys/timerfd.h>
+#endif
 
 union any_addr {
 	struct sockaddr_storage ss;
@@ -63,8 +94,22 @@ union any_addr {
 
 static size_t page_size;
 static unsigned g_seq;
-static VALUE cListenStats, cIDSock;
-static ID id_new;
+static VALUE cListenStats, cQueueAges, cIDSock;
+static ID id_new, id_nl_buf;
+
+/*
+ * netlink dumps are sent as one datagram per recvmsg() call and the
+ * kernel sizes each datagram based on our previous recvmsg() buffer
+ * size, capped at 32K (see max_recvmsg_len in net/netlink/af_netlink.c)
+ */
+#define NL_BUF_DEFAULT 32768
+
+/* persistent buffer for netlink I/O, owned by each InetDiagSocket */
+struct nl_buf {
+	size_t len;
+	size_t accounted; /* bytes reported to GC, see nl_buf_account */
+	void *ptr; /* malloc()-ed so it may be grown without the GVL */
+};
 
 struct listen_stats {
 	uint32_t active;
@@ -72,15 +117,70 @@ struct listen_stats {
 	uint32_t queued:31;
 };
 
+/* binary key for the tcp_listener_stats table, compared with memcmp() */
+struct listen_key {
+	uint32_t addr[4]; /* network byte order, zero-padded for IPv4 */
+	uint16_t port; /* network byte order */
+	uint16_t family;
+};
+
+/* an address to filter for, +lo+ and +hi+ are in host byte order */
+struct addr_filter {
+	union any_addr addr;
+	uint16_t lo;
+	uint16_t hi;
+	int range; /* given as "addr:lo-hi" */
+};
+
+/* passed to st_AND_hash via st_foreach() */
+struct and_args {
+	VALUE hash;
+	const struct addr_filter *filters;
+	long nr;
+};
+
 #define OPLEN (sizeof(struct inet_diag_bc_op) + \
 	       sizeof(struct inet_diag_hostcond) + \
 	       sizeof(struct sockaddr_storage))
 
+/* packed records gathered without the GVL for tcp_info_dump */
+struct rec_buf {
+	char *ptr; /* malloc()-ed */
+	size_t len;
+	size_t capa;
+	int enomem;
+};
+
+/* accept queue entry (or listener) seen by tcp_listener_queue_ages */
+struct age_rec {
+	struct listen_key key;
+	uint32_t age; /* milliseconds */
+	uint32_t listener_p;
+};
+
+/*
+ * "struct tcp_info" records returned by tcp_info_dump, these are sized
+ * by linux_tcp_info.c which uses the (larger) kernel headers
+ */
+extern const size_t rd_tcpi_len;
+#define TCPI_LEN rd_tcpi_len
+
+struct nogvl_args;
+typedef void (*nl_acc_fn)(struct nogvl_args *, struct nlmsghdr *);
+
 struct nogvl_args {
 	st_table *table;
+	struct nl_buf *buf;
+	struct rec_buf *out;
 	struct iovec iov[3]; /* last iov holds inet_diag bytecode */
 	struct listen_stats stats;
+	nl_acc_fn acc;
+	uint32_t states; /* TCPF_* bitmask of sockets to dump */
+	unsigned char ext; /* INET_DIAG_* extensions to request */
 	int fd;
+	int filter; /* only update existing table entries (unix_diag) */
+	struct unix_path *paths; /* unix_diag */
+	long nr_paths;
 };
 
 #ifdef SOCK_CLOEXEC
@@ -98,21 +198,134 @@ static VALUE FORCE_CLOEXEC(VALUE io)
 }
 #endif
 
+static void nl_buf_free(void *ptr)
+{
+	struct nl_buf *b = ptr;
+
+	free(b->ptr);
+	xfree(b);
+}
+
+static size_t nl_buf_memsize(const void *ptr)
+{
+	const struct nl_buf *b = ptr;
+
+	return sizeof(struct nl_buf) + b->len;
+}
+
+static const rb_data_type_t nl_buf_type = {
+	"raindrops_nl_buf",
+	{ NULL, nl_buf_free, nl_buf_memsize, },
+};
+
+/*
+ * tells GC about the malloc()-ed buffer, including any growth which
+ * happened in nl_buf_fit without the GVL
+ */
+static void nl_buf_account(struct nl_buf *b)
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+	rb_gc_adjust_memory_usage((ssize_t)b->len - (ssize_t)b->accounted);
+#endif
+	b->accounted = b->len;
+}
+
+static struct nl_buf *nl_buf_attach(VALUE sock, size_t len)
+{
+	struct nl_buf *b;
+	VALUE tmp = TypedData_Make_Struct(rb_cObject, struct nl_buf,
+	                                  &nl_buf_type, b);
+
+	if (len < page_size)
+		len = page_size;
+	b->ptr = malloc(len);
+	if (b->ptr == NULL)
+		rb_memerror();
+	b->len = len;
+	nl_buf_account(b);
+	rb_ivar_set(sock, id_nl_buf, tmp);
+
+	return b;
+}
+
+/* returns the buffer of +sock+, attaching one if it has none yet */
+static struct nl_buf *nl_buf_get(VALUE sock)
+{
+	VALUE tmp = rb_attr_get(sock, id_nl_buf);
+	struct nl_buf *b;
+
+	if (NIL_P(tmp))
+		return nl_buf_attach(sock, NL_BUF_DEFAULT);
+	TypedData_Get_Struct(tmp, struct nl_buf, &nl_buf_type, b);
+	return b;
+}
+
+/*
+ * closes a socket we created for a single call, releasing its buffer
+ * right away instead of leaving it for GC
+ */
+static void nl_close(VALUE sock)
+{
+	VALUE tmp = rb_attr_get(sock, id_nl_buf);
+
+	if (!NIL_P(tmp)) {
+		struct nl_buf *b;
+
+		TypedData_Get_Struct(tmp, struct nl_buf, &nl_buf_type, b);
+		free(b->ptr);
+		b->ptr = NULL;
+		b->len = 0;
+		nl_buf_account(b);
+		rb_ivar_set(sock, id_nl_buf, Qnil);
+	}
+	rb_io_close(sock);
+}
+
 /*
  * call-seq:
- *	Raindrops::InetDiagSocket.new	-> Socket
+ *	Raindrops::InetDiagSocket.new([buffer_size])	-> Socket
  *
- * Creates a new Socket object for the netlink inet_diag facility
+ * Creates a new Socket object for the netlink inet_diag facility.
+ *
+ * Each socket owns a buffer of +buffer_size+ bytes (default: 32768)
+ * which is reused by every call made with it, so reusing a socket
+ * avoids allocating memory for each sample.  Larger buffers allow the
+ * kernel to send more sockets per recvmsg(2) call, but current kernels
+ * will not fill more than 32K at once.  The buffer is grown as needed.
  */
-static VALUE ids_s_new(VALUE klass)
+static VALUE ids_s_new(int argc, VALUE *argv, VALUE klass)
 {
-	VALUE argv[3];
+	VALUE args[3], rv, bufsize;
+	size_t len;
+	int rcvbuf;
+
+	rb_scan_args(argc, argv, "01", &bufsize);
+	len = NIL_P(bufsize) ? NL_BUF_DEFAULT : NUM2SIZET(bufsize);
+
+	args[0] = INT2NUM(AF_NETLINK);
+	args[1] = INT2NUM(my_SOCK_RAW);
+	args[2] = INT2NUM(NETLINK_INET_DIAG);
+
+	rv = FORCE_CLOEXEC(rb_call_super(3, args));
+	nl_buf_attach(rv, len);
 
-	argv[0] = INT2NUM(AF_NETLINK);
-	argv[1] = INT2NUM(my_SOCK_RAW);
-	argv[2] = INT2NUM(NETLINK_INET_DIAG);
+	/* ensure a full dump datagram fits, failure here is harmless */
+	rcvbuf = len > INT_MAX / 4 ? INT_MAX / 2 : (int)len * 2;
+	(void)setsockopt(my_fileno(rv), SOL_SOCKET, SO_RCVBUF,
+	                 &rcvbuf, sizeof(rcvbuf));
 
-	return FORCE_CLOEXEC(rb_call_super(3, argv));
+	return rv;
+}
+
+/*
+ * call-seq:
+ *	sock.buffer_size	-> Integer
+ *
+ * Returns the size of the netlink buffer owned by this socket
+ */
+static VALUE ids_buffer_size(VALUE self)
+{
+	return SIZET2NUM(nl_buf_get(self)->len);
 }
 
 /* creates a Ruby ListenStats Struct based on our internal listen_stats */
@@ -132,12 +345,65 @@ static int st_free_data(st_data_t key, st_data_t value, st_data_t ignored)
 	return ST_DELETE;
 }
 
-static int st_to_hash(st_data_t key, st_data_t value, VALUE hash)
+static int listen_key_cmp(st_data_t a, st_data_t b)
+{
+	return memcmp((void *)a, (void *)b, sizeof(struct listen_key));
+}
+
+/* FNV-1a, keys are small and hashed once per socket in a dump */
+static st_index_t listen_key_hash(st_data_t a)
+{
+	const unsigned char *p = (const unsigned char *)a;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(struct listen_key); i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
+	return (st_index_t)h;
+}
+
+static const struct st_hash_type listen_key_type = {
+	listen_key_cmp,
+	listen_key_hash,
+};
+
+static void bug_warn(void)
+{
+	fprintf(stderr, "Please report how you produced this at "\
+	                "raindrops@librelist.org\n");
+	fflush(stderr);
+}
+
+/* formats +key+ the same way tcp_listener_stats expects its input */
+static VALUE listen_key_str(const struct listen_key *key)
+{
+	char buf[1 + INET6_ADDRSTRLEN + sizeof("]:65535")];
+	char *host = buf;
+	size_t n;
+
+	if (key->family == AF_INET6)
+		*host++ = '[';
+	if (!inet_ntop(key->family, key->addr, host, INET6_ADDRSTRLEN)) {
+		fprintf(stderr, "BUG: inet_ntop: %s\n", strerror(errno));
+		bug_warn();
+		*host = 0;
+	}
+	n = strlen(buf);
+	if (key->family == AF_INET6)
+		buf[n++] = ']';
+	snprintf(buf + n, sizeof(buf) - n, ":%u", ntohs(key->port));
+
+	return rb_str_new2(buf);
+}
+
+static int st_addr_to_hash(st_data_t key, st_data_t value, VALUE hash)
 {
 	struct listen_stats *stats = (struct listen_stats *)value;
 
 	if (stats->listener_p) {
-		VALUE k = rb_str_new2((const char *)key);
+		VALUE k = listen_key_str((struct listen_key *)key);
 		VALUE v = rb_listen_stats(stats);
 
 		OBJ_FREEZE(k);
@@ -146,135 +412,94 @@ static int st_to_hash(st_data_t key, st_data_t value, VALUE hash)
 	return st_free_data(key, value, 0);
 }
 
-static int st_AND_hash(st_data_t key, st_data_t value, VALUE hash)
+/* does listener +key+ fall in any of the port ranges we filtered for? */
+static int range_match(const struct and_args *a, const struct listen_key *key)
 {
-	struct listen_stats *stats = (struct listen_stats *)value;
+	uint16_t port = ntohs(key->port);
+	long i;
 
-	if (stats->listener_p) {
-		VALUE k = rb_str_new2((const char *)key);
+	for (i = 0; i < a->nr; i++) {
+		const struct addr_filter *f = &a->filters[i];
 
-		if (rb_hash_lookup(hash, k) == Qtrue) {
-			VALUE v = rb_listen_stats(stats);
-			OBJ_FREEZE(k);
-			rb_hash_aset(hash, k, v);
+		if (!f->range || f->addr.ss.ss_family != key->family ||
+		    port < f->lo || port > f->hi)
+			continue;
+		if (key->family == AF_INET) {
+			uint32_t addr = f->addr.in.sin_addr.s_addr;
+
+			if (addr == 0 || addr == key->addr[0])
+				return 1;
+		} else {
+			const struct in6_addr *addr = &f->addr.in6.sin6_addr;
+
+			if (IN6_IS_ADDR_UNSPECIFIED(addr) ||
+			    memcmp(addr, key->addr, sizeof(*addr)) == 0)
+				return 1;
 		}
 	}
-	return st_free_data(key, value, 0);
+	return 0;
 }
 
-static const char *addr_any(sa_family_t family)
+static int st_AND_hash(st_data_t key, st_data_t value, st_data_t arg)
 {
-	static const char ipv4[] = "0.0.0.0";
-	static const char ipv6[] = "[::]";
-
-	if (family == AF_INET)
-		return ipv4;
-	assert(family == AF_INET6 && "unknown family");
-	return ipv6;
-}
+	struct listen_stats *stats = (struct listen_stats *)value;
+	struct and_args *a = (struct and_args *)arg;
 
-static void bug_warn(void)
-{
-	fprintf(stderr, "Please report how you produced this at "\
-	                "raindrops@librelist.org\n");
-	fflush(stderr);
-}
+	if (stats->listener_p) {
+		VALUE k = listen_key_str((struct listen_key *)key);
 
-static struct listen_stats *stats_for(st_table *table, struct inet_diag_msg *r)
-{
-	char *key, *port, *old_key;
-	size_t alloca_len;
-	struct listen_stats *stats;
-	size_t keylen;
-	size_t portlen = sizeof("65535");
-	union any_addr sa = { 0 };
-	socklen_t len = sizeof(struct sockaddr_storage);
-	int rc;
-	int flags = NI_NUMERICHOST | NI_NUMERICSERV;
-
-	switch ((sa.ss.ss_family = r->idiag_family)) {
-	case AF_INET: {
-		sa.in.sin_port = r->id.idiag_sport;
-		sa.in.sin_addr.s_addr = r->id.idiag_src[0];
-		keylen = INET_ADDRSTRLEN;
-		alloca_len = keylen + 1 + portlen;
-		key = alloca(alloca_len);
-		key[keylen] = 0; /* will be ':' later */
-		port = key + keylen + 1;
-		rc = getnameinfo(&sa.sa, len,
-				 key, keylen, port, portlen, flags);
-		break;
-		}
-	case AF_INET6: {
-		sa.in6.sin6_port = r->id.idiag_sport;
-		memcpy(&sa.in6.sin6_addr, &r->id.idiag_src, sizeof(__be32[4]));
-		keylen = INET6_ADDRSTRLEN;
-		          /* [            ] */
-		alloca_len = 1 + keylen + 1 + 1 + portlen;
-		key = alloca(alloca_len);
-		*key = '[';
-		key[1 + keylen + 1] = 0; /* will be ':' later */
-		port = 1 + key + keylen + 1 + 1;
-		rc = getnameinfo(&sa.sa, len,
-				 key + 1, keylen, port, portlen, flags);
-		break;
+		if (rb_hash_lookup(a->hash, k) == Qtrue ||
+		    range_match(a, (struct listen_key *)key)) {
+			VALUE v = rb_listen_stats(stats);
+			OBJ_FREEZE(k);
+			rb_hash_aset(a->hash, k, v);
 		}
-	default:
-		assert(0 && "unsupported address family, could that be IPv7?!");
 	}
-	if (rc != 0) {
-		fprintf(stderr, "BUG: getnameinfo: %s\n", gai_strerror(rc));
-		bug_warn();
-		*key = 0;
-	}
-
-	keylen = strlen(key);
-	portlen = strlen(port);
+	return st_free_data(key, value, 0);
+}
 
-	switch (sa.ss.ss_family) {
+static void listen_key_init(struct listen_key *key, struct inet_diag_msg *r)
+{
+	memset(key, 0, sizeof(struct listen_key));
+	key->family = r->idiag_family;
+	key->port = r->id.idiag_sport;
+	switch (r->idiag_family) {
 	case AF_INET:
-		key[keylen] = ':';
-		memmove(key + keylen + 1, port, portlen + 1);
+		key->addr[0] = r->id.idiag_src[0];
 		break;
 	case AF_INET6:
-		key[keylen] = ']';
-		key[keylen + 1] = ':';
-		memmove(key + keylen + 2, port, portlen + 1);
-		keylen++;
+		memcpy(key->addr, r->id.idiag_src, sizeof(key->addr));
 		break;
 	default:
 		assert(0 && "unsupported address family, could that be IPv7?!");
 	}
+}
 
-	if (st_lookup(table, (st_data_t)key, (st_data_t *)&stats))
-		return stats;
+/*
+ * this is called for every socket in the dump, so no string formatting
+ * happens here: the table is keyed on the raw address and port and
+ * listen_key_str() is only called once per listener afterwards
+ */
+static struct listen_stats *stats_for(st_table *table, struct inet_diag_msg *r)
+{
+	struct listen_key key, *k;
+	struct listen_stats *stats;
 
-	old_key = key;
+	listen_key_init(&key, r);
+	if (st_lookup(table, (st_data_t)&key, (st_data_t *)&stats))
+		return stats;
 
+	/* accepted from a listener bound to 0.0.0.0 or [::] */
 	if (r->idiag_state == TCP_ESTABLISHED) {
-		int n = snprintf(key, alloca_len, "%s:%u",
-				 addr_any(sa.ss.ss_family),
-				 ntohs(r->id.idiag_sport));
-		if (n <= 0) {
-			fprintf(stderr, "BUG: snprintf: %d\n", n);
-			bug_warn();
-		}
-		if (st_lookup(table, (st_data_t)key, (st_data_t *)&stats))
+		memset(key.addr, 0, sizeof(key.addr));
+		if (st_lookup(table, (st_data_t)&key, (st_data_t *)&stats))
 			return stats;
-		if (n <= 0) {
-			key = xmalloc(1);
-			*key = '\0';
-		} else {
-			old_key = key;
-			key = xmalloc(n + 1);
-			memcpy(key, old_key, n + 1);
-		}
-	} else {
-		key = xmalloc(keylen + 1 + portlen + 1);
-		memcpy(key, old_key, keylen + 1 + portlen + 1);
 	}
+
+	k = xmalloc(sizeof(struct listen_key));
+	memcpy(k, &key, sizeof(struct listen_key));
 	stats = xcalloc(1, sizeof(struct listen_stats));
-	st_insert(table, (st_data_t)key, (st_data_t)stats);
+	st_insert(table, (st_data_t)k, (st_data_t)stats);
 	return stats;
 }
 
@@ -292,8 +517,10 @@ static void table_set_queued(st_table *table, struct inet_diag_msg *r)
 }
 
 /* inner loop of inet_diag, called for every socket returned by netlink */
-static inline void r_acc(struct nogvl_args *args, struct inet_diag_msg *r)
+static void r_acc(struct nogvl_args *args, struct nlmsghdr *h)
 {
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+
 	/*
 	 * inode == 0 means the connection is still in the listen queue
 	 * and has not yet been accept()-ed by the server.  The
@@ -317,6 +544,99 @@ static inline void r_acc(struct nogvl_args *args, struct inet_diag_msg *r)
 	 */
 }
 
+/* returns space for a +len+ byte record at the end of +out+ */
+static char *rec_buf_reserve(struct rec_buf *out, size_t len)
+{
+	char *dst;
+
+	if (out->len + len > out->capa) {
+		size_t capa = out->capa ? out->capa * 2 : 64 * len;
+		void *ptr = realloc(out->ptr, capa);
+
+		if (ptr == NULL) {
+			out->enomem = 1;
+			return NULL;
+		}
+		out->ptr = ptr;
+		out->capa = capa;
+	}
+	dst = out->ptr + out->len;
+	out->len += len;
+
+	return dst;
+}
+
+static struct rtattr *
+diag_attr(struct nlmsghdr *h, unsigned short type)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct rtattr *rta = (struct rtattr *)(r + 1);
+	int len = (int)(h->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == type)
+			return rta;
+	return NULL;
+}
+
+/* called for every connection returned by tcp_info_dump */
+static void info_acc(struct nogvl_args *args, struct nlmsghdr *h)
+{
+	struct rtattr *rta = diag_attr(h, INET_DIAG_INFO);
+	size_t n;
+	char *dst;
+
+	if (!rta || !(dst = rec_buf_reserve(args->out, TCPI_LEN)))
+		return;
+
+	/* older kernels send less, newer kernels send more */
+	n = RTA_PAYLOAD(rta);
+	if (n > TCPI_LEN)
+		n = TCPI_LEN;
+	memcpy(dst, RTA_DATA(rta), n);
+	memset(dst + n, 0, TCPI_LEN - n);
+}
+
+/*
+ * called for every socket returned by tcp_listener_queue_ages, this
+ * keeps the inode == 0 sockets r_acc() skips, they are the ones
+ * waiting in a listen queue
+ */
+static void age_acc(struct nogvl_args *args, struct nlmsghdr *h)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct age_rec *rec;
+
+	if (r->idiag_state == TCP_ESTABLISHED) {
+		struct rtattr *rta = diag_attr(h, INET_DIAG_INFO);
+		struct tcp_info *info;
+
+		if (r->idiag_inode != 0 || !rta ||
+		    RTA_PAYLOAD(rta) < sizeof(struct tcp_info))
+			return;
+		rec = (void *)rec_buf_reserve(args->out, sizeof(*rec));
+		if (!rec)
+			return;
+		listen_key_init(&rec->key, r);
+
+		/*
+		 * both timestamps start when the connection is established
+		 * and neither can be older than the connection itself
+		 */
+		info = RTA_DATA(rta);
+		rec->age = info->tcpi_last_data_recv > info->tcpi_last_ack_recv ?
+		           info->tcpi_last_data_recv : info->tcpi_last_ack_recv;
+		rec->listener_p = 0;
+	} else { /* if (r->idiag_state == TCP_LISTEN) */
+		rec = (void *)rec_buf_reserve(args->out, sizeof(*rec));
+		if (!rec)
+			return;
+		listen_key_init(&rec->key, r);
+		rec->age = 0;
+		rec->listener_p = 1;
+	}
+}
+
 static const char err_sendmsg[] = "sendmsg";
 static const char err_recvmsg[] = "recvmsg";
 static const char err_nlmsg[] = "nlmsg";
@@ -356,7 +676,8 @@ static void prep_diag_args(
 	req->nlh.nlmsg_type = TCPDIAG_GETSOCK;
 	req->nlh.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
 	req->nlh.nlmsg_pid = getpid();
-	req->r.idiag_states = (1<<TCP_ESTABLISHED) | (1<<TCP_LISTEN);
+	req->r.idiag_states = args->states;
+	req->r.idiag_ext = args->ext;
 	rta->rta_type = INET_DIAG_REQ_BYTECODE;
 	rta->rta_len = RTA_LENGTH(args->iov[2].iov_len);
 
@@ -370,30 +691,52 @@ static void prep_diag_args(
 
 static void prep_recvmsg_buf(struct nogvl_args *args)
 {
-	/* reuse buffer that was allocated for bytecode */
-	args->iov[0].iov_len = page_size;
-	args->iov[0].iov_base = args->iov[2].iov_base;
+	/* reuse buffer that was used for the request bytecode */
+	args->iov[0].iov_len = args->buf->len;
+	args->iov[0].iov_base = args->buf->ptr;
 }
 
-/* does the inet_diag stuff with netlink(), this is called w/o GVL */
-static VALUE diag(void *ptr)
+/*
+ * peeks at the size of the first datagram and grows our buffer if it
+ * would not fit.  The kernel sizes later datagrams of the same dump
+ * based on our buffer, so we only do this once per dump.
+ */
+static const char *nl_buf_fit(struct nogvl_args *args)
 {
-	struct nogvl_args *args = ptr;
-	struct sockaddr_nl nladdr;
-	struct rtattr rta;
-	struct diag_req req;
-	struct msghdr msg;
-	const char *err = NULL;
-	unsigned seq = ++g_seq;
-
-	prep_diag_args(args, &nladdr, &rta, &req, &msg);
-	req.nlh.nlmsg_seq = seq;
+	ssize_t n;
+	void *ptr;
+
+	do {
+		n = recv(args->fd, args->buf->ptr, args->buf->len,
+		         MSG_PEEK | MSG_TRUNC);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return err_recvmsg;
+	if ((size_t)n <= args->buf->len)
+		return NULL;
+
+	ptr = realloc(args->buf->ptr, (size_t)n);
+	if (ptr == NULL)
+		return err_recvmsg;
+	args->buf->ptr = ptr;
+	args->buf->len = (size_t)n;
+
+	return NULL;
+}
 
-	if (sendmsg(args->fd, &msg, 0) < 0) {
-		err = err_sendmsg;
-		goto out;
-	}
+/*
+ * reads netlink responses for +seq+ until NLMSG_DONE, calling +acc+
+ * for every message.  errno is set from NLMSG_ERROR responses.
+ */
+static const char *
+nl_recv(struct nogvl_args *args, struct sockaddr_nl *nladdr,
+        unsigned seq, nl_acc_fn acc)
+{
+	struct msghdr msg;
+	const char *err = nl_buf_fit(args);
 
+	if (err)
+		return err;
 	prep_recvmsg_buf(args);
 
 	while (1) {
@@ -401,41 +744,71 @@ static VALUE diag(void *ptr)
 		size_t r;
 		struct nlmsghdr *h = (struct nlmsghdr *)args->iov[0].iov_base;
 
-		prep_msghdr(&msg, args, &nladdr, 1);
+		prep_msghdr(&msg, args, nladdr, 1);
 		readed = recvmsg(args->fd, &msg, 0);
 		if (readed < 0) {
 			if (errno == EINTR)
 				continue;
-			err = err_recvmsg;
-			goto out;
+			return err_recvmsg;
 		}
 		if (readed == 0)
-			goto out;
+			return NULL;
+		if (msg.msg_flags & MSG_TRUNC) {
+			errno = EMSGSIZE;
+			return err_recvmsg;
+		}
 		r = (size_t)readed;
 		for ( ; NLMSG_OK(h, r); h = NLMSG_NEXT(h, r)) {
 			if (h->nlmsg_seq != seq)
 				continue;
 			if (h->nlmsg_type == NLMSG_DONE)
-				goto out;
+				return NULL;
 			if (h->nlmsg_type == NLMSG_ERROR) {
-				err = err_nlmsg;
-				goto out;
+				struct nlmsgerr *e = NLMSG_DATA(h);
+
+				errno = -e->error;
+				return err_nlmsg;
 			}
-			r_acc(args, NLMSG_DATA(h));
+			acc(args, h);
 		}
 	}
-out:
-	{
-		int save_errno = errno;
-		if (err && args->table) {
-			st_foreach(args->table, st_free_data, 0);
-			st_free_table(args->table);
-		}
-		errno = save_errno;
+}
+
+static VALUE diag_done(struct nogvl_args *args, const char *err)
+{
+	int save_errno = errno;
+
+	if (err && args->table) {
+		st_foreach(args->table, st_free_data, 0);
+		st_free_table(args->table);
 	}
+	errno = save_errno;
+
 	return (VALUE)err;
 }
 
+/* does the inet_diag stuff with netlink(), this is called w/o GVL */
+static VALUE diag(void *ptr)
+{
+	struct nogvl_args *args = ptr;
+	struct sockaddr_nl nladdr;
+	struct rtattr rta;
+	struct diag_req req;
+	struct msghdr msg;
+	const char *err;
+	unsigned seq = ++g_seq;
+
+	prep_diag_args(args, &nladdr, &rta, &req, &msg);
+	req.nlh.nlmsg_seq = seq;
+
+	if (sendmsg(args->fd, &msg, 0) < 0)
+		err = err_sendmsg;
+	else
+		err = nl_recv(args, &nladdr, seq, args->acc);
+
+	return diag_done(args, err);
+}
+
 /* populates sockaddr_storage struct by parsing +addr+ */
 static void parse_addr(union any_addr *inet, VALUE addr)
 {
@@ -507,66 +880,187 @@ static void gen_bytecode_all(struct iovec *iov)
 	cond->prefix_len = 0;
 }
 
-/* generates inet_diag bytecode to match a single addr */
-static void gen_bytecode(struct iovec *iov, union any_addr *inet)
+/* returns a pointer to the '-' of "addr:lo-hi", NULL if not a range */
+static const char *range_dash(VALUE addr)
 {
-	struct inet_diag_bc_op *op;
-	struct inet_diag_hostcond *cond;
+	const char *ptr = RSTRING_PTR(addr);
+	long len = RSTRING_LEN(addr);
+	const char *colon = memrchr(ptr, ':', len);
 
-	/* iov_len was already set and base allocated in a parent function */
-	assert(iov->iov_len == OPLEN && iov->iov_base && "iov invalid");
-	op = iov->iov_base;
-	op->code = INET_DIAG_BC_S_COND;
-	op->yes = OPLEN;
-	op->no = sizeof(struct inet_diag_bc_op) + OPLEN;
+	if (!colon)
+		return NULL;
+	return memchr(colon, '-', len - (colon - ptr));
+}
 
-	cond = (struct inet_diag_hostcond *)(op + 1);
-	cond->family = inet->ss.ss_family;
-	switch (inet->ss.ss_family) {
-	case AF_INET: {
-		cond->port = ntohs(inet->in.sin_port);
-		cond->prefix_len = inet->in.sin_addr.s_addr == 0 ? 0 :
-				   sizeof(inet->in.sin_addr.s_addr) * CHAR_BIT;
-		*cond->addr = inet->in.sin_addr.s_addr;
-		}
-		break;
-	case AF_INET6: {
-		cond->port = ntohs(inet->in6.sin6_port);
-		cond->prefix_len = memcmp(&in6addr_any, &inet->in6.sin6_addr,
-				          sizeof(struct in6_addr)) == 0 ?
-				  0 : sizeof(inet->in6.sin6_addr) * CHAR_BIT;
-		memcpy(&cond->addr, &inet->in6.sin6_addr,
-		       sizeof(struct in6_addr));
-		}
-		break;
-	default:
-		assert(0 && "unsupported address family, could that be IPv7?!");
-	}
+static uint16_t addr_port(const union any_addr *inet)
+{
+	return ntohs(inet->ss.ss_family == AF_INET ?
+	             inet->in.sin_port : inet->in6.sin6_port);
 }
 
-static void nl_errcheck(VALUE r)
+/* parses "addr:port" or "addr:lo-hi" into +f+ */
+static void parse_filter(struct addr_filter *f, VALUE addr)
 {
-	const char *err = (const char *)r;
+	const char *dash;
+	char *check;
+	unsigned long hi;
 
-	if (err) {
-		if (err == err_nlmsg)
-			rb_raise(rb_eRuntimeError, "NLMSG_ERROR");
-		else
-			rb_sys_fail(err);
+	Check_Type(addr, T_STRING);
+	dash = range_dash(addr);
+	if (!dash) {
+		parse_addr(&f->addr, addr);
+		f->lo = f->hi = addr_port(&f->addr);
+		f->range = 0;
+		return;
 	}
+
+	parse_addr(&f->addr, rb_str_new(RSTRING_PTR(addr),
+	                                 dash - RSTRING_PTR(addr)));
+	hi = strtoul(dash + 1, &check, 10);
+	if (dash[1] == 0 || *check || ((uint16_t)hi != hi))
+		rb_raise(rb_eArgError, "invalid port: %s", dash + 1);
+	f->lo = addr_port(&f->addr);
+	f->hi = (uint16_t)hi;
+	if (f->lo > f->hi)
+		rb_raise(rb_eArgError, "invalid port range: %u-%u",
+		         f->lo, f->hi);
+	f->range = 1;
 }
 
-static VALUE tcp_stats(struct nogvl_args *args, VALUE addr)
+static size_t cond_len(const struct addr_filter *f)
 {
-	union any_addr query_addr;
-
-	parse_addr(&query_addr, addr);
-	gen_bytecode(&args->iov[2], &query_addr);
-
-	memset(&args->stats, 0, sizeof(struct listen_stats));
-	nl_errcheck(rb_thread_io_blocking_region(diag, args, args->fd));
+	return sizeof(struct inet_diag_bc_op) +
+	       sizeof(struct inet_diag_hostcond) +
+	       (f->addr.ss.ss_family == AF_INET ?
+	        sizeof(struct in_addr) : sizeof(struct in6_addr));
+}
 
-	return rb_listen_stats(&args->stats);
+/* ports are compared against the "no" field of the following op */
+static struct inet_diag_bc_op *
+port_op(struct inet_diag_bc_op *op, unsigned char code, uint16_t port,
+        size_t fail)
+{
+	op->code = code;
+	op->yes = 2 * sizeof(struct inet_diag_bc_op);
+	op->no = (unsigned short)fail;
+	op[1].code = INET_DIAG_BC_NOP;
+	op[1].yes = sizeof(struct inet_diag_bc_op);
+	op[1].no = port;
+
+	return op + 2;
+}
+
+/*
+ * generates inet_diag bytecode matching any of the +nr+ filters, so the
+ * kernel only sends us the sockets we are interested in.  Each filter
+ * compiles to:
+ *
+ *	[S_GE lo] [S_LE hi]	(port ranges only, "no" goes to the next filter)
+ *	S_COND addr:port	("no" goes to the next filter)
+ *	JMP			(to the end of the bytecode, accepting the socket)
+ *
+ * "yes" offsets are only 8 bits wide, so the long jump to the end of
+ * the bytecode has to go through the 16-bit "no" offset of a JMP op.
+ * The last filter fails by jumping past the end.
+ */
+static void gen_bytecode(struct nogvl_args *args,
+                         const struct addr_filter *filters, long nr)
+{
+	const size_t op_len = sizeof(struct inet_diag_bc_op);
+	size_t len = 0, off = 0;
+	char *bc;
+	long i;
+
+	for (i = 0; i < nr; i++)
+		len += (filters[i].range ? 4 * op_len : 0) +
+		       cond_len(&filters[i]) + op_len;
+	if (len > USHRT_MAX - RTA_LENGTH(0) - op_len)
+		rb_raise(rb_eArgError, "too many addresses to filter for");
+	if (len > args->buf->len) {
+		void *ptr = realloc(args->buf->ptr, len);
+
+		if (ptr == NULL)
+			rb_memerror();
+		args->buf->ptr = ptr;
+		args->buf->len = len;
+	}
+
+	bc = args->buf->ptr;
+	for (i = 0; i < nr; i++) {
+		const struct addr_filter *f = &filters[i];
+		size_t next = off + (f->range ? 4 * op_len : 0) +
+		              cond_len(f) + op_len;
+		size_t fail = i == nr - 1 ? len + op_len : next;
+		struct inet_diag_bc_op *op = (void *)(bc + off);
+		struct inet_diag_hostcond *cond;
+
+		if (f->range) {
+			op = port_op(op, INET_DIAG_BC_S_GE, f->lo, fail - off);
+			op = port_op(op, INET_DIAG_BC_S_LE, f->hi,
+			             fail - off - 2 * op_len);
+			off += 4 * op_len;
+		}
+
+		op->code = INET_DIAG_BC_S_COND;
+		op->yes = (unsigned char)cond_len(f);
+		op->no = (unsigned short)(fail - off);
+		cond = (struct inet_diag_hostcond *)(op + 1);
+		cond->family = f->addr.ss.ss_family;
+		cond->port = f->range ? -1 : f->lo;
+		switch (f->addr.ss.ss_family) {
+		case AF_INET:
+			cond->prefix_len = f->addr.in.sin_addr.s_addr == 0 ?
+			        0 : sizeof(struct in_addr) * CHAR_BIT;
+			*cond->addr = f->addr.in.sin_addr.s_addr;
+			break;
+		case AF_INET6:
+			cond->prefix_len = IN6_IS_ADDR_UNSPECIFIED(
+			                         &f->addr.in6.sin6_addr) ?
+			        0 : sizeof(struct in6_addr) * CHAR_BIT;
+			memcpy(&cond->addr, &f->addr.in6.sin6_addr,
+			       sizeof(struct in6_addr));
+			break;
+		default:
+			assert(0 && "unsupported address family, could that be IPv7?!");
+		}
+		off += cond_len(f);
+
+		op = (void *)(bc + off);
+		op->code = INET_DIAG_BC_JMP;
+		op->yes = op_len;
+		op->no = (unsigned short)(len - off);
+		off += op_len;
+		assert(off == next && "bytecode length mismatch");
+	}
+
+	args->iov[2].iov_base = bc;
+	args->iov[2].iov_len = len;
+}
+
+static void nl_errcheck(VALUE r)
+{
+	const char *err = (const char *)r;
+
+	if (err) {
+		if (err == err_nlmsg)
+			rb_raise(rb_eRuntimeError, "NLMSG_ERROR");
+		else
+			rb_sys_fail(err);
+	}
+}
+
+static VALUE tcp_stats(struct nogvl_args *args, VALUE addr)
+{
+	struct addr_filter f;
+
+	parse_filter(&f, addr);
+	gen_bytecode(args, &f, 1);
+
+	memset(&args->stats, 0, sizeof(struct listen_stats));
+	nl_errcheck(rb_thread_io_blocking_region(diag, args, args->fd));
+	nl_buf_account(args->buf);
+
+	return rb_listen_stats(&args->stats);
 }
 
 /*
@@ -579,6 +1073,14 @@ static VALUE tcp_stats(struct nogvl_args *args, VALUE addr)
  *
  *      addrs = %w(0.0.0.0:80 127.0.0.1:8080)
  *
+ * Addresses may also specify an inclusive port range, every listener
+ * in the range is then returned under its own address:
+ *
+ *      addrs = %w(0.0.0.0:8000-8099 [::]:8000-8099)
+ *
+ * All addresses are filtered for by the kernel, so only the sockets
+ * asked about are transferred regardless of how busy the system is.
+ *
  * If +addr+ is nil or not specified, all (IPv4) addresses are returned.
  * If +sock+ is specified, it should be a Raindrops::InetDiagSock object.
  */
@@ -588,42 +1090,65 @@ static VALUE tcp_listener_stats(int argc, VALUE *argv, VALUE self)
 	long i;
 	VALUE rv = rb_hash_new();
 	struct nogvl_args args;
-	VALUE addrs, sock;
+	struct and_args and_args;
+	struct addr_filter *filters;
+	VALUE addrs, sock, tmp = Qnil;
 
 	rb_scan_args(argc, argv, "02", &addrs, &sock);
 
-	/*
-	 * allocating page_size instead of OP_LEN since we'll reuse the
-	 * buffer for recvmsg() later, we already checked for
-	 * OPLEN <= page_size at initialization
-	 */
-	args.iov[2].iov_len = OPLEN;
-	args.iov[2].iov_base = alloca(page_size);
 	args.table = NULL;
+	args.filter = 0;
+	args.acc = r_acc;
+	args.states = (1<<TCP_ESTABLISHED) | (1<<TCP_LISTEN);
+	args.ext = 0;
 	if (NIL_P(sock))
 		sock = rb_funcall(cIDSock, id_new, 0);
 	args.fd = my_fileno(sock);
 
+	/*
+	 * the bytecode lives in the socket buffer since it is sent before
+	 * we reuse the buffer for recvmsg(), the buffer is never smaller
+	 * than page_size and we already checked for OPLEN <= page_size
+	 * at initialization
+	 */
+	args.buf = nl_buf_get(sock);
+	args.iov[2].iov_len = OPLEN;
+	args.iov[2].iov_base = args.buf->ptr;
+
 	switch (TYPE(addrs)) {
 	case T_STRING:
-		rb_hash_aset(rv, addrs, tcp_stats(&args, addrs));
-		return rv;
+		if (!range_dash(addrs)) {
+			rb_hash_aset(rv, addrs, tcp_stats(&args, addrs));
+			if (argc < 2) nl_close(sock);
+			return rv;
+		}
+		addrs = rb_ary_new4(1, &addrs);
+		/* fall through */
 	case T_ARRAY:
 		ary = RARRAY_PTR(addrs);
 		i = RARRAY_LEN(addrs);
-		if (i == 1) {
+		if (i == 1 && TYPE(*ary) == T_STRING && !range_dash(*ary)) {
 			rb_hash_aset(rv, *ary, tcp_stats(&args, *ary));
+			if (argc < 2) nl_close(sock);
 			return rv;
 		}
-		for (; --i >= 0; ary++) {
-			union any_addr check;
 
-			parse_addr(&check, *ary);
-			rb_hash_aset(rv, *ary, Qtrue);
+		/* GC-managed in case parsing raises */
+		tmp = rb_str_new(NULL, i * sizeof(struct addr_filter));
+		filters = (struct addr_filter *)RSTRING_PTR(tmp);
+		and_args.hash = rv;
+		and_args.filters = filters;
+		and_args.nr = i;
+		for (; --i >= 0; ary++, filters++) {
+			parse_filter(filters, *ary);
+			if (!filters->range)
+				rb_hash_aset(rv, *ary, Qtrue);
 		}
-		/* fall through */
+		args.table = st_init_table(&listen_key_type);
+		gen_bytecode(&args, and_args.filters, and_args.nr);
+		break;
 	case T_NIL:
-		args.table = st_init_strtable();
+		args.table = st_init_table(&listen_key_type);
 		gen_bytecode_all(&args.iov[2]);
 		break;
 	default:
@@ -632,14 +1157,1281 @@ static VALUE tcp_listener_stats(int argc, VALUE *argv, VALUE self)
 	}
 
 	nl_errcheck(rb_thread_io_blocking_region(diag, &args, args.fd));
+	nl_buf_account(args.buf);
 
-	st_foreach(args.table, NIL_P(addrs) ? st_to_hash : st_AND_hash, rv);
+	if (NIL_P(addrs))
+		st_foreach(args.table, st_addr_to_hash, rv);
+	else
+		st_foreach(args.table, st_AND_hash, (st_data_t)&and_args);
+	RB_GC_GUARD(tmp);
 	st_free_table(args.table);
 
 	/* let GC deal with corner cases */
-	if (argc < 2) rb_io_close(sock);
+	if (argc < 2) nl_close(sock);
+	return rv;
+}
+
+/*
+ * call-seq:
+ *	Raindrops::Linux.tcp_info_dump(addrs[, sock])	=> string
+ *	Raindrops::Linux.tcp_info_dump(addrs[, sock]) { |tcp_info| ... }
+ *
+ * Returns the "struct tcp_info" of every established connection on
+ * the listeners given by +addrs+ in a single netlink round trip,
+ * without a getsockopt(2) call or Ruby object for each connection.
+ * +addrs+ is a string or array of strings in the same format accepted
+ * by Raindrops::Linux.tcp_listener_stats, including port ranges.
+ *
+ * The returned string holds packed records which are each
+ * Raindrops::Linux::TCP_INFO_SIZE bytes long and laid out as
+ * described in tcp(7).  Connections still in the listen queue are
+ * included.
+ *
+ * If a block is given, a Raindrops::TCP_Info object is yielded for
+ * every record.
+ *
+ * If +sock+ is specified, it should be a Raindrops::InetDiagSock object.
+ */
+static VALUE tcp_info_dump(int argc, VALUE *argv, VALUE self)
+{
+	VALUE addrs, sock, tmp, rv;
+	struct nogvl_args args;
+	struct rec_buf out;
+	struct addr_filter *filters;
+	const char *err;
+	long i, n;
+
+	rb_scan_args(argc, argv, "11", &addrs, &sock);
+	if (TYPE(addrs) == T_STRING)
+		addrs = rb_ary_new4(1, &addrs);
+	Check_Type(addrs, T_ARRAY);
+	n = RARRAY_LEN(addrs);
+	if (n == 0)
+		return rb_str_new(0, 0);
+
+	tmp = rb_str_new(NULL, n * sizeof(struct addr_filter));
+	filters = (struct addr_filter *)RSTRING_PTR(tmp);
+	for (i = 0; i < n; i++)
+		parse_filter(&filters[i], RARRAY_PTR(addrs)[i]);
+
+	if (NIL_P(sock))
+		sock = rb_funcall(cIDSock, id_new, 0);
+	memset(&out, 0, sizeof(struct rec_buf));
+	memset(&args, 0, sizeof(struct nogvl_args));
+	args.fd = my_fileno(sock);
+	args.buf = nl_buf_get(sock);
+	args.out = &out;
+	args.acc = info_acc;
+	args.states = 1<<TCP_ESTABLISHED;
+	args.ext = 1 << (INET_DIAG_INFO - 1);
+	gen_bytecode(&args, filters, n);
+	RB_GC_GUARD(tmp);
+
+	rv = rb_thread_io_blocking_region(diag, &args, args.fd);
+	nl_buf_account(args.buf);
+	err = (const char *)rv;
+	if (err || out.enomem) {
+		int save_errno = errno;
+
+		free(out.ptr);
+		errno = save_errno;
+		nl_errcheck(rv);
+		rb_memerror();
+	}
+	rv = rb_str_new(out.ptr, out.len);
+	free(out.ptr);
+
+	/* let GC deal with corner cases */
+	if (argc < 2) nl_close(sock);
+
+	if (rb_block_given_p()) {
+		VALUE cRaindrops = rb_const_get(rb_cObject,
+		                                rb_intern("Raindrops"));
+		VALUE cTCP_Info = rb_const_get(cRaindrops,
+		                               rb_intern("TCP_Info"));
+
+		for (i = 0; (size_t)i < out.len; i += TCPI_LEN) {
+			VALUE rec = rb_str_substr(rv, i, TCPI_LEN);
+
+			rb_yield(rb_funcall(cTCP_Info, id_new, 1, rec));
+		}
+	}
+
+	return rv;
+}
+
+/* orders queued connections by listener, then by age */
+static int age_cmp(const void *x, const void *y)
+{
+	const struct age_rec *a = x, *b = y;
+	int rc = memcmp(&a->key, &b->key, sizeof(a->key));
+
+	if (rc)
+		return rc;
+	return a->age < b->age ? -1 : (a->age > b->age);
+}
+
+/* nearest-rank percentile of +n+ ages sorted in ascending order */
+static VALUE age_pct(const struct age_rec *sorted, long n, long pct)
+{
+	long rank = (n * pct + 99) / 100;
+
+	return UINT2NUM(sorted[(rank < 1 ? 1 : rank) - 1].age);
+}
+
+/*
+ * call-seq:
+ *	Raindrops::Linux.tcp_listener_queue_ages([addrs[, sock]]) => hash
+ *
+ * Returns a hash with listen addresses as keys and
+ * Raindrops::QueueAges structs as values.  Each holds how long (in
+ * milliseconds) connections currently in the listen queue have been
+ * waiting to be accept()-ed:
+ *
+ *	ages.count	-> number of connections in the queue
+ *	ages.max	-> the oldest connection in the queue
+ *	ages.p50	-> the median wait
+ *	ages.p99	-> the 99th percentile wait
+ *
+ * +max+, +p50+ and +p99+ are +nil+ if the queue is empty.
+ *
+ * Queued connections are normally skipped by inet_diag users because
+ * they are not associated with any process yet.  Their age is taken
+ * from the last_data_recv and last_ack_recv timers of tcp_info, so
+ * this does not need +TCP_DEFER_ACCEPT+ or any instrumentation of
+ * the application.
+ *
+ * +addrs+ and +sock+ are treated the same way as in
+ * Raindrops::Linux.tcp_listener_stats, except every matching listener
+ * is returned under its own address.
+ */
+static VALUE tcp_listener_queue_ages(int argc, VALUE *argv, VALUE self)
+{
+	VALUE addrs, sock, tmp = Qnil, rv, by_key, qtmp;
+	struct nogvl_args args;
+	struct rec_buf out;
+	struct addr_filter *filters = NULL;
+	struct age_rec *rec, *end, *queued, *q;
+	const char *err;
+	long i, n = 0;
+
+	rb_scan_args(argc, argv, "02", &addrs, &sock);
+	if (TYPE(addrs) == T_STRING)
+		addrs = rb_ary_new4(1, &addrs);
+	if (!NIL_P(addrs)) {
+		Check_Type(addrs, T_ARRAY);
+		n = RARRAY_LEN(addrs);
+		tmp = rb_str_new(NULL, n * sizeof(struct addr_filter));
+		filters = (struct addr_filter *)RSTRING_PTR(tmp);
+		for (i = 0; i < n; i++)
+			parse_filter(&filters[i], RARRAY_PTR(addrs)[i]);
+	}
+
+	if (NIL_P(sock))
+		sock = rb_funcall(cIDSock, id_new, 0);
+	memset(&out, 0, sizeof(struct rec_buf));
+	memset(&args, 0, sizeof(struct nogvl_args));
+	args.fd = my_fileno(sock);
+	args.buf = nl_buf_get(sock);
+	args.out = &out;
+	args.acc = age_acc;
+	args.states = (1<<TCP_ESTABLISHED) | (1<<TCP_LISTEN);
+	args.ext = 1 << (INET_DIAG_INFO - 1);
+	if (filters) {
+		gen_bytecode(&args, filters, n);
+	} else {
+		args.iov[2].iov_len = OPLEN;
+		args.iov[2].iov_base = args.buf->ptr;
+		gen_bytecode_all(&args.iov[2]);
+	}
+	RB_GC_GUARD(tmp);
+
+	rv = rb_thread_io_blocking_region(diag, &args, args.fd);
+	nl_buf_account(args.buf);
+	err = (const char *)rv;
+	if (err || out.enomem) {
+		int save_errno = errno;
+
+		free(out.ptr);
+		errno = save_errno;
+		nl_errcheck(rv);
+		rb_memerror();
+	}
+	/* GC-managed in case anything below raises */
+	tmp = rb_str_new(out.ptr, out.len);
+	free(out.ptr);
+
+	/* let GC deal with corner cases */
+	if (argc < 2) nl_close(sock);
+
+	by_key = rb_hash_new();
+	rec = (struct age_rec *)RSTRING_PTR(tmp);
+	end = rec + RSTRING_LEN(tmp) / sizeof(struct age_rec);
+
+	/* listeners first, they may come after their queued connections */
+	for (; rec < end; rec++)
+		if (rec->listener_p)
+			rb_hash_aset(by_key, rb_str_new((const char *)&rec->key,
+			                                sizeof(rec->key)), Qfalse);
+
+	/*
+	 * copy queued connections keyed by their listener, dropping the
+	 * ones accepted by nobody we know of
+	 */
+	qtmp = rb_str_new(NULL, RSTRING_LEN(tmp));
+	queued = q = (struct age_rec *)RSTRING_PTR(qtmp);
+	rec = (struct age_rec *)RSTRING_PTR(tmp);
+	for (; rec < end; rec++) {
+		VALUE key;
+
+		if (rec->listener_p)
+			continue;
+		key = rb_str_new((const char *)&rec->key, sizeof(rec->key));
+		if (NIL_P(rb_hash_lookup(by_key, key))) {
+			/* accepted by a 0.0.0.0 or [::] listener */
+			memset(rec->key.addr, 0, sizeof(rec->key.addr));
+			key = rb_str_new((const char *)&rec->key,
+			                 sizeof(rec->key));
+			if (NIL_P(rb_hash_lookup(by_key, key)))
+				continue;
+		}
+		*q++ = *rec;
+	}
+	n = q - queued;
+	qsort(queued, (size_t)n, sizeof(struct age_rec), age_cmp);
+
+	for (i = 0; i < n; ) {
+		long j = i;
+		const struct age_rec *first = &queued[i];
+		VALUE key = rb_str_new((const char *)&first->key,
+		                       sizeof(first->key));
+
+		while (j < n && !memcmp(&queued[j].key, &first->key,
+		                        sizeof(first->key)))
+			j++;
+		rb_hash_aset(by_key, key,
+		             rb_struct_new(cQueueAges, LONG2NUM(j - i),
+		                           UINT2NUM(queued[j - 1].age),
+		                           age_pct(first, j - i, 50),
+		                           age_pct(first, j - i, 99)));
+		i = j;
+	}
+	RB_GC_GUARD(qtmp);
+
+	rv = rb_hash_new();
+	rec = (struct age_rec *)RSTRING_PTR(tmp);
+	for (; rec < end; rec++) {
+		VALUE key, ages;
+
+		if (!rec->listener_p)
+			continue;
+		key = rb_str_new((const char *)&rec->key, sizeof(rec->key));
+		ages = rb_hash_lookup(by_key, key);
+		key = listen_key_str(&rec->key);
+		OBJ_FREEZE(key);
+		if (ages == Qfalse)
+			ages = rb_struct_new(cQueueAges, INT2FIX(0),
+			                     Qnil, Qnil, Qnil);
+		rb_hash_aset(rv, key, ages);
+	}
+	RB_GC_GUARD(tmp);
+
+	return rv;
+}
+
+#ifdef HAVE_SYS_TIMERFD_H
+/*
+ * Raindrops::Linux::Sampler runs the dumps of tcp_listener_stats from a
+ * native thread which never enters the VM.  Everything that thread
+ * writes to is owned by struct sampler and only freed after the thread
+ * is joined, Ruby only reads counters and copies histograms out.
+ */
+#define SAMPLER_DEFAULT_BITS 5
+
+struct sampler_listener {
+	struct listen_key key;
+	uint32_t active; /* counted during the current dump */
+	uint32_t queued;
+	unsigned long pub_seq; /* odd while last_* are being published */
+	uint32_t last_active; /* published after every complete dump */
+	uint32_t last_queued;
+	struct rd_hist active_hist; /* data is xcalloc()-ed, not mmap()-ed */
+	struct rd_hist queued_hist;
+	struct rd_history history; /* MAP_FAILED without :history */
+};
+
+struct sampler {
+	struct nogvl_args args; /* must be first, see sampler_acc */
+	struct nl_buf buf;
+	void *bc; /* bytecode, buf is reused for replies after every dump */
+	size_t bc_len;
+	struct sampler_listener *listeners;
+	long nr;
+	VALUE addrs;
+	double interval;
+	pthread_t thr;
+	pid_t pid; /* the thread does not survive fork() */
+	int running;
+	volatile int stop;
+	int tfd;
+	unsigned seq;
+	int last_errno;
+	unsigned long ticks;
+	unsigned long missed;
+	unsigned long errors;
+};
+
+static VALUE sym_bits, sym_history;
+
+static void sampler_mark(void *ptr)
+{
+	struct sampler *s = ptr;
+
+	rb_gc_mark(s->addrs);
+}
+
+static void sampler_stop(struct sampler *s)
+{
+	struct itimerspec its;
+
+	if (!s->running)
+		return;
+	s->running = 0;
+	if (s->pid != getpid())
+		return;
+
+	s->stop = 1;
+	__sync_synchronize();
+
+	/* expire right away so the thread wakes up and sees s->stop */
+	memset(&its, 0, sizeof(struct itimerspec));
+	its.it_value.tv_nsec = 1;
+	if (timerfd_settime(s->tfd, 0, &its, NULL) != 0)
+		rb_bug("timerfd_settime failed on stop: %s", strerror(errno));
+	pthread_join(s->thr, NULL);
+}
+
+/* called by GC */
+static void sampler_free(void *ptr)
+{
+	struct sampler *s = ptr;
+	long i;
+
+	sampler_stop(s);
+	if (s->tfd >= 0)
+		close(s->tfd);
+	if (s->args.fd >= 0)
+		close(s->args.fd);
+	free(s->buf.ptr);
+	xfree(s->bc);
+	for (i = 0; i < s->nr; i++) {
+		xfree(s->listeners[i].active_hist.data);
+		xfree(s->listeners[i].queued_hist.data);
+		rd_history_unmap(&s->listeners[i].history);
+	}
+	xfree(s->listeners);
+	xfree(s);
+}
+
+static VALUE sampler_alloc(VALUE klass)
+{
+	struct sampler *s;
+	VALUE rv = Data_Make_Struct(klass, struct sampler,
+	                            sampler_mark, sampler_free, s);
+
+	s->addrs = Qnil;
+	s->tfd = -1;
+	s->args.fd = -1;
+
+	return rv;
+}
+
+static struct sampler *sampler_get(VALUE self)
+{
+	struct sampler *s;
+
+	Data_Get_Struct(self, struct sampler, s);
+	if (s->listeners == NULL)
+		rb_raise(rb_eArgError, "uninitialized Sampler");
+
+	return s;
+}
+
+static struct sampler_listener *
+sampler_find(struct sampler *s, const struct listen_key *key)
+{
+	long i;
+
+	for (i = 0; i < s->nr; i++)
+		if (!memcmp(&s->listeners[i].key, key, sizeof(struct listen_key)))
+			return &s->listeners[i];
+
+	return NULL;
+}
+
+/* like r_acc, but only counts into our fixed set of listeners */
+static void sampler_acc(struct nogvl_args *args, struct nlmsghdr *h)
+{
+	struct sampler *s = (struct sampler *)args;
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct sampler_listener *l;
+	struct listen_key key;
+
+	if (r->idiag_inode == 0)
+		return;
+	listen_key_init(&key, r);
+	l = sampler_find(s, &key);
+	if (r->idiag_state == TCP_ESTABLISHED) {
+		if (l == NULL) { /* accepted by a 0.0.0.0 or [::] listener */
+			memset(key.addr, 0, sizeof(key.addr));
+			l = sampler_find(s, &key);
+		}
+		if (l)
+			l->active++;
+	} else if (l) {
+		l->queued = r->idiag_rqueue;
+	}
+}
+
+/* one dump, like diag() but with our own bytecode and sequence */
+static void sampler_tick(struct sampler *s)
+{
+	struct sockaddr_nl nladdr;
+	struct rtattr rta;
+	struct diag_req req;
+	struct msghdr msg;
+	const char *err;
+	uint64_t msec;
+	long i;
+
+	for (i = 0; i < s->nr; i++)
+		s->listeners[i].active = s->listeners[i].queued = 0;
+
+	s->args.iov[2].iov_base = s->bc;
+	s->args.iov[2].iov_len = s->bc_len;
+	prep_diag_args(&s->args, &nladdr, &rta, &req, &msg);
+	req.nlh.nlmsg_seq = ++s->seq;
+
+	if (sendmsg(s->args.fd, &msg, 0) < 0)
+		err = err_sendmsg;
+	else
+		err = nl_recv(&s->args, &nladdr, s->seq, sampler_acc);
+	if (err) {
+		s->last_errno = errno;
+		s->errors++;
+		return;
+	}
+
+	msec = rd_history_now();
+	for (i = 0; i < s->nr; i++) {
+		struct sampler_listener *l = &s->listeners[i];
+
+		/* __sync builtins are full barriers, see sampler_last */
+		__sync_add_and_fetch(&l->pub_seq, 1);
+		l->last_active = l->active;
+		l->last_queued = l->queued;
+		__sync_add_and_fetch(&l->pub_seq, 1);
+		rd_hist_record(&l->active_hist, l->active, 1);
+		rd_hist_record(&l->queued_hist, l->queued, 1);
+		if (l->history.data != MAP_FAILED)
+			rd_history_record(&l->history, msec,
+			                  l->active, l->queued);
+	}
+}
+
+/* the native thread, this must never call into Ruby */
+static void *sampler_run(void *ptr)
+{
+	struct sampler *s = ptr;
+	uint64_t n;
+
+	for (;;) {
+		ssize_t r = read(s->tfd, &n, sizeof(n));
+
+		if (s->stop)
+			break;
+		if (r != (ssize_t)sizeof(n)) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			s->last_errno = r < 0 ? errno : EIO;
+			s->errors++;
+			break;
+		}
+
+		/*
+		 * the timer keeps its own schedule, so a slow dump never
+		 * shifts later ticks.  Expirations we were too slow to
+		 * read are counted here instead of being sampled late.
+		 */
+		s->missed += (unsigned long)(n - 1);
+		s->ticks++;
+		sampler_tick(s);
+	}
+
+	return NULL;
+}
+
+static void sampler_hist_init(struct rd_hist *h, unsigned bits)
+{
+	h->bits = bits;
+	h->nr_buckets = rd_hist_nr_buckets(bits);
+	h->len = offsetof(struct rd_hist_data, buckets) +
+	         h->nr_buckets * sizeof(unsigned long);
+	h->data = xcalloc(1, h->len);
+	h->data->min = ULONG_MAX;
+}
+
+static void
+sampler_listeners_init(struct sampler *s, VALUE addrs, unsigned bits,
+                       size_t history)
+{
+	VALUE tmp;
+	struct addr_filter *filters;
+	long i, n = RARRAY_LEN(addrs);
+
+	if (n == 0)
+		rb_raise(rb_eArgError, "no addresses to sample");
+	tmp = rb_str_new(NULL, n * sizeof(struct addr_filter));
+	filters = (struct addr_filter *)RSTRING_PTR(tmp);
+	for (i = 0; i < n; i++) {
+		VALUE addr = RARRAY_PTR(addrs)[i];
+
+		parse_filter(&filters[i], addr);
+		if (filters[i].range)
+			rb_raise(rb_eArgError,
+			         "port ranges may not be sampled: %s",
+			         RSTRING_PTR(addr));
+	}
+
+	s->buf.ptr = malloc(NL_BUF_DEFAULT);
+	if (s->buf.ptr == NULL)
+		rb_memerror();
+	s->buf.len = NL_BUF_DEFAULT;
+	s->args.buf = &s->buf;
+	s->args.states = (1<<TCP_ESTABLISHED) | (1<<TCP_LISTEN);
+	gen_bytecode(&s->args, filters, n);
+	s->bc = xmalloc(s->args.iov[2].iov_len);
+	s->bc_len = s->args.iov[2].iov_len;
+	memcpy(s->bc, s->args.iov[2].iov_base, s->bc_len);
+
+	s->listeners = xcalloc(n, sizeof(struct sampler_listener));
+	for (i = 0; i < n; i++)
+		s->listeners[i].history.data = MAP_FAILED;
+	s->nr = n;
+	for (i = 0; i < n; i++) {
+		struct sampler_listener *l = &s->listeners[i];
+		const union any_addr *a = &filters[i].addr;
+
+		l->key.family = a->ss.ss_family;
+		l->key.port = htons(filters[i].lo);
+		if (a->ss.ss_family == AF_INET)
+			l->key.addr[0] = a->in.sin_addr.s_addr;
+		else
+			memcpy(l->key.addr, &a->in6.sin6_addr,
+			       sizeof(l->key.addr));
+		sampler_hist_init(&l->active_hist, bits);
+		sampler_hist_init(&l->queued_hist, bits);
+		if (history)
+			rd_history_map(&l->history, history);
+	}
+	RB_GC_GUARD(tmp);
+}
+
+/*
+ * call-seq:
+ *	Raindrops::Linux::Sampler.new(addrs, interval[, options]) -> sampler
+ *
+ * Starts sampling the listeners at +addrs+ (a String or Array of
+ * "addr:port" Strings, as accepted by
+ * Raindrops::Linux.tcp_listener_stats) every +interval+ seconds.
+ *
+ * Sampling happens in a native thread which never takes the GVL: the
+ * netlink dump and the histogram updates are all done in C, so Ruby
+ * threads are neither slowed down by sampling nor able to delay it.
+ * Ticks come from a timerfd(2) with a fixed schedule, so they do not
+ * drift, and ticks which could not be sampled in time are counted
+ * by +missed+ instead of being sampled late.
+ *
+ * +options+ is a hash that accepts the following keys:
+ *
+ * * :bits - precision of the histograms, see Raindrops::Histogram.new
+ * * :history - number of samples kept for +dump_history+ (default: 0)
+ *
+ * The thread is stopped with +stop+, or when the sampler is garbage
+ * collected.  It is not carried over to forked children.
+ */
+static VALUE sampler_init(int argc, VALUE *argv, VALUE self)
+{
+	struct sampler *s = DATA_PTR(self);
+	VALUE addrs, interval, opts, tmp;
+	unsigned bits = SAMPLER_DEFAULT_BITS;
+	size_t history = 0;
+	struct itimerspec its;
+	sigset_t set, old;
+	double sec;
+	long i;
+	int rc;
+
+	rb_scan_args(argc, argv, "21", &addrs, &interval, &opts);
+	if (s->listeners)
+		rb_raise(rb_eRuntimeError, "already initialized");
+	if (TYPE(addrs) == T_STRING)
+		addrs = rb_ary_new4(1, &addrs);
+	Check_Type(addrs, T_ARRAY);
+	addrs = rb_ary_dup(addrs);
+	for (i = 0; i < RARRAY_LEN(addrs); i++) {
+		tmp = RARRAY_PTR(addrs)[i];
+		Check_Type(tmp, T_STRING);
+		tmp = rb_str_dup(tmp);
+		OBJ_FREEZE(tmp);
+		rb_ary_store(addrs, i, tmp);
+	}
+	OBJ_FREEZE(addrs);
+
+	sec = NUM2DBL(interval);
+	if (!(sec > 0.0))
+		rb_raise(rb_eArgError, "interval must be positive");
+	if (!NIL_P(opts)) {
+		Check_Type(opts, T_HASH);
+		tmp = rb_hash_aref(opts, sym_bits);
+		if (!NIL_P(tmp))
+			bits = NUM2UINT(tmp);
+		tmp = rb_hash_aref(opts, sym_history);
+		if (!NIL_P(tmp))
+			history = NUM2SIZET(tmp);
+	}
+	if (bits < 1 || bits > RD_HIST_BITS_MAX)
+		rb_raise(rb_eArgError, "bits must be between 1 and %d",
+		         RD_HIST_BITS_MAX);
+
+	s->args.fd = socket(AF_NETLINK, my_SOCK_RAW, NETLINK_INET_DIAG);
+	if (s->args.fd < 0)
+		rb_sys_fail("socket(AF_NETLINK)");
+	s->addrs = addrs; /* before listeners, which may raise halfway */
+	sampler_listeners_init(s, addrs, bits, history);
+	s->interval = sec;
+
+	s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (s->tfd < 0)
+		rb_sys_fail("timerfd_create");
+	its.it_interval.tv_sec = (time_t)sec;
+	its.it_interval.tv_nsec = (long)((sec - (double)(time_t)sec) * 1e9);
+	if (its.it_interval.tv_sec == 0 && its.it_interval.tv_nsec == 0)
+		its.it_interval.tv_nsec = 1;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(s->tfd, 0, &its, NULL) != 0)
+		rb_sys_fail("timerfd_settime");
+
+	/* signals are for Ruby threads to handle */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	s->pid = getpid();
+	rc = pthread_create(&s->thr, NULL, sampler_run, s);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc != 0) {
+		errno = rc;
+		rb_sys_fail("pthread_create");
+	}
+	s->running = 1;
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	sampler.stop	-> nil
+ *
+ * Stops the sampling thread and waits for it to exit.  Results
+ * remain readable afterwards.  This is a no-op if the sampler was
+ * already stopped.
+ */
+static VALUE sampler_stop_m(VALUE self)
+{
+	sampler_stop(sampler_get(self));
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *	sampler.running?	-> true or false
+ *
+ * Returns true if the sampling thread is running in this process
+ */
+static VALUE sampler_running_p(VALUE self)
+{
+	struct sampler *s = sampler_get(self);
+
+	return s->running && !s->stop && s->pid == getpid() ? Qtrue : Qfalse;
+}
+
+/*
+ * reads the last published sample of +l+ so active and queued always
+ * come from the same dump, retrying while the thread publishes
+ */
+static void
+sampler_last(struct sampler_listener *l, struct listen_stats *stats)
+{
+	unsigned long seq;
+
+	for (;;) {
+		seq = *(volatile unsigned long *)&l->pub_seq;
+		__sync_synchronize();
+		stats->active = l->last_active;
+		stats->queued = l->last_queued;
+		__sync_synchronize();
+		if (!(seq & 1) &&
+		    seq == *(volatile unsigned long *)&l->pub_seq)
+			break;
+		sched_yield();
+	}
+	stats->listener_p = 1;
+}
+
+/*
+ * call-seq:
+ *	sampler.stats	-> hash
+ *
+ * Returns a hash with the addresses given to +new+ as keys and
+ * ListenStats objects from the last complete sample as values.  All
+ * values are zero until the first tick.
+ */
+static VALUE sampler_stats(VALUE self)
+{
+	struct sampler *s = sampler_get(self);
+	VALUE rv = rb_hash_new();
+	long i;
+
+	for (i = 0; i < s->nr; i++) {
+		struct listen_stats stats;
+
+		sampler_last(&s->listeners[i], &stats);
+		rb_hash_aset(rv, RARRAY_PTR(s->addrs)[i],
+		             rb_listen_stats(&stats));
+	}
+
+	return rv;
+}
+
+static VALUE
+sampler_hists(int argc, VALUE *argv, VALUE self, size_t off)
+{
+	struct sampler *s = sampler_get(self);
+	VALUE cHistogram = rb_const_get(rb_const_get(rb_cObject,
+	                                             rb_intern("Raindrops")),
+	                                rb_intern("Histogram"));
+	unsigned bits = s->listeners[0].active_hist.bits;
+	VALUE opts = rb_hash_new();
+	VALUE rv;
+	long i;
+
+	rb_scan_args(argc, argv, "01", &rv);
+	if (NIL_P(rv))
+		rv = rb_hash_new();
+	else
+		Check_Type(rv, T_HASH);
+	rb_hash_aset(opts, sym_bits, UINT2NUM(bits));
+	for (i = 0; i < s->nr; i++) {
+		struct rd_hist *src = (struct rd_hist *)
+		                      ((char *)&s->listeners[i] + off);
+		VALUE addr = RARRAY_PTR(s->addrs)[i];
+		VALUE hist = rb_hash_aref(rv, addr);
+		struct rd_hist *dst;
+
+		if (NIL_P(hist)) {
+			hist = rb_funcall(cHistogram, id_new, 1, opts);
+			rb_hash_aset(rv, addr, hist);
+		}
+		dst = rd_hist_get(hist);
+		if (dst->bits != bits)
+			rb_raise(rb_eArgError,
+			         "histogram for %s has %u bits, expected %u",
+			         RSTRING_PTR(addr), dst->bits, bits);
+
+		/* may be torn by a concurrent tick, like Histogram#dup */
+		memcpy(dst->data, src->data, src->len);
+	}
+
+	return rv;
+}
+
+/*
+ * call-seq:
+ *	sampler.active_histograms([hash])	-> hash
+ *
+ * Returns a hash with the addresses given to +new+ as keys and
+ * Raindrops::Histogram objects of every active connection count
+ * sampled so far as values.  The histograms are copies, so recording
+ * into them does not affect the sampler.
+ *
+ * If +hash+ is given, the Histogram objects already in it (which must
+ * have the same +bits+) are overwritten instead of allocating new
+ * ones, and +hash+ is returned.  Missing entries are added.
+ */
+static VALUE sampler_active_hists(int argc, VALUE *argv, VALUE self)
+{
+	return sampler_hists(argc, argv, self,
+	                     offsetof(struct sampler_listener, active_hist));
+}
+
+/*
+ * call-seq:
+ *	sampler.queued_histograms([hash])	-> hash
+ *
+ * Like +active_histograms+, but for the number of queued connections
+ */
+static VALUE sampler_queued_hists(int argc, VALUE *argv, VALUE self)
+{
+	return sampler_hists(argc, argv, self,
+	                     offsetof(struct sampler_listener, queued_hist));
+}
+
+static void sampler_hist_clear(struct rd_hist *h)
+{
+	memset(h->data, 0, h->len);
+	h->data->min = ULONG_MAX;
+}
+
+/* returns the listener for +addr+, raising if it is not sampled */
+static struct sampler_listener *
+sampler_lookup(struct sampler *s, VALUE addr)
+{
+	long i;
+
+	for (i = 0; i < s->nr; i++)
+		if (rb_str_equal(RARRAY_PTR(s->addrs)[i], addr) == Qtrue)
+			return &s->listeners[i];
+	rb_raise(rb_eArgError, "not sampled: %s", StringValueCStr(addr));
+
+	return NULL;
+}
+
+/*
+ * call-seq:
+ *	sampler.reset!(addr)	-> sampler
+ *
+ * Clears both histograms of +addr+, which must be one of the
+ * addresses given to +new+.  Like Raindrops::Histogram#reset!, this
+ * is not atomic, a tick recorded at the same time may be partially
+ * kept.
+ */
+static VALUE sampler_reset_bang(VALUE self, VALUE addr)
+{
+	struct sampler_listener *l = sampler_lookup(sampler_get(self), addr);
+
+	sampler_hist_clear(&l->active_hist);
+	sampler_hist_clear(&l->queued_hist);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *	sampler.dump_history(addr[, options])	-> String or nil
+ *
+ * Returns the samples of +addr+ kept with the +:history+ option of
+ * +new+, in the format of Raindrops::History#dump, which also
+ * describes +options+.  Every successful tick is kept, so these are
+ * +interval+ seconds apart.  The buffer is read in place without
+ * stopping the sampling thread.  Returns nil without +:history+.
+ */
+static VALUE sampler_dump_history(int argc, VALUE *argv, VALUE self)
+{
+	struct sampler *s = sampler_get(self);
+	struct sampler_listener *l;
+	VALUE addr, opts;
+
+	rb_scan_args(argc, argv, "11", &addr, &opts);
+	l = sampler_lookup(s, addr);
+	if (l->history.data == MAP_FAILED)
+		return Qnil;
+
+	return rd_history_dump(&l->history, opts);
+}
+
+/*
+ * call-seq:
+ *	sampler.ticks	-> Integer
+ *
+ * Returns the number of ticks sampled, including failed ones
+ */
+static VALUE sampler_ticks(VALUE self)
+{
+	return ULONG2NUM(sampler_get(self)->ticks);
+}
+
+/*
+ * call-seq:
+ *	sampler.missed	-> Integer
+ *
+ * Returns the number of ticks skipped because the previous sample
+ * took longer than +interval+ or the thread was not scheduled in time.
+ * If this keeps growing, +interval+ is too short for this system.
+ */
+static VALUE sampler_missed(VALUE self)
+{
+	return ULONG2NUM(sampler_get(self)->missed);
+}
+
+/*
+ * call-seq:
+ *	sampler.errors	-> Integer
+ *
+ * Returns the number of ticks where the netlink dump failed.  Failed
+ * ticks are not recorded in the histograms.
+ */
+static VALUE sampler_errors(VALUE self)
+{
+	return ULONG2NUM(sampler_get(self)->errors);
+}
+
+/*
+ * call-seq:
+ *	sampler.last_error	-> SystemCallError or nil
+ *
+ * Returns the error of the most recent failed tick, if any
+ */
+static VALUE sampler_last_error(VALUE self)
+{
+	struct sampler *s = sampler_get(self);
+	VALUE args[2];
+
+	if (s->errors == 0)
+		return Qnil;
+	args[0] = rb_str_new2("Raindrops::Linux::Sampler");
+	args[1] = INT2NUM(s->last_errno);
+
+	return rb_class_new_instance(2, args, rb_eSystemCallError);
+}
+
+/*
+ * call-seq:
+ *	sampler.interval	-> Float
+ *
+ * Returns the sampling interval in seconds
+ */
+static VALUE sampler_interval(VALUE self)
+{
+	return rb_float_new(sampler_get(self)->interval);
+}
+
+/*
+ * call-seq:
+ *	sampler.addresses	-> array
+ *
+ * Returns the frozen array of addresses given to +new+
+ */
+static VALUE sampler_addresses(VALUE self)
+{
+	return sampler_get(self)->addrs;
+}
+
+static void init_sampler(VALUE mLinux)
+{
+	/*
+	 * Document-class: Raindrops::Linux::Sampler
+	 *
+	 * Samples Raindrops::Linux.tcp_listener_stats for a fixed set of
+	 * listeners from a native thread on a timerfd(2) schedule,
+	 * recording every sample into histograms.  Ruby only reads the
+	 * results, so this is suitable for intervals far shorter than
+	 * Ruby threads could keep up with:
+	 *
+	 *   sampler = Raindrops::Linux::Sampler.new("0.0.0.0:80", 0.01)
+	 *   ...
+	 *   sampler.stats["0.0.0.0:80"].queued
+	 *   sampler.queued_histograms["0.0.0.0:80"].percentile(99)
+	 *   sampler.missed
+	 */
+	VALUE cSampler = rb_define_class_under(mLinux, "Sampler", rb_cObject);
+
+	sym_bits = ID2SYM(rb_intern("bits"));
+	sym_history = ID2SYM(rb_intern("history"));
+	rb_define_alloc_func(cSampler, sampler_alloc);
+	rb_define_method(cSampler, "initialize", sampler_init, -1);
+	rb_define_method(cSampler, "stop", sampler_stop_m, 0);
+	rb_define_method(cSampler, "running?", sampler_running_p, 0);
+	rb_define_method(cSampler, "stats", sampler_stats, 0);
+	rb_define_method(cSampler, "active_histograms",
+	                 sampler_active_hists, -1);
+	rb_define_method(cSampler, "queued_histograms",
+	                 sampler_queued_hists, -1);
+	rb_define_method(cSampler, "reset!", sampler_reset_bang, 1);
+	rb_define_method(cSampler, "dump_history", sampler_dump_history, -1);
+	rb_define_method(cSampler, "ticks", sampler_ticks, 0);
+	rb_define_method(cSampler, "missed", sampler_missed, 0);
+	rb_define_method(cSampler, "errors", sampler_errors, 0);
+	rb_define_method(cSampler, "last_error", sampler_last_error, 0);
+	rb_define_method(cSampler, "interval", sampler_interval, 0);
+	rb_define_method(cSampler, "addresses", sampler_addresses, 0);
+}
+#endif /* HAVE_SYS_TIMERFD_H */
+
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+struct unix_diag_req_msg {
+	struct nlmsghdr nlh;
+	struct unix_diag_req r;
+};
+
+/* a path given to unix_diag_listener_stats */
+struct unix_path {
+	const char *path;
+	struct listen_stats *stats; /* owned by nogvl_args.table */
+	uint32_t dev; /* kernel encoding, as in struct unix_diag_vfs */
+	uint32_t ino; /* zero unless +path+ is a socket in the filesystem */
+};
+
+/*
+ * finds the stats of the socket named +key+ which is bound to the
+ * filesystem inode in +vfs+ (NULL for abstract sockets).  Inodes are
+ * compared for paths which exist, so sockets which were renamed are
+ * found and stale sockets whose path was unlinked and reused are not.
+ */
+static struct listen_stats *
+unix_path_stats(struct nogvl_args *args, const char *key,
+                const struct unix_diag_vfs *vfs)
+{
+	long i;
+
+	for (i = 0; i < args->nr_paths; i++) {
+		const struct unix_path *p = &args->paths[i];
+
+		if (p->ino && vfs) {
+			if (p->ino == vfs->udiag_vfs_ino &&
+			    p->dev == vfs->udiag_vfs_dev)
+				return p->stats;
+		} else if (!strcmp(p->path, key)) {
+			return p->stats;
+		}
+	}
+
+	return NULL;
+}
+
+/* records the inode of +p->path+ if it is a socket in the filesystem */
+static void unix_path_stat(struct unix_path *p)
+{
+	struct stat st;
+
+	p->dev = p->ino = 0;
+	if (*p->path == '@' || stat(p->path, &st) != 0 ||
+	    !S_ISSOCK(st.st_mode))
+		return;
+	/* the kernel sends s_dev, not the new_encode_dev() of stat(2) */
+	p->dev = (uint32_t)((major(st.st_dev) << 20) | minor(st.st_dev));
+	p->ino = (uint32_t)st.st_ino;
+}
+
+static int st_to_hash(st_data_t key, st_data_t value, VALUE hash)
+{
+	struct listen_stats *stats = (struct listen_stats *)value;
+
+	if (stats->listener_p) {
+		VALUE k = rb_str_new2((const char *)key);
+		VALUE v = rb_listen_stats(stats);
+
+		OBJ_FREEZE(k);
+		rb_hash_aset(hash, k, v);
+	}
+	return st_free_data(key, value, 0);
+}
+
+/* called for every Unix domain socket returned by unix_diag */
+static void unix_acc(struct nogvl_args *args, struct nlmsghdr *h)
+{
+	struct unix_diag_msg *m = NLMSG_DATA(h);
+	struct rtattr *rta = (struct rtattr *)(m + 1);
+	int len = (int)(h->nlmsg_len - NLMSG_LENGTH(sizeof(*m)));
+	char key[sizeof(((struct sockaddr_un *)0)->sun_path) + 1];
+	size_t keylen = 0;
+	uint32_t rqueue = 0;
+	const struct unix_diag_vfs *vfs = NULL;
+	struct listen_stats *stats;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case UNIX_DIAG_NAME:
+			keylen = RTA_PAYLOAD(rta);
+			if (keylen >= sizeof(key))
+				keylen = sizeof(key) - 1;
+			memcpy(key, RTA_DATA(rta), keylen);
+			break;
+		case UNIX_DIAG_RQLEN:
+			rqueue = ((struct unix_diag_rqlen *)RTA_DATA(rta))
+			         ->udiag_rqueue;
+			break;
+		case UNIX_DIAG_VFS:
+			if (RTA_PAYLOAD(rta) >= sizeof(*vfs))
+				vfs = RTA_DATA(rta);
+			break;
+		}
+	}
+
+	/* unnamed, or not yet accept()-ed (we count those via rqueue) */
+	if (keylen == 0 || (m->udiag_state == TCP_ESTABLISHED &&
+	                    m->udiag_ino == 0))
+		return;
+
+	key[keylen] = 0;
+	if (*key == 0) /* abstract namespace, shown as '@' in /proc */
+		*key = '@';
+
+	if (args->filter) {
+		stats = unix_path_stats(args, key, vfs);
+		if (!stats)
+			return;
+	} else if (!st_lookup(args->table, (st_data_t)key,
+	                      (st_data_t *)&stats)) {
+		char *k = xmalloc(keylen + 1);
+
+		memcpy(k, key, keylen + 1);
+		stats = xcalloc(1, sizeof(struct listen_stats));
+		st_insert(args->table, (st_data_t)k, (st_data_t)stats);
+	}
+
+	if (m->udiag_state == TCP_LISTEN) {
+		stats->listener_p = 1;
+		stats->queued += rqueue;
+	} else {
+		stats->active++;
+	}
+}
+
+/* does the unix_diag stuff with netlink(), this is called w/o GVL */
+static VALUE unix_diag(void *ptr)
+{
+	struct nogvl_args *args = ptr;
+	struct sockaddr_nl nladdr;
+	struct unix_diag_req_msg req;
+	struct msghdr msg;
+	const char *err;
+	unsigned seq = ++g_seq;
+
+	memset(&req, 0, sizeof(req));
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
+	req.nlh.nlmsg_pid = getpid();
+	req.nlh.nlmsg_seq = seq;
+	req.r.sdiag_family = AF_UNIX;
+	req.r.udiag_states = (1<<TCP_ESTABLISHED) | (1<<TCP_LISTEN);
+	req.r.udiag_show = UDIAG_SHOW_NAME | UDIAG_SHOW_RQLEN;
+	if (args->filter)
+		req.r.udiag_show |= UDIAG_SHOW_VFS;
+
+	args->iov[0].iov_base = &req;
+	args->iov[0].iov_len = sizeof(req);
+	prep_msghdr(&msg, args, &nladdr, 1);
+
+	if (sendmsg(args->fd, &msg, 0) < 0)
+		err = err_sendmsg;
+	else
+		err = nl_recv(args, &nladdr, seq, unix_acc);
+
+	return diag_done(args, err);
+}
+
+/*
+ * call-seq:
+ *	Raindrops::Linux.unix_diag_listener_stats([paths[, sock]]) => hash
+ *
+ * Like Raindrops::Linux.unix_listener_stats, but uses the unix_diag
+ * facility of netlink instead of parsing /proc/net/unix.  The +queued+
+ * count comes directly from the accept queue length of the listener.
+ * Abstract socket names are prefixed with '@' as in /proc/net/unix.
+ * Given +paths+ which exist in the filesystem are matched by inode, so
+ * renamed listeners are found and stale listeners whose path was
+ * unlinked and bound again are ignored.
+ *
+ * Raises a SystemCallError (usually Errno::ENOENT) if the kernel does
+ * not support unix_diag.  If +sock+ is specified, it should be a
+ * Raindrops::InetDiagSocket object.
+ */
+static VALUE unix_diag_listener_stats(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rv = rb_hash_new();
+	struct nogvl_args args;
+	VALUE paths, sock, err, tmp = 0;
+	long i;
+	int own_sock;
+
+	rb_scan_args(argc, argv, "02", &paths, &sock);
+
+	args.filter = !NIL_P(paths);
+	args.paths = NULL;
+	args.nr_paths = 0;
+	if (args.filter) {
+		Check_Type(paths, T_ARRAY);
+		for (i = 0; i < RARRAY_LEN(paths); i++) {
+			VALUE path = rb_ary_entry(paths, i);
+
+			Check_Type(path, T_STRING);
+			StringValueCStr(path);
+		}
+	}
+
+	args.table = st_init_strtable();
+	if (args.filter) {
+		/* one entry per distinct path, matched in unix_acc */
+		args.paths = ALLOCV_N(struct unix_path, tmp, RARRAY_LEN(paths));
+		for (i = 0; i < RARRAY_LEN(paths); i++) {
+			VALUE path = rb_ary_entry(paths, i);
+			struct unix_path *p = &args.paths[args.nr_paths];
+			struct listen_stats *stats;
+			char *k;
+
+			if (st_lookup(args.table, (st_data_t)RSTRING_PTR(path),
+			              (st_data_t *)&stats))
+				continue;
+			k = xmalloc(RSTRING_LEN(path) + 1);
+			memcpy(k, RSTRING_PTR(path), RSTRING_LEN(path) + 1);
+			stats = xcalloc(1, sizeof(struct listen_stats));
+			st_insert(args.table, (st_data_t)k, (st_data_t)stats);
+
+			/* +k+ stays put while GC runs without our GVL */
+			p->path = k;
+			p->stats = stats;
+			unix_path_stat(p);
+			args.nr_paths++;
+		}
+	}
+	own_sock = NIL_P(sock);
+	if (own_sock)
+		sock = rb_funcall(cIDSock, id_new, 0);
+	args.fd = my_fileno(sock);
+	args.buf = nl_buf_get(sock);
+
+	err = rb_thread_io_blocking_region(unix_diag, &args, args.fd);
+	nl_buf_account(args.buf);
+	if (own_sock) nl_close(sock);
+	if (err) {
+		if ((const char *)err == err_nlmsg)
+			rb_sys_fail("unix_diag");
+		rb_sys_fail((const char *)err);
+	}
+
+	if (args.filter) {
+		for (i = 0; i < RARRAY_LEN(paths); i++) {
+			VALUE path = rb_ary_entry(paths, i);
+			struct listen_stats *stats;
+
+			st_lookup(args.table, (st_data_t)RSTRING_PTR(path),
+			          (st_data_t *)&stats);
+			rb_hash_aset(rv, path, rb_listen_stats(stats));
+		}
+		st_foreach(args.table, st_free_data, 0);
+		ALLOCV_END(tmp);
+	} else {
+		st_foreach(args.table, st_to_hash, rv);
+	}
+	st_free_table(args.table);
+
 	return rv;
 }
+#endif /* HAVE_LINUX_UNIX_DIAG_H */
 
 void Init_raindrops_linux_inet_diag(void)
 {
@@ -649,6 +2441,7 @@ void Init_raindrops_linux_inet_diag(void)
 	rb_require("socket");
 	cIDSock = rb_const_get(rb_cObject, rb_intern("Socket"));
 	id_new = rb_intern("new");
+	id_nl_buf = rb_intern("raindrops_nl_buf"); /* hidden from Ruby */
 
 	/*
 	 * Document-class: Raindrops::InetDiagSocket
@@ -657,12 +2450,29 @@ void Init_raindrops_linux_inet_diag(void)
 	 * to the inet_diag facility of Netlink.
 	 */
 	cIDSock = rb_define_class_under(cRaindrops, "InetDiagSocket", cIDSock);
-	rb_define_singleton_method(cIDSock, "new", ids_s_new, 0);
+	rb_define_singleton_method(cIDSock, "new", ids_s_new, -1);
+	rb_define_method(cIDSock, "buffer_size", ids_buffer_size, 0);
 
 	cListenStats = rb_const_get(cRaindrops, rb_intern("ListenStats"));
+	cQueueAges = rb_const_get(cRaindrops, rb_intern("QueueAges"));
 
 	rb_define_module_function(mLinux, "tcp_listener_stats",
 	                          tcp_listener_stats, -1);
+	rb_define_module_function(mLinux, "tcp_info_dump", tcp_info_dump, -1);
+	rb_define_module_function(mLinux, "tcp_listener_queue_ages",
+	                          tcp_listener_queue_ages, -1);
+
+	/*
+	 * size of each record returned by Raindrops::Linux.tcp_info_dump
+	 */
+	rb_define_const(mLinux, "TCP_INFO_SIZE", SIZET2NUM(TCPI_LEN));
+#ifdef HAVE_LINUX_UNIX_DIAG_H
+	rb_define_module_function(mLinux, "unix_diag_listener_stats",
+	                          unix_diag_listener_stats, -1);
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+	init_sampler(mLinux);
+#endif
 
 	page_size = getpagesize();
 
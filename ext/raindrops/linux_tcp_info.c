@@ -3,8 +3,60 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <linux/tcp.h>
+#include <string.h>
 #ifdef TCP_INFO
 #include "my_fileno.h"
+#include "histogram.h"
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#  include <ruby/thread.h>
+#  define WITHOUT_GVL(fn,a) \
+	rb_thread_call_without_gvl((fn),(a),RUBY_UBF_IO,0)
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+typedef VALUE (*my_blocking_fn_t)(void*);
+#  define WITHOUT_GVL(fn,a) \
+	rb_thread_blocking_region((my_blocking_fn_t)(fn),(a),RUBY_UBF_IO,0)
+#else
+#  define WITHOUT_GVL(fn,a) (fn)(a)
+#endif
+#ifndef SIZET2NUM
+#  define SIZET2NUM(x) ULONG2NUM(x)
+#endif
+
+/* every "tcpi_" field we expose, in struct order */
+#define TCPI_FIELDS(X) \
+	X(state) \
+	X(ca_state) \
+	X(retransmits) \
+	X(probes) \
+	X(backoff) \
+	X(options) \
+	X(snd_wscale) \
+	X(rcv_wscale) \
+	X(rto) \
+	X(ato) \
+	X(snd_mss) \
+	X(rcv_mss) \
+	X(unacked) \
+	X(sacked) \
+	X(lost) \
+	X(retrans) \
+	X(fackets) \
+	X(last_data_sent) \
+	X(last_ack_sent) \
+	X(last_data_recv) \
+	X(last_ack_recv) \
+	X(pmtu) \
+	X(rcv_ssthresh) \
+	X(rtt) \
+	X(rttvar) \
+	X(snd_ssthresh) \
+	X(snd_cwnd) \
+	X(advmss) \
+	X(reordering) \
+	X(rcv_rtt) \
+	X(rcv_space) \
+	X(total_retrans)
 
 #define TCPI_ATTR_READER(x) \
 static VALUE tcp_info_##x(VALUE self) \
@@ -13,38 +65,18 @@ static VALUE tcp_info_##x(VALUE self) \
 	return UINT2NUM((uint32_t)info->tcpi_##x); \
 }
 
-TCPI_ATTR_READER(state)
-TCPI_ATTR_READER(ca_state)
-TCPI_ATTR_READER(retransmits)
-TCPI_ATTR_READER(probes)
-TCPI_ATTR_READER(backoff)
-TCPI_ATTR_READER(options)
-TCPI_ATTR_READER(snd_wscale)
-TCPI_ATTR_READER(rcv_wscale)
-TCPI_ATTR_READER(rto)
-TCPI_ATTR_READER(ato)
-TCPI_ATTR_READER(snd_mss)
-TCPI_ATTR_READER(rcv_mss)
-TCPI_ATTR_READER(unacked)
-TCPI_ATTR_READER(sacked)
-TCPI_ATTR_READER(lost)
-TCPI_ATTR_READER(retrans)
-TCPI_ATTR_READER(fackets)
-TCPI_ATTR_READER(last_data_sent)
-TCPI_ATTR_READER(last_ack_sent)
-TCPI_ATTR_READER(last_data_recv)
-TCPI_ATTR_READER(last_ack_recv)
-TCPI_ATTR_READER(pmtu)
-TCPI_ATTR_READER(rcv_ssthresh)
-TCPI_ATTR_READER(rtt)
-TCPI_ATTR_READER(rttvar)
-TCPI_ATTR_READER(snd_ssthresh)
-TCPI_ATTR_READER(snd_cwnd)
-TCPI_ATTR_READER(advmss)
-TCPI_ATTR_READER(reordering)
-TCPI_ATTR_READER(rcv_rtt)
-TCPI_ATTR_READER(rcv_space)
-TCPI_ATTR_READER(total_retrans)
+TCPI_FIELDS(TCPI_ATTR_READER)
+
+/* readers indexed like tcpi_ids, called without method dispatch */
+#define TCPI_READER_PTR(x) tcp_info_##x,
+static VALUE (*const tcpi_readers[])(VALUE) = {
+	TCPI_FIELDS(TCPI_READER_PTR)
+};
+#define NR_TCPI (sizeof(tcpi_readers) / sizeof(tcpi_readers[0]))
+static ID tcpi_ids[NR_TCPI];
+
+/* size of each record packed by TCP_Info.sample and tcp_info_dump */
+const size_t rd_tcpi_len = sizeof(struct tcp_info);
 
 static VALUE alloc(VALUE klass)
 {
@@ -54,31 +86,204 @@ static VALUE alloc(VALUE klass)
 	return Data_Wrap_Struct(klass, NULL, -1, info);
 }
 
+/* copies a packed record, zero-filling fields older kernels lack */
+static void load(struct tcp_info *info, VALUE str)
+{
+	size_t len = (size_t)RSTRING_LEN(str);
+
+	if (len > sizeof(struct tcp_info))
+		len = sizeof(struct tcp_info);
+	memcpy(info, RSTRING_PTR(str), len);
+	memset((char *)info + len, 0, sizeof(struct tcp_info) - len);
+}
+
+static void refresh(struct tcp_info *info, VALUE io)
+{
+	socklen_t len = (socklen_t)sizeof(struct tcp_info);
+	int rc = getsockopt(my_fileno(io), IPPROTO_TCP, TCP_INFO, info, &len);
+
+	if (rc != 0)
+		rb_sys_fail("getsockopt");
+}
+
 /*
  * call-seq:
  *
  *	Raindrops::TCP_Info.new(tcp_socket)	-> TCP_Info object
+ *	Raindrops::TCP_Info.new(packed_string)	-> TCP_Info object
  *
  * Reads a TCP_Info object from any given +tcp_socket+.  See the tcp(7)
  * manpage and /usr/include/linux/tcp.h for more details.
+ *
+ * A +packed_string+ holding a "struct tcp_info" (such as a record
+ * returned by Raindrops::Linux.tcp_info_dump) may be given instead of
+ * a socket.
  */
 static VALUE init(VALUE self, VALUE io)
 {
-	int fd = my_fileno(io);
 	struct tcp_info *info = DATA_PTR(self);
-	socklen_t len = (socklen_t)sizeof(struct tcp_info);
-	int rc = getsockopt(fd, IPPROTO_TCP, TCP_INFO, info, &len);
 
-	if (rc != 0)
-		rb_sys_fail("getsockopt");
+	if (TYPE(io) == T_STRING)
+		load(info, io);
+	else
+		refresh(info, io);
+
+	return self;
+}
+
+/*
+ * call-seq:
+ *
+ *	tcp_info.refresh!(tcp_socket)	-> tcp_info
+ *
+ * Rereads the TCP_Info of +tcp_socket+ into the existing object, this
+ * avoids allocating a new object for every socket when scanning many.
+ */
+static VALUE refresh_bang(VALUE self, VALUE io)
+{
+	refresh(DATA_PTR(self), io);
 
 	return self;
 }
 
+/*
+ * call-seq:
+ *
+ *	tcp_info.to_a	-> [ state, ca_state, ..., total_retrans ]
+ *
+ * Returns the values of all fields in a single call, in the order
+ * they are listed in Raindrops::TCP_Info::FIELDS
+ */
+static VALUE to_a(VALUE self)
+{
+	VALUE rv = rb_ary_new2(NR_TCPI);
+	size_t i;
+
+	for (i = 0; i < NR_TCPI; i++)
+		rb_ary_push(rv, tcpi_readers[i](self));
+
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	tcp_info.values_at(:rtt, :snd_cwnd, ...)	-> [ rtt, snd_cwnd, ... ]
+ *
+ * Returns the values of the given fields in a single call
+ */
+static VALUE values_at(int argc, VALUE *argv, VALUE self)
+{
+	VALUE rv = rb_ary_new2(argc);
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		ID id = rb_to_id(argv[i]);
+		size_t j;
+
+		for (j = 0; j < NR_TCPI; j++)
+			if (tcpi_ids[j] == id)
+				break;
+		if (j == NR_TCPI)
+			rb_raise(rb_eArgError, "unknown field: %s",
+			         rb_id2name(id));
+		rb_ary_push(rv, tcpi_readers[j](self));
+	}
+
+	return rv;
+}
+
+struct sample_args {
+	int *fds;
+	struct tcp_info *out;
+	long nr;
+};
+
+/* does the getsockopt() calls for TCP_Info.sample, without the GVL */
+static void *sample_all(void *ptr)
+{
+	struct sample_args *a = ptr;
+	long i;
+
+	for (i = 0; i < a->nr; i++) {
+		char *dst = (char *)&a->out[i];
+		socklen_t len = (socklen_t)sizeof(struct tcp_info);
+
+		if (getsockopt(a->fds[i], IPPROTO_TCP, TCP_INFO, dst, &len))
+			len = 0;
+		memset(dst + len, 0, sizeof(struct tcp_info) - len);
+	}
+
+	return NULL;
+}
+
+/*
+ * call-seq:
+ *
+ *	Raindrops::TCP_Info.sample(tcp_sockets)	-> String
+ *
+ * Reads the TCP_Info of every socket in the +tcp_sockets+ Array with
+ * one call that does not hold the GVL, and returns them packed in a
+ * String.  Each record is Raindrops::TCP_Info::SIZE bytes long and
+ * may be passed to Raindrops::TCP_Info.new, no objects are allocated
+ * for individual sockets.  Records for sockets which could not be
+ * read (e.g. already shutdown by the peer) are zero-filled and have
+ * a +state+ of zero.
+ */
+static VALUE sample(VALUE klass, VALUE ios)
+{
+	struct sample_args a;
+	VALUE rv, tmp_fds, tmp_out;
+	long i;
+
+	Check_Type(ios, T_ARRAY);
+	a.nr = RARRAY_LEN(ios);
+
+	/*
+	 * ALLOCV buffers are never moved while we are without the GVL, and
+	 * GC frees them if my_fileno() or rb_str_new() raises
+	 */
+	a.fds = ALLOCV_N(int, tmp_fds, a.nr);
+	for (i = 0; i < a.nr; i++)
+		a.fds[i] = my_fileno(RARRAY_PTR(ios)[i]);
+	a.out = ALLOCV_N(struct tcp_info, tmp_out, a.nr);
+	WITHOUT_GVL(sample_all, &a);
+
+	rv = rb_str_new((const char *)a.out, a.nr * sizeof(struct tcp_info));
+	ALLOCV_END(tmp_out);
+	ALLOCV_END(tmp_fds);
+
+	return rv;
+}
+
+/*
+ * call-seq:
+ *
+ *	hist.record_last_data_recv(tcp_socket)	-> Integer
+ *
+ * Records the +last_data_recv+ field of the TCP_Info of +tcp_socket+
+ * into the Raindrops::Histogram +hist+ and returns it.  This is one
+ * getsockopt() call and a few atomic operations on shared memory,
+ * no TCP_Info object is allocated, so it is cheap enough for the
+ * accept path of every worker.  See Raindrops::Aggregate::LastDataRecv.
+ */
+static VALUE record_last_data_recv(VALUE self, VALUE io)
+{
+	struct rd_hist *h = rd_hist_get(self);
+	struct tcp_info info;
+
+	refresh(&info, io);
+	rd_hist_record(h, (unsigned long)info.tcpi_last_data_recv, 1);
+
+	return UINT2NUM((uint32_t)info.tcpi_last_data_recv);
+}
+
 void Init_raindrops_linux_tcp_info(void)
 {
 	VALUE cRaindrops = rb_const_get(rb_cObject, rb_intern("Raindrops"));
-	VALUE cTCP_Info;
+	VALUE cHistogram = rb_const_get(cRaindrops, rb_intern("Histogram"));
+	VALUE cTCP_Info, fields;
+	size_t i = 0;
 
 	/*
 	 * Document-class: Raindrops::TCP_Info
@@ -133,40 +338,30 @@ void Init_raindrops_linux_tcp_info(void)
 	rb_define_private_method(cTCP_Info, "initialize", init, 1);
 
 #define TCPI_DEFINE_METHOD(x) \
-	rb_define_method(cTCP_Info, #x, tcp_info_##x, 0)
-
-	TCPI_DEFINE_METHOD(state);
-	TCPI_DEFINE_METHOD(ca_state);
-	TCPI_DEFINE_METHOD(retransmits);
-	TCPI_DEFINE_METHOD(probes);
-	TCPI_DEFINE_METHOD(backoff);
-	TCPI_DEFINE_METHOD(options);
-	TCPI_DEFINE_METHOD(snd_wscale);
-	TCPI_DEFINE_METHOD(rcv_wscale);
-	TCPI_DEFINE_METHOD(rto);
-	TCPI_DEFINE_METHOD(ato);
-	TCPI_DEFINE_METHOD(snd_mss);
-	TCPI_DEFINE_METHOD(rcv_mss);
-	TCPI_DEFINE_METHOD(unacked);
-	TCPI_DEFINE_METHOD(sacked);
-	TCPI_DEFINE_METHOD(lost);
-	TCPI_DEFINE_METHOD(retrans);
-	TCPI_DEFINE_METHOD(fackets);
-	TCPI_DEFINE_METHOD(last_data_sent);
-	TCPI_DEFINE_METHOD(last_ack_sent);
-	TCPI_DEFINE_METHOD(last_data_recv);
-	TCPI_DEFINE_METHOD(last_ack_recv);
-	TCPI_DEFINE_METHOD(pmtu);
-	TCPI_DEFINE_METHOD(rcv_ssthresh);
-	TCPI_DEFINE_METHOD(rtt);
-	TCPI_DEFINE_METHOD(rttvar);
-	TCPI_DEFINE_METHOD(snd_ssthresh);
-	TCPI_DEFINE_METHOD(snd_cwnd);
-	TCPI_DEFINE_METHOD(advmss);
-	TCPI_DEFINE_METHOD(reordering);
-	TCPI_DEFINE_METHOD(rcv_rtt);
-	TCPI_DEFINE_METHOD(rcv_space);
-	TCPI_DEFINE_METHOD(total_retrans);
+	rb_define_method(cTCP_Info, #x, tcp_info_##x, 0);
+
+	TCPI_FIELDS(TCPI_DEFINE_METHOD)
+
+	rb_define_method(cTCP_Info, "refresh!", refresh_bang, 1);
+	rb_define_method(cTCP_Info, "to_a", to_a, 0);
+	rb_define_method(cTCP_Info, "values_at", values_at, -1);
+	rb_define_singleton_method(cTCP_Info, "sample", sample, 1);
+	rb_define_method(cHistogram, "record_last_data_recv",
+	                 record_last_data_recv, 1);
+
+	fields = rb_ary_new2(NR_TCPI);
+#define TCPI_ID(x) \
+	tcpi_ids[i] = rb_intern(#x); \
+	rb_ary_push(fields, ID2SYM(tcpi_ids[i++]));
+
+	TCPI_FIELDS(TCPI_ID)
+	OBJ_FREEZE(fields);
+
+	/* field names in the order returned by Raindrops::TCP_Info#to_a */
+	rb_define_const(cTCP_Info, "FIELDS", fields);
+
+	/* size of each record returned by Raindrops::TCP_Info.sample */
+	rb_define_const(cTCP_Info, "SIZE", SIZET2NUM(rd_tcpi_len));
 }
 #endif /* TCP_INFO */
 #endif /* __linux__ */
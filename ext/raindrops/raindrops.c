@@ -4,6 +4,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#ifdef HAVE_SCHED_GETCPU
+#  include <sched.h>
+#endif
 #include "raindrops_atomic.h"
 
 #ifndef SIZET2NUM
@@ -20,6 +27,8 @@
  */
 static size_t raindrop_size = 128;
 static size_t rd_page_size;
+static size_t rd_nr_cpus = 1;
+static VALUE sym_cpu, sym_shards;
 
 #define PAGE_MASK               (~(rd_page_size - 1))
 #define PAGE_ALIGN(addr)        (((addr) + rd_page_size - 1) & PAGE_MASK)
@@ -33,17 +42,67 @@ struct raindrop {
 struct raindrops {
 	size_t size;
 	size_t capa;
+	size_t shards;
+	size_t offset; /* non-zero for file-backed regions, see rd_s_open */
 	pid_t pid;
 	struct raindrop *drops;
 };
 
+/*
+ * on-disk header of file-backed Raindrops regions created by
+ * Raindrops.open, all fields are in native byte order.  External
+ * readers may mmap() the file and find counter +i+ and shard +s+ at:
+ *
+ *	offset + (i * shards + s) * slot_size
+ */
+#define RD_MAGIC "RAINDROP"
+#define RD_VERSION 1
+struct raindrops_hdr {
+	char magic[8];		/* RD_MAGIC, without the trailing '\0' */
+	uint32_t version;	/* RD_VERSION */
+	uint32_t slot_size;	/* Raindrops::SIZE of the creator */
+	uint64_t offset;	/* where the first counter starts */
+	uint64_t capa;		/* number of counters */
+	uint64_t shards;	/* slots per counter */
+};
+
+/*
+ * each counter is made up of +shards+ raindrops laid out next to
+ * each other, so this is the number of bytes between two counters
+ */
+static size_t rd_stride(const struct raindrops *r)
+{
+	return raindrop_size * r->shards;
+}
+
+/*
+ * upper bound for the counters of one mapping, this leaves room for
+ * page rounding and the header of file-backed regions without
+ * overflowing size_t or off_t
+ */
+#define RD_MAP_MAX (SIZE_MAX / 2)
+
+/* returns non-zero if +n+ counters of +shards+ slots each fit RD_MAP_MAX */
+static int rd_fits(uint64_t n, uint64_t shards)
+{
+	return shards >= 1 && shards <= RD_MAP_MAX / raindrop_size &&
+	       n <= RD_MAP_MAX / (raindrop_size * shards);
+}
+
+/* unmaps everything we mapped, including the header of file-backed regions */
+static int rd_munmap(struct raindrops *r, void *drops)
+{
+	return munmap((char *)drops - r->offset,
+	              r->offset + rd_stride(r) * r->capa);
+}
+
 /* called by GC */
 static void gcfree(void *ptr)
 {
 	struct raindrops *r = ptr;
 
 	if (r->drops != MAP_FAILED) {
-		int rv = munmap(r->drops, raindrop_size * r->capa);
+		int rv = rd_munmap(r, r->drops);
 		if (rv != 0)
 			rb_bug("munmap failed in gc: %s", strerror(errno));
 	}
@@ -58,6 +117,7 @@ static VALUE alloc(VALUE klass)
 	VALUE rv = Data_Make_Struct(klass, struct raindrops, NULL, gcfree, r);
 
 	r->drops = MAP_FAILED;
+	r->shards = 1;
 	return rv;
 }
 
@@ -73,32 +133,46 @@ static struct raindrops *get(VALUE self)
 	return r;
 }
 
-/*
- * call-seq:
- *	Raindrops.new(size)	-> raindrops object
- *
- * Initializes a Raindrops object to hold +size+ counters.  +size+ is
- * only a hint and the actual number of counters the object has is
- * dependent on the CPU model, number of cores, and page size of
- * the machine.  The actual size of the object will always be equal
- * or greater than the specified +size+.
- */
-static VALUE init(VALUE self, VALUE size)
+static size_t shards_arg(VALUE opts)
+{
+	VALUE tmp;
+	size_t shards;
+
+	if (NIL_P(opts))
+		return 1;
+	Check_Type(opts, T_HASH);
+	tmp = rb_hash_aref(opts, sym_shards);
+	if (NIL_P(tmp))
+		return 1;
+	if (tmp == sym_cpu)
+		return rd_nr_cpus;
+
+	shards = NUM2SIZET(tmp);
+	if (shards < 1)
+		rb_raise(rb_eArgError, "shards must be >= 1");
+	if (!rd_fits(1, shards))
+		rb_raise(rb_eRangeError, "too many shards");
+	return shards;
+}
+
+static void rd_init(struct raindrops *r, size_t size, size_t shards)
 {
-	struct raindrops *r = DATA_PTR(self);
 	int tries = 1;
 	size_t tmp;
 
 	if (r->drops != MAP_FAILED)
 		rb_raise(rb_eRuntimeError, "already initialized");
 
-	r->size = NUM2SIZET(size);
+	r->size = size;
 	if (r->size < 1)
 		rb_raise(rb_eArgError, "size must be >= 1");
+	if (!rd_fits(size, shards))
+		rb_raise(rb_eRangeError, "size too large");
+	r->shards = shards;
 
-	tmp = PAGE_ALIGN(raindrop_size * r->size);
-	r->capa = tmp / raindrop_size;
-	assert(PAGE_ALIGN(raindrop_size * r->capa) == tmp && "not aligned");
+	tmp = PAGE_ALIGN(rd_stride(r) * r->size);
+	r->capa = tmp / rd_stride(r);
+	assert(PAGE_ALIGN(rd_stride(r) * r->capa) == tmp && "not aligned");
 
 retry:
 	r->drops = mmap(NULL, tmp,
@@ -111,10 +185,186 @@ retry:
 		rb_sys_fail("mmap");
 	}
 	r->pid = getpid();
+}
+
+/*
+ * call-seq:
+ *	Raindrops.new(size)			-> raindrops object
+ *	Raindrops.new(size, :shards => :cpu)	-> raindrops object
+ *
+ * Initializes a Raindrops object to hold +size+ counters.  +size+ is
+ * only a hint and the actual number of counters the object has is
+ * dependent on the CPU model, number of cores, and page size of
+ * the machine.  The actual size of the object will always be equal
+ * or greater than the specified +size+.
+ *
+ * If +:shards+ is given, each counter is split across that many
+ * cache-line-sized slots and writers update the slot of the CPU they
+ * are running on.  This avoids bouncing one cache line between cores
+ * when many processes update the same counter, at the cost of having
+ * readers sum up every shard.  +:shards+ may be a positive Integer or
+ * +:cpu+ to use one shard per online CPU.
+ *
+ * RangeError is raised if +size+ and +:shards+ are too large to map.
+ */
+static VALUE init(int argc, VALUE *argv, VALUE self)
+{
+	VALUE size, opts;
+
+	rb_scan_args(argc, argv, "11", &size, &opts);
+	rd_init(DATA_PTR(self), NUM2SIZET(size), shards_arg(opts));
 
 	return self;
 }
 
+/* closes +fd+ (releasing its flock) and raises with errno preserved */
+static void open_sys_fail(int fd, const char *msg)
+{
+	int save_errno = errno;
+
+	(void)close(fd);
+	errno = save_errno;
+	rb_sys_fail(msg);
+}
+
+static void open_raise(int fd, VALUE path, const char *msg)
+{
+	(void)close(fd);
+	rb_raise(rb_eArgError, "%s: %s", msg, StringValueCStr(path));
+}
+
+static int lock_fd(int fd, int op)
+{
+	int rc;
+
+	do {
+		rc = flock(fd, op);
+	} while (rc != 0 && errno == EINTR);
+
+	return rc;
+}
+
+/*
+ * call-seq:
+ *	Raindrops.open(path, size[, options])	-> raindrops object
+ *
+ * Like Raindrops.new, but the counters are backed by the file at
+ * +path+ instead of anonymous memory.  Using a file in a tmpfs such as
+ * "/dev/shm" is recommended.  The file is created if it does not
+ * exist, otherwise its existing counters are reused.  This allows
+ * counters to survive a re-exec of the server (e.g. SIGUSR2 in
+ * Unicorn) and to be read by unrelated processes without going
+ * through a Ruby worker.
+ *
+ * The file starts with a small header recording the slot size, the
+ * number of counters and shards, and the offset of the first counter.
+ * See struct raindrops_hdr in raindrops.c for the exact layout.
+ *
+ * +options+ is a hash that accepts the following keys:
+ *
+ * * :shards - same as Raindrops.new, must match an existing file
+ * * :mode - permissions for newly created files (default: 0600)
+ *
+ * ArgumentError is raised if an existing file is too small or was
+ * created with an incompatible layout.  File-backed regions cannot
+ * be resized beyond their capacity.
+ */
+static VALUE rd_s_open(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE path, size, opts, rv, tmp;
+	struct raindrops *r;
+	struct raindrops_hdr hdr;
+	struct stat st;
+	void *base;
+	mode_t mode = 0600;
+	size_t len;
+	int fd;
+
+	rb_scan_args(argc, argv, "21", &path, &size, &opts);
+	rv = rb_obj_alloc(klass);
+	r = DATA_PTR(rv);
+	r->size = NUM2SIZET(size);
+	if (r->size < 1)
+		rb_raise(rb_eArgError, "size must be >= 1");
+	r->shards = shards_arg(opts);
+	if (!rd_fits(r->size, r->shards))
+		rb_raise(rb_eRangeError, "size too large");
+	if (!NIL_P(opts)) {
+		tmp = rb_hash_aref(opts, ID2SYM(rb_intern("mode")));
+		if (!NIL_P(tmp))
+			mode = (mode_t)NUM2UINT(tmp);
+	}
+
+	fd = open(StringValueCStr(path), O_RDWR|O_CREAT, mode);
+	if (fd < 0)
+		rb_sys_fail(RSTRING_PTR(path));
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* serialize header initialization with other processes */
+	if (lock_fd(fd, LOCK_EX) != 0)
+		open_sys_fail(fd, "flock");
+	if (fstat(fd, &st) != 0)
+		open_sys_fail(fd, "fstat");
+
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, RD_MAGIC, sizeof(hdr.magic));
+		hdr.version = RD_VERSION;
+		hdr.slot_size = (uint32_t)raindrop_size;
+		hdr.offset = PAGE_ALIGN(sizeof(hdr));
+		len = PAGE_ALIGN(rd_stride(r) * r->size);
+		hdr.capa = len / rd_stride(r);
+		hdr.shards = r->shards;
+		if (ftruncate(fd, (off_t)(hdr.offset + len)) != 0)
+			open_sys_fail(fd, "ftruncate");
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+			open_sys_fail(fd, "pwrite");
+	} else {
+		if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+			open_raise(fd, path, "truncated header");
+		if (memcmp(hdr.magic, RD_MAGIC, sizeof(hdr.magic)) ||
+		    hdr.version != RD_VERSION)
+			open_raise(fd, path, "not a Raindrops file");
+		if (hdr.slot_size != raindrop_size)
+			open_raise(fd, path, "slot size mismatch");
+		if (NIL_P(opts) ||
+		    NIL_P(rb_hash_aref(opts, sym_shards)))
+			r->shards = (size_t)hdr.shards;
+		if (hdr.shards != r->shards || hdr.shards < 1)
+			open_raise(fd, path, "shards mismatch");
+		if (hdr.capa < r->size)
+			open_raise(fd, path, "size exceeds capacity");
+		/* do not trust the header to keep the sums below in range */
+		if (!rd_fits(hdr.capa, hdr.shards) ||
+		    hdr.offset < sizeof(hdr) || hdr.offset > RD_MAP_MAX ||
+		    hdr.offset % rd_page_size)
+			open_raise(fd, path, "corrupt header");
+		len = (size_t)hdr.capa * rd_stride(r);
+		if (st.st_size < 0 ||
+		    (uint64_t)st.st_size < hdr.offset + len)
+			open_raise(fd, path, "truncated file");
+	}
+	r->capa = (size_t)hdr.capa;
+	r->offset = (size_t)hdr.offset;
+
+	base = mmap(NULL, r->offset + len,
+	            PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+		open_sys_fail(fd, "mmap");
+
+	/*
+	 * the mapping references the open file description, so close()
+	 * alone would not release the flock until munmap()
+	 */
+	(void)lock_fd(fd, LOCK_UN);
+	(void)close(fd);
+
+	r->drops = (struct raindrop *)((char *)base + r->offset);
+	r->pid = getpid();
+
+	return rv;
+}
+
 /*
  * mremap() is currently broken with MAP_SHARED
  * https://bugzilla.kernel.org/show_bug.cgi?id=8691
@@ -130,13 +380,17 @@ retry:
 #endif
 static void resize(struct raindrops *r, size_t new_rd_size)
 {
-	size_t old_size = raindrop_size * r->capa;
-	size_t new_size = PAGE_ALIGN(raindrop_size * new_rd_size);
+	size_t old_size = rd_stride(r) * r->capa;
+	size_t new_size = PAGE_ALIGN(rd_stride(r) * new_rd_size);
 	void *old_address = r->drops;
 	void *rv;
 
 	if (r->pid != getpid())
 		rb_raise(rb_eRuntimeError, "cannot mremap() from child");
+	if (r->offset)
+		rb_raise(rb_eRangeError, "cannot resize file-backed Raindrops");
+	if (!rd_fits(new_rd_size, r->shards))
+		rb_raise(rb_eRangeError, "size too large");
 
 	rv = mremap(old_address, old_size, new_size, MREMAP_MAYMOVE);
 	if (rv == MAP_FAILED) {
@@ -149,7 +403,7 @@ static void resize(struct raindrops *r, size_t new_rd_size)
 	}
 	r->drops = rv;
 	r->size = new_rd_size;
-	r->capa = new_size / raindrop_size;
+	r->capa = new_size / rd_stride(r);
 	assert(r->capa >= r->size && "bad sizing");
 }
 #else /* ! HAVE_MREMAP */
@@ -207,21 +461,76 @@ static VALUE init_copy(VALUE dest, VALUE source)
 	struct raindrops *dst = DATA_PTR(dest);
 	struct raindrops *src = get(source);
 
-	init(dest, SIZET2NUM(src->size));
-	memcpy(dst->drops, src->drops, raindrop_size * src->size);
+	rd_init(dst, src->size, src->shards);
+	memcpy(dst->drops, src->drops, rd_stride(src) * src->size);
 
 	return dest;
 }
 
-static unsigned long *addr_of(VALUE self, VALUE index)
+/* returns the address of the first shard of the counter at +i+ */
+static unsigned long *drop_at(struct raindrops *r, size_t i)
 {
-	struct raindrops *r = get(self);
-	unsigned long off = FIX2ULONG(index) * raindrop_size;
+	return (unsigned long *)((unsigned long)r->drops + i * rd_stride(r));
+}
+
+/* validates +index+ against the current size, never calls Ruby code */
+static size_t index_of(struct raindrops *r, VALUE index)
+{
+	long i;
 
-	if (off >= raindrop_size * r->size)
+	if (!FIXNUM_P(index)) {
+		if (TYPE(index) == T_BIGNUM)
+			rb_raise(rb_eArgError, "offset overrun");
+		rb_raise(rb_eTypeError, "index must be an Integer");
+	}
+	i = FIX2LONG(index);
+	if (i < 0 || (unsigned long)i >= r->size)
 		rb_raise(rb_eArgError, "offset overrun");
 
-	return (unsigned long *)((unsigned long)r->drops + off);
+	return (size_t)i;
+}
+
+/* returns the address of the first shard of the counter at +index+ */
+static unsigned long *addr_of(struct raindrops *r, VALUE index)
+{
+	return drop_at(r, index_of(r, index));
+}
+
+static unsigned long *shard_of(unsigned long *addr, size_t shard)
+{
+	return (unsigned long *)((unsigned long)addr + shard * raindrop_size);
+}
+
+/*
+ * picks the shard the current process writes to, the CPU we are on
+ * may change at any time, but every shard is updated atomically so
+ * this only affects cache locality and never correctness
+ */
+static size_t my_shard(struct raindrops *r)
+{
+	long shard;
+
+	if (r->shards == 1)
+		return 0;
+#ifdef HAVE_SCHED_GETCPU
+	shard = sched_getcpu();
+	if (shard < 0)
+#endif
+		shard = getpid();
+
+	return (size_t)shard % r->shards;
+}
+
+/* sums up all shards of a counter, racy with concurrent writers */
+static unsigned long sum_shards(struct raindrops *r, unsigned long *addr)
+{
+	unsigned long rv = *addr;
+	size_t i;
+
+	for (i = 1; i < r->shards; i++)
+		rv += *shard_of(addr, i);
+
+	return rv;
 }
 
 static unsigned long incr_decr_arg(int argc, const VALUE *argv)
@@ -239,12 +548,19 @@ static unsigned long incr_decr_arg(int argc, const VALUE *argv)
  *
  * Increments the value referred to by the +index+ by +number+.
  * +number+ defaults to +1+ if unspecified.
+ *
+ * Sharded Raindrops objects return +nil+ since no single slot holds
+ * the total, use rd[index] to read it.
  */
 static VALUE incr(int argc, VALUE *argv, VALUE self)
 {
+	struct raindrops *r = get(self);
 	unsigned long nr = incr_decr_arg(argc, argv);
+	unsigned long *addr = shard_of(addr_of(r, argv[0]), my_shard(r));
 
-	return ULONG2NUM(__sync_add_and_fetch(addr_of(self, argv[0]), nr));
+	nr = __sync_add_and_fetch(addr, nr);
+
+	return r->shards == 1 ? ULONG2NUM(nr) : Qnil;
 }
 
 /*
@@ -253,12 +569,255 @@ static VALUE incr(int argc, VALUE *argv, VALUE self)
  *
  * Decrements the value referred to by the +index+ by +number+.
  * +number+ defaults to +1+ if unspecified.
+ *
+ * Sharded Raindrops objects return +nil+ since no single slot holds
+ * the total, use rd[index] to read it.
  */
 static VALUE decr(int argc, VALUE *argv, VALUE self)
 {
+	struct raindrops *r = get(self);
 	unsigned long nr = incr_decr_arg(argc, argv);
+	unsigned long *addr = shard_of(addr_of(r, argv[0]), my_shard(r));
+
+	nr = __sync_sub_and_fetch(addr, nr);
+
+	return r->shards == 1 ? ULONG2NUM(nr) : Qnil;
+}
+
+/*
+ * the only slot of a counter for operations which need a single slot,
+ * sharded counters are sums with no single value to compare against
+ */
+static unsigned long *slot_of(struct raindrops *r, VALUE index)
+{
+	if (r->shards != 1)
+		rb_raise(rb_eArgError, "not supported with sharded Raindrops");
+
+	return addr_of(r, index);
+}
+
+/*
+ * call-seq:
+ *	rd.max!(index, number)	-> result
+ *
+ * Atomically stores +number+ in the slot designated by +index+ if it
+ * is greater than the current value and returns the resulting value.
+ * This allows processes to track a high-water mark without locking:
+ *
+ *	rd.max!(PEAK, rd.incr(CALLING))
+ */
+static VALUE max_bang(VALUE self, VALUE index, VALUE number)
+{
+	struct raindrops *r = get(self);
+	unsigned long *addr = slot_of(r, index);
+
+	return ULONG2NUM(rd_atomic_max(addr, NUM2ULONG(number)));
+}
+
+/*
+ * call-seq:
+ *	rd.min!(index, number)	-> result
+ *
+ * Atomically stores +number+ in the slot designated by +index+ if it
+ * is lower than the current value and returns the resulting value.
+ * The slot should be initialized to Raindrops::MAX first.
+ */
+static VALUE min_bang(VALUE self, VALUE index, VALUE number)
+{
+	struct raindrops *r = get(self);
+	unsigned long *addr = slot_of(r, index);
+
+	return ULONG2NUM(rd_atomic_min(addr, NUM2ULONG(number)));
+}
+
+/*
+ * call-seq:
+ *	rd.cas(index, old, new)	-> true or false
+ *
+ * Atomically stores +new+ in the slot designated by +index+ only if
+ * it currently holds +old+.  Returns +true+ if +new+ was stored.
+ */
+static VALUE cas(VALUE self, VALUE index, VALUE old, VALUE new)
+{
+	struct raindrops *r = get(self);
+	unsigned long *addr = slot_of(r, index);
+
+	return __sync_bool_compare_and_swap(addr, NUM2ULONG(old),
+	                                    NUM2ULONG(new)) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *	rd.swap(index, number)	-> previous
+ *
+ * Atomically stores +number+ in the slot designated by +index+ and
+ * returns the value it replaced.  Unlike reading and assigning
+ * separately, no concurrent increments are lost, so counters may be
+ * sampled and reset at the same time:
+ *
+ *	requests_since_last_sample = rd.swap(REQUESTS, 0)
+ */
+static VALUE swap(VALUE self, VALUE index, VALUE number)
+{
+	struct raindrops *r = get(self);
+	unsigned long *addr = slot_of(r, index);
+
+	return ULONG2NUM(rd_atomic_swap(addr, NUM2ULONG(number)));
+}
+
+/*
+ * call-seq:
+ *	rd.seqlock_read(index)	-> Array or nil
+ *
+ * Returns the values of all slots like +to_ary+, read as a seqlock
+ * reader where the slot designated by +index+ is the sequence counter.
+ * Writers increment the counter before and after modifying other
+ * slots, so it is odd while a write is in progress (+incr+ is a full
+ * memory barrier).  Returns +nil+ if a write was in progress or
+ * happened while reading, callers may retry or use older values.
+ *
+ *	rd.incr(SEQ)
+ *	rd[A] = a
+ *	rd[B] = b
+ *	rd.incr(SEQ)
+ *
+ *	vals = rd.seqlock_read(SEQ) # vals[A] and vals[B] are consistent
+ */
+static VALUE seqlock_read(VALUE self, VALUE index)
+{
+	struct raindrops *r = get(self);
+	volatile unsigned long *seqp = slot_of(r, index);
+	unsigned long seq, *buf;
+	VALUE tmp, rv = Qnil;
+	size_t i;
+
+	/* no allocations or Ruby calls between the two seq loads */
+	buf = ALLOCV_N(unsigned long, tmp, r->size);
+	seq = *seqp;
+	if (!(seq & 1)) {
+		__sync_synchronize(); /* load seq before the values */
+		for (i = 0; i < r->size; i++)
+			buf[i] = *(volatile unsigned long *)drop_at(r, i);
+		__sync_synchronize(); /* load the values before seq again */
+		if (*seqp == seq) {
+			rv = rb_ary_new2(r->size);
+			for (i = 0; i < r->size; i++)
+				rb_ary_push(rv, ULONG2NUM(buf[i]));
+		}
+	}
+	ALLOCV_END(tmp);
+
+	return rv;
+}
+
+/* a single update for Raindrops#apply, +delta+ may be negative */
+struct rd_delta {
+	unsigned long index;
+	long delta;
+};
+
+static void apply_str(struct raindrops *r, VALUE str)
+{
+	const char *p = RSTRING_PTR(str);
+	long i, n = RSTRING_LEN(str);
+	size_t shard;
+
+	if (n % sizeof(struct rd_delta))
+		rb_raise(rb_eArgError, "packed String length not a multiple "
+		         "of %lu", (unsigned long)sizeof(struct rd_delta));
+	n /= sizeof(struct rd_delta);
+
+	/* substrings may not be aligned, so copy each record out */
+	for (i = 0; i < n; i++) {
+		struct rd_delta d;
+
+		memcpy(&d, p + i * sizeof(d), sizeof(d));
+		if (d.index >= r->size)
+			rb_raise(rb_eArgError, "offset overrun");
+	}
+
+	shard = my_shard(r);
+	for (i = 0; i < n; i++) {
+		struct rd_delta d;
+
+		memcpy(&d, p + i * sizeof(d), sizeof(d));
+		__sync_add_and_fetch(shard_of(drop_at(r, d.index), shard),
+		                     (unsigned long)d.delta);
+	}
+}
+
+static void apply_ary(VALUE self, VALUE ary)
+{
+	long i, n = RARRAY_LEN(ary);
+	struct rd_delta *d;
+	struct raindrops *r;
+	size_t shard;
+	VALUE tmp;
+
+	/*
+	 * read every pair exactly once into C memory: NUM2LONG may call
+	 * #to_int, which may modify +ary+ or even resize or evaporate us
+	 */
+	d = ALLOCV_N(struct rd_delta, tmp, n);
+	for (i = 0; i < n; i++) {
+		VALUE pair = rb_ary_entry(ary, i);
+		VALUE index;
+
+		Check_Type(pair, T_ARRAY);
+		if (RARRAY_LEN(pair) != 2)
+			rb_raise(rb_eArgError, "expected [index, delta] pair");
+		index = rb_ary_entry(pair, 0);
+		d[i].index = (unsigned long)index_of(get(self), index);
+		d[i].delta = NUM2LONG(rb_ary_entry(pair, 1));
+	}
+
+	/* no Ruby code runs from here on, so we never apply partially */
+	r = get(self);
+	for (i = 0; i < n; i++)
+		if (d[i].index >= r->size)
+			rb_raise(rb_eArgError, "offset overrun");
+	shard = my_shard(r);
+	for (i = 0; i < n; i++)
+		__sync_add_and_fetch(shard_of(drop_at(r, d[i].index), shard),
+		                     (unsigned long)d[i].delta);
+	ALLOCV_END(tmp);
+}
 
-	return ULONG2NUM(__sync_sub_and_fetch(addr_of(self, argv[0]), nr));
+/*
+ * call-seq:
+ *	rd.apply([[index, delta], ...])		-> nil
+ *	rd.apply(packed_string)			-> nil
+ *
+ * Atomically adds each (signed) +delta+ to the slot designated by
+ * +index+ in a single method call.  All indices are validated before
+ * any slot is updated.  Each individual update is atomic, but other
+ * processes may observe some updates before others.
+ *
+ * +packed_string+ is a String of native (unsigned long, long) pairs,
+ * allowing workers to cheaply buffer updates and flush them later:
+ *
+ *	buf = ""
+ *	buf << [ 0, 1 ].pack("L!l!")
+ *	buf << [ 2, -1 ].pack("L!l!")
+ *	rd.apply(buf)
+ */
+static VALUE apply(VALUE self, VALUE deltas)
+{
+	struct raindrops *r = get(self);
+
+	switch (TYPE(deltas)) {
+	case T_STRING:
+		apply_str(r, deltas);
+		break;
+	case T_ARRAY:
+		apply_ary(self, deltas);
+		break;
+	default:
+		rb_raise(rb_eTypeError,
+		         "deltas must be an Array of pairs or a packed String");
+	}
+
+	return Qnil;
 }
 
 /*
@@ -275,8 +834,8 @@ static VALUE to_ary(VALUE self)
 	unsigned long base = (unsigned long)r->drops;
 
 	for (i = 0; i < r->size; i++) {
-		rb_ary_push(rv, ULONG2NUM(*((unsigned long *)base)));
-		base += raindrop_size;
+		rb_ary_push(rv, ULONG2NUM(sum_shards(r, (unsigned long *)base)));
+		base += rd_stride(r);
 	}
 
 	return rv;
@@ -300,12 +859,19 @@ static VALUE size(VALUE self)
  *	rd[index] = value
  *
  * Assigns +value+ to the slot designated by +index+
+ *
+ * For sharded Raindrops objects, this clears all other shards and is
+ * not atomic with respect to concurrent writers.
  */
 static VALUE aset(VALUE self, VALUE index, VALUE value)
 {
-	unsigned long *addr = addr_of(self, index);
+	struct raindrops *r = get(self);
+	unsigned long *addr = addr_of(r, index);
+	size_t i;
 
 	*addr = NUM2ULONG(value);
+	for (i = 1; i < r->shards; i++)
+		*shard_of(addr, i) = 0;
 
 	return value;
 }
@@ -318,9 +884,25 @@ static VALUE aset(VALUE self, VALUE index, VALUE value)
  */
 static VALUE aref(VALUE self, VALUE index)
 {
-	return  ULONG2NUM(*addr_of(self, index));
+	struct raindrops *r = get(self);
+
+	return ULONG2NUM(sum_shards(r, addr_of(r, index)));
+}
+
+/*
+ * call-seq:
+ *	rd.shards	-> Integer
+ *
+ * Returns the number of shards each counter is split across,
+ * this is +1+ unless +:shards+ was given to Raindrops.new
+ */
+static VALUE shards(VALUE self)
+{
+	return SIZET2NUM(get(self)->shards);
 }
 
+void Init_raindrops_histogram(void);
+void Init_raindrops_history(void);
 #ifdef __linux__
 void Init_raindrops_linux_inet_diag(void);
 void Init_raindrops_linux_tcp_info(void);
@@ -349,7 +931,7 @@ static VALUE evaporate_bang(VALUE self)
 	void *addr = r->drops;
 
 	r->drops = MAP_FAILED;
-	if (munmap(addr, raindrop_size * r->capa) != 0)
+	if (rd_munmap(r, addr) != 0)
 		rb_sys_fail("munmap");
 	return Qnil;
 }
@@ -361,6 +943,8 @@ void Init_raindrops_ext(void)
 
 #ifdef _SC_NPROCESSORS_ONLN
 	tmp = sysconf(_SC_NPROCESSORS_ONLN);
+	if (tmp > 0)
+		rd_nr_cpus = (size_t)tmp;
 #endif
 	/* no point in padding on single CPU machines */
 	if (tmp == 1)
@@ -411,19 +995,33 @@ void Init_raindrops_ext(void)
 	rb_define_const(cRaindrops, "MAX", ULONG2NUM((unsigned long)-1));
 
 	rb_define_alloc_func(cRaindrops, alloc);
+	rb_define_singleton_method(cRaindrops, "open", rd_s_open, -1);
+
+	sym_cpu = ID2SYM(rb_intern("cpu"));
+	sym_shards = ID2SYM(rb_intern("shards"));
 
-	rb_define_method(cRaindrops, "initialize", init, 1);
+	rb_define_method(cRaindrops, "initialize", init, -1);
 	rb_define_method(cRaindrops, "incr", incr, -1);
 	rb_define_method(cRaindrops, "decr", decr, -1);
+	rb_define_method(cRaindrops, "apply", apply, 1);
+	rb_define_method(cRaindrops, "max!", max_bang, 2);
+	rb_define_method(cRaindrops, "min!", min_bang, 2);
+	rb_define_method(cRaindrops, "cas", cas, 3);
+	rb_define_method(cRaindrops, "swap", swap, 2);
+	rb_define_method(cRaindrops, "seqlock_read", seqlock_read, 1);
 	rb_define_method(cRaindrops, "to_ary", to_ary, 0);
 	rb_define_method(cRaindrops, "[]", aref, 1);
 	rb_define_method(cRaindrops, "[]=", aset, 2);
 	rb_define_method(cRaindrops, "size", size, 0);
 	rb_define_method(cRaindrops, "size=", setsize, 1);
 	rb_define_method(cRaindrops, "capa", capa, 0);
+	rb_define_method(cRaindrops, "shards", shards, 0);
 	rb_define_method(cRaindrops, "initialize_copy", init_copy, 1);
 	rb_define_method(cRaindrops, "evaporate!", evaporate_bang, 0);
 
+	Init_raindrops_histogram();
+	Init_raindrops_history();
+
 #ifdef __linux__
 	Init_raindrops_linux_inet_diag();
 	Init_raindrops_linux_tcp_info();
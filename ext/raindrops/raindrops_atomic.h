@@ -20,4 +20,54 @@ __sync_sub_and_fetch(unsigned long *dst, unsigned long incr)
 
         return (unsigned long)tmp - incr;
 }
+
+static inline int
+__sync_bool_compare_and_swap(unsigned long *dst,
+                             unsigned long old, unsigned long new)
+{
+        return AO_compare_and_swap((AO_t *)dst, (AO_t)old, (AO_t)new);
+}
 #endif /* HAVE_GCC_ATOMIC_BUILTINS */
+
+/*
+ * compare-and-swap loops for operations without a single instruction,
+ * these work on any unsigned long in shared memory
+ */
+
+/* stores +v+ if it is greater, returns the resulting value */
+static inline unsigned long rd_atomic_max(unsigned long *dst, unsigned long v)
+{
+	unsigned long cur = *dst;
+
+	while (v > cur) {
+		if (__sync_bool_compare_and_swap(dst, cur, v))
+			return v;
+		cur = *dst;
+	}
+	return cur;
+}
+
+/* stores +v+ if it is lower, returns the resulting value */
+static inline unsigned long rd_atomic_min(unsigned long *dst, unsigned long v)
+{
+	unsigned long cur = *dst;
+
+	while (v < cur) {
+		if (__sync_bool_compare_and_swap(dst, cur, v))
+			return v;
+		cur = *dst;
+	}
+	return cur;
+}
+
+/* stores +v+ unconditionally, returns the previous value */
+static inline unsigned long rd_atomic_swap(unsigned long *dst, unsigned long v)
+{
+	unsigned long cur;
+
+	do {
+		cur = *dst;
+	} while (!__sync_bool_compare_and_swap(dst, cur, v));
+
+	return cur;
+}
@@ -9,6 +9,12 @@
 #   rd.incr(0, 1)   -> 1
 #   rd.to_ary       -> [ 1, 0, 0, 0 ]
 #
+# Heavily-contended counters may be split into per-CPU shards to
+# avoid bouncing a single cache line between cores, reads will sum
+# up all shards:
+#
+#   rd = Raindrops.new 4, :shards => :cpu
+#
 # Unlike many classes in this package, the core Raindrops class is
 # intended to be portable to all reasonably modern *nix systems
 # supporting mmap().  Please let us know if you have portability
@@ -38,11 +44,21 @@ class Raindrops
     end
   end
 
+  # This structure is returned by Raindrops::Linux.tcp_listener_queue_ages
+  # and holds how long connections currently in the listen queue of a
+  # listener have been waiting, in milliseconds.  +max+, +p50+ and +p99+
+  # are +nil+ if +count+ is zero.
+  #
+  # These stats are currently only available under \Linux
+  class QueueAges < Struct.new(:count, :max, :p50, :p99)
+  end
+
   autoload :Linux, 'raindrops/linux'
   autoload :Struct, 'raindrops/struct'
   autoload :Middleware, 'raindrops/middleware'
   autoload :Aggregate, 'raindrops/aggregate'
   autoload :LastDataRecv, 'raindrops/last_data_recv'
   autoload :Watcher, 'raindrops/watcher'
+  autoload :OpenMetrics, 'raindrops/open_metrics'
 end
 require 'raindrops_ext'
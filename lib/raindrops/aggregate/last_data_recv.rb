@@ -7,6 +7,13 @@ require "socket"
 # is designed to be used with Raindrops::LastDataRecv Rack application
 # but can be easily changed to work with other stats collection devices.
 #
+# Recording into a Raindrops::Histogram avoids the \Aggregate master
+# and allocating a TCP_Info object for every accepted client, only one
+# getsockopt() and a few atomic operations on shared memory remain:
+#
+#   Raindrops::Aggregate::LastDataRecv.default_aggregate =
+#     Raindrops::Histogram.new
+#
 # Methods wrapped include:
 # - TCPServer#accept
 # - TCPServer#accept_nonblock
@@ -25,7 +32,8 @@ module Raindrops::Aggregate::LastDataRecv
   @@default_aggregate = nil
 
   # By default, this is a Raindrops::Aggregate::PMQ object
-  # It may be anything that responds to *<<*
+  # It may be anything that responds to *<<*, a Raindrops::Histogram
+  # is recorded into without allocating objects
   def self.default_aggregate
     @@default_aggregate ||= Raindrops::Aggregate::PMQ.new
   end
@@ -78,8 +86,12 @@ module Raindrops::Aggregate::LastDataRecv
   # +last_data_recv+ to be accurate
   def count!(io)
     if io
-      x = TCP_Info.new(io)
-      @raindrops_aggregate << x.last_data_recv
+      agg = @raindrops_aggregate
+      if Raindrops::Histogram === agg
+        agg.record_last_data_recv(io)
+      else
+        agg << TCP_Info.new(io).last_data_recv
+      end
     end
     io
   end
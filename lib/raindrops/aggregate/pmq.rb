@@ -1,10 +1,6 @@
 # -*- encoding: binary -*-
-require "tempfile"
 require "aggregate"
 require "posix_mq"
-require "fcntl"
-require "io/extra"
-require "thread"
 
 # \Aggregate + POSIX message queues support for Ruby 1.9 and \Linux
 #
@@ -19,7 +15,6 @@ require "thread"
 # or libraries:
 #
 # * aggregate (tested with 0.2.2)
-# * io-extra  (tested with 1.2.3)
 # * posix_mq  (tested with 1.0.0)
 #
 # == Design
@@ -27,21 +22,66 @@ require "thread"
 # There is one master thread which aggregates statistics.  Individual
 # worker processes or threads will write to a shared POSIX message
 # queue (default: "/raindrops") that the master reads from.  At a
-# predefined interval, the master thread will write out to a shared,
-# anonymous temporary file that workers may read from
+# predefined interval, the master thread will publish a snapshot of the
+# \Aggregate to shared memory that workers may read from.
 #
 # Setting +:worker_interval+ and +:master_interval+ to +1+ will result
 # in perfect accuracy but at the cost of a high synchronization
 # overhead.  Larger intervals mean less frequent messaging for higher
 # performance but lower accuracy.
+#
+# Workers pre-aggregate samples into a local copy of the \Aggregate
+# buckets, keeping a count, sum and sum of squares for each bucket (and
+# for the low and high outliers) along with the minimum and maximum of
+# the batch.  Each message carries these bucket deltas in a packed binary
+# format which the master adds straight into its \Aggregate, so the cost
+# of a message depends on the number of buckets touched and not on the
+# number of samples:
+#
+#   uint8_t  version;  currently 2, 0 stops the master loop
+#   uint8_t  min_type; T_INT (int64_t) or T_FLOAT (double)
+#   uint8_t  max_type; T_INT (int64_t) or T_FLOAT (double)
+#   uint32_t nr;       number of buckets
+#   int64_t or double min;
+#   int64_t or double max;
+#   { int32_t bucket; uint32_t count; double sum; double sum2; } buckets[nr];
+#
+# +bucket+ is an index into the \Aggregate buckets, or LOW or HIGH for
+# outliers.  All fields are packed without padding in native byte order,
+# as the queue never leaves the host.  This relies on the internals of
+# \Aggregate (tested with 0.2.2) to find the bucket of a sample and to
+# merge into it.
+#
+# The snapshot is a Raindrops object with a fixed layout: a sequence
+# counter followed by every instance variable of the \Aggregate (the
+# same state Marshal would dump) as a type tag and 8 bytes of data.
+# The master increments the sequence counter before and after writing,
+# and readers retry until they copy out an even, unchanged sequence,
+# falling back to their last good copy if the master died mid-write.
+# So reads need no syscalls, locks or Marshal, and never block the
+# master.
 class Raindrops::Aggregate::PMQ
 
   # :stopdoc:
-  # These constants are for Linux.  This is designed for aggregating
-  # TCP_INFO.
-  RDLOCK = [ Fcntl::F_RDLCK ].pack("s @256")
-  WRLOCK = [ Fcntl::F_WRLCK ].pack("s @256")
-  UNLOCK = [ Fcntl::F_UNLCK ].pack("s @256")
+  # wire format, see "Design" above
+  VERSION = 2
+  HEADER = "CCCL"
+  HEADER_SIZE = 7
+  MINMAX_SIZE = 16
+  BUCKET = "lLDD"
+  BUCKET_SIZE = 24
+  LOW, HIGH = -1, -2 # outlier buckets
+  INT_MIN = -(1 << 63)
+  INT_MAX = (1 << 63) - 1
+  COUNT_MAX = (1 << 32) - 1
+  STOP = [ 0, 0, 0, 0 ].pack(HEADER).freeze
+
+  # snapshot layout, see "Design" above
+  SEQ = 0
+  SEQ_RETRIES = 1000 # before falling back to the last good snapshot
+  WORDS = 8 / [ 0 ].pack("L!").bytesize # per value, after the tag
+  T_NIL, T_INT, T_FLOAT, T_TRUE, T_FALSE = 0, 1, 2, 3, 4
+  VALUE_FORMAT = { T_INT => "q", T_FLOAT => "D" }
   # :startdoc:
 
   # returns the number of dropped messages sent to a POSIX message
@@ -73,17 +113,27 @@ class Raindrops::Aggregate::PMQ
       :aggregate => Aggregate.new,
     }.merge! params
     @master_interval = opts[:master_interval]
-    @worker_interval = opts[:worker_interval]
+    @worker_interval = opts[:worker_interval] || 1
+    # per-bucket counts must fit in a message
+    @worker_interval = COUNT_MAX if @worker_interval > COUNT_MAX
     @aggregate = opts[:aggregate]
-    @worker_queue = @worker_interval ? [] : nil
-    @mutex = Mutex.new
+    @aggregate.respond_to?(:to_index, true) or
+      raise ArgumentError, "#{@aggregate.class} does not bucket like Aggregate"
+    @low = @aggregate.instance_variable_get(:@low)
+    @high = @aggregate.instance_variable_get(:@high)
+    @pending = {} # bucket => [ count, sum, sum2 ]
+    @nr_pending = 0
 
     @mq_name = opts[:queue]
     mq = POSIX_MQ.new @mq_name, :w, opts[:mq_umask], opts[:mq_attr]
-    Tempfile.open("raindrops_pmq") do |t|
-      @wr = File.open(t.path, "wb")
-      @rd = File.open(t.path, "rb")
-    end
+
+    # flush early rather than exceeding the queue message size
+    @max_buckets = (mq.attr.msgsize - HEADER_SIZE - MINMAX_SIZE) / BUCKET_SIZE
+    @max_buckets >= 1 or raise ArgumentError, "mq_attr msgsize too small"
+    @layout = snapshot_layout(@aggregate)
+    @snapshot = Raindrops.new(@layout.inject(1) { |n, (_, len)|
+      n + (len || 1) * (1 + WORDS)
+    })
     @cached_aggregate = @aggregate
     flush_master
     @mq_send = if opts[:lossy]
@@ -97,20 +147,66 @@ class Raindrops::Aggregate::PMQ
 
   # adds a sample to the underlying \Aggregate object
   def << val
-    if q = @worker_queue
-      q << val
-      if q.size >= @worker_interval
-        mq_send(q) or @nr_dropped += 1
-        q.clear
-      end
+    q = @pending
+    if val < @low
+      bucket = LOW
+    elsif val >= @high
+      bucket = HIGH
+    else
+      bucket = @aggregate.__send__(:to_index, val)
+    end
+    # sums start as Floats, exactly like they do in \Aggregate
+    if s = q[bucket]
+      s[0] += 1
+      s[1] += val
+      s[2] += val * val
     else
-      mq_send(val) or @nr_dropped += 1
+      q[bucket] = [ 1, 0.0 + val, 0.0 + val * val ]
     end
+    if @nr_pending == 0
+      @pending_min = @pending_max = val
+    else
+      @pending_min = val if val < @pending_min
+      @pending_max = val if val > @pending_max
+    end
+    @nr_pending += 1
+    flush if @nr_pending >= @worker_interval || q.size >= @max_buckets
   end
 
-  def mq_send(val) # :nodoc:
+  def mq_send(msg) # :nodoc:
     @cached_aggregate = nil
-    @mq_send.call Marshal.dump(val)
+    @mq_send.call msg
+  end
+
+  # packs bucket => [ count, sum, sum2 ] deltas and the minimum and
+  # maximum sample into a single message
+  def self.pack(hist, min, max) # :nodoc:
+    min_type, min = wire_value(min)
+    max_type, max = wire_value(max)
+    msg = [ VERSION, min_type, max_type, hist.size, min, max ]
+    hist.each { |bucket, (n, sum, sum2)| msg.push(bucket, n, sum, sum2) }
+    msg.pack("#{HEADER}#{VALUE_FORMAT[min_type]}#{VALUE_FORMAT[max_type]}" \
+             "#{BUCKET * hist.size}")
+  end
+
+  def self.wire_value(val) # :nodoc:
+    Integer === val && val >= INT_MIN && val <= INT_MAX ?
+      [ T_INT, val ] : [ T_FLOAT, val.to_f ]
+  end
+
+  # unpacks a message into [ min, max, [ bucket, count, sum, sum2, ... ] ],
+  # returns nil for the stop message and false if invalid
+  def self.unpack(msg) # :nodoc:
+    return false if msg.bytesize < HEADER_SIZE
+    version, min_type, max_type, nr = msg.unpack(HEADER)
+    return nil if version == 0
+    min_fmt, max_fmt = VALUE_FORMAT[min_type], VALUE_FORMAT[max_type]
+    return false if version != VERSION || ! min_fmt || ! max_fmt ||
+                    msg.bytesize != HEADER_SIZE + MINMAX_SIZE +
+                                    nr * BUCKET_SIZE
+    min, max, *buckets = msg.unpack("@#{HEADER_SIZE}#{min_fmt}#{max_fmt}" \
+                                    "#{BUCKET * nr}")
+    [ min, max, buckets ]
   end
 
   #
@@ -131,12 +227,11 @@ class Raindrops::Aggregate::PMQ
         flush_master
       end
       mq.shift(buf)
-      data = begin
-        Marshal.load(buf) or return
-      rescue ArgumentError, TypeError
-        next
+      case data = self.class.unpack(buf)
+      when nil then return
+      when false then next
       end
-      Array === data ? data.each { |x| a << x } : a << data
+      merge(a, data)
     rescue Errno::EINTR
     rescue => e
       warn "Unhandled exception in #{__FILE__}:#{__LINE__}: #{e}"
@@ -146,60 +241,173 @@ class Raindrops::Aggregate::PMQ
       flush_master
   end
 
+  # adds bucket deltas unpacked from a message straight into +agg+,
+  # the same way \Aggregate#<< would for each sample
+  def merge(agg, data) # :nodoc:
+    min, max, buckets = data
+    count = agg.instance_variable_get(:@count)
+    if count == 0
+      agg.instance_variable_set(:@min, min)
+      agg.instance_variable_set(:@max, max)
+    else
+      min < agg.min and agg.instance_variable_set(:@min, min)
+      max > agg.max and agg.instance_variable_set(:@max, max)
+    end
+    sum = agg.instance_variable_get(:@sum)
+    sum2 = agg.instance_variable_get(:@sum2)
+    counts = agg.instance_variable_get(:@buckets)
+    i = 0
+    while bucket = buckets[i]
+      n = buckets[i + 1]
+      count += n
+      sum += buckets[i + 2]
+      sum2 += buckets[i + 3]
+      case bucket
+      when LOW
+        agg.instance_variable_set(:@outliers_low, agg.outliers_low + n)
+      when HIGH
+        agg.instance_variable_set(:@outliers_high, agg.outliers_high + n)
+      else
+        counts[bucket] += n
+      end
+      i += 4
+    end
+    agg.instance_variable_set(:@count, count)
+    agg.instance_variable_set(:@sum, sum)
+    agg.instance_variable_set(:@sum2, sum2)
+  end
+
   # Loads the last shared \Aggregate from the master thread/process
   def aggregate
     @cached_aggregate ||= begin
       flush
-      Marshal.load(synchronize(@rd, RDLOCK) do |rd|
-        IO.pread rd.fileno, rd.stat.size, 0
-      end)
+      load_snapshot
     end
   end
 
-  # Flushes the currently aggregate statistics to a temporary file.
-  # There is no need to call this explicitly as +:worker_interval+ defines
-  # how frequently your data will be flushed for workers to read.
+  # Publishes the current aggregate statistics to shared memory.
+  # There is no need to call this explicitly as +:master_interval+ defines
+  # how frequently the master publishes data for workers to read.
   def flush_master
-    dump = Marshal.dump @aggregate
-    synchronize(@wr, WRLOCK) do |wr|
-      wr.truncate 0
-      IO.pwrite wr.fileno, dump, 0
+    raw = []
+    @layout.each do |ivar, len|
+      val = @aggregate.instance_variable_get(ivar)
+      if len
+        Array === val && val.size == len or
+          raise TypeError, "#{ivar} changed size"
+        val.each { |x| snapshot_encode(raw, x) }
+      else
+        snapshot_encode(raw, val)
+      end
     end
+
+    rd = @snapshot
+    # a master which died while writing left SEQ odd, this is the only
+    # writer so restore even parity or readers would never succeed
+    rd.incr(SEQ) if rd[SEQ].odd?
+    rd.incr(SEQ) # incr is a full memory barrier, see load_snapshot
+    raw.each_with_index { |x, i| rd[i + 1] = x }
+    rd.incr(SEQ)
   end
 
-  # stops the currently running master loop, may be called from any
-  # worker thread or process
-  def stop_master_loop
-    sleep 0.1 until mq_send(false)
-    rescue Errno::EINTR
-      retry
+  # returns an array of [ ivar, length ] pairs, length is nil for
+  # scalar instance variables
+  def snapshot_layout(agg) # :nodoc:
+    # \Aggregate only sets some instance variables (@min, @max) on the
+    # first sample, so look at a deep copy which has seen one, too
+    probe = Marshal.load(Marshal.dump(agg))
+    probe << 1
+    (agg.instance_variables | probe.instance_variables).map do |ivar|
+      val = agg.instance_variable_get(ivar)
+      val = probe.instance_variable_get(ivar) if val.nil?
+      if Array === val
+        val.each { |x| snapshot_encode([], x) }
+        [ ivar, val.size ]
+      else
+        snapshot_encode([], val)
+        [ ivar, nil ]
+      end
+    end
   end
 
-  def lock! io, type # :nodoc:
-    io.fcntl Fcntl::F_SETLKW, type
-    rescue Errno::EINTR
-      retry
+  def snapshot_encode(raw, val) # :nodoc:
+    case val
+    when nil, true, false
+      raw << (val.nil? ? T_NIL : (val ? T_TRUE : T_FALSE))
+      WORDS.times { raw << 0 }
+      return raw
+    when Integer
+      if val >= INT_MIN && val <= INT_MAX
+        return raw.push(T_INT, *[ val ].pack("q").unpack("L!*"))
+      end
+      val = val.to_f
+    when Float
+    else
+      raise TypeError, "can not share #{val.class} in #{@aggregate.class}"
+    end
+    raw.push(T_FLOAT, *[ val ].pack("D").unpack("L!*"))
   end
 
-  # we use both a mutex for thread-safety and fcntl lock for process-safety
-  def synchronize io, type # :nodoc:
-    @mutex.synchronize do
-      begin
-        lock! io, type
-        yield io
-      ensure
-        lock! io, UNLOCK
+  def snapshot_decode(raw, i) # :nodoc:
+    case raw[i]
+    when T_INT then raw[i + 1, WORDS].pack("L!*").unpack("q")[0]
+    when T_FLOAT then raw[i + 1, WORDS].pack("L!*").unpack("D")[0]
+    when T_TRUE then true
+    when T_FALSE then false
+    end
+  end
+
+  # seqlock reader, copies the snapshot into a new \Aggregate object
+  def load_snapshot # :nodoc:
+    # Raindrops#seqlock_read has the memory barriers a reader needs
+    tries = SEQ_RETRIES
+    until raw = @snapshot.seqlock_read(SEQ)
+      if (tries -= 1) <= 0
+        # the master may have died while writing
+        raw = @last_snapshot or
+          raise RuntimeError, "no consistent snapshot from the master"
+        break
+      end
+      Thread.pass # the master is writing
+    end
+    @last_snapshot = raw
+
+    agg = @aggregate.class.allocate
+    i = 1
+    @layout.each do |ivar, len|
+      if len
+        val = Array.new(len)
+        len.times do |j|
+          val[j] = snapshot_decode(raw, i)
+          i += 1 + WORDS
+        end
+      else
+        val = snapshot_decode(raw, i)
+        i += 1 + WORDS
       end
+      agg.instance_variable_set(ivar, val)
     end
+    agg
+  end
+
+  # stops the currently running master loop, may be called from any
+  # worker thread or process
+  def stop_master_loop
+    sleep 0.1 until mq_send(STOP)
+    rescue Errno::EINTR
+      retry
   end
 
   # flushes the local queue of the worker process, sending all pending
   # data to the master.  There is no need to call this explicitly as
   # +:worker_interval+ defines how frequently your queue will be flushed
   def flush
-    if q = @local_queue && ! q.empty?
-      mq_send q
+    q = @pending
+    unless q.empty?
+      mq_send(self.class.pack(q, @pending_min, @pending_max)) or
+        @nr_dropped += 1
       q.clear
+      @nr_pending = 0
     end
     nil
   end
@@ -23,6 +23,10 @@ require "raindrops"
 # - X-Outliers-Low - number of low outliers (hopefully many!)
 # - X-Outliers-High - number of high outliers (hopefully zero!)
 #
+# If the aggregate is a Raindrops::Histogram, the standard deviation and
+# outlier headers are omitted and the body has one "lower..upper<TAB>count"
+# line for every non-empty bucket.
+#
 # == To use with Unicorn and derived servers (preload_app=false):
 #
 # Put the following in our Unicorn config file (not config.ru):
@@ -68,7 +72,9 @@ class Raindrops::LastDataRecv
   # trigger autoloads
   if defined?(Unicorn)
     agg = Raindrops::Aggregate::LastDataRecv.default_aggregate
-    AGGREGATE_THREAD = Thread.new { agg.master_loop }
+    if agg.respond_to?(:master_loop)
+      AGGREGATE_THREAD = Thread.new { agg.master_loop }
+    end
   end
   # :startdoc
 
@@ -89,11 +95,18 @@ class Raindrops::LastDataRecv
       headers["X-Min"] = a.min.to_s
       headers["X-Max"] = a.max.to_s
       headers["X-Mean"] = a.mean.round.to_s
-      headers["X-Std-Dev"] = a.std_dev.round.to_s
-      headers["X-Outliers-Low"] = a.outliers_low.to_s
-      headers["X-Outliers-High"] = a.outliers_high.to_s
     end
-    body = a.to_s
+    if Raindrops::Histogram === a
+      body = ""
+      a.each_nonzero { |lo, hi, n| body << "#{lo}..#{hi}\t#{n}\n" }
+    else
+      if count > 1
+        headers["X-Std-Dev"] = a.std_dev.round.to_s
+        headers["X-Outliers-Low"] = a.outliers_low.to_s
+        headers["X-Outliers-High"] = a.outliers_high.to_s
+      end
+      body = a.to_s
+    end
     headers["Content-Length"] = body.size.to_s
     [ 200, headers, [ body ] ]
   end
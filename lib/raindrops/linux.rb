@@ -30,11 +30,33 @@ module Raindrops::Linux
   # * SS_CONNECTING maps to ListenStats#queued
   # * SS_CONNECTED maps to ListenStats#active
   #
-  # This method may be significantly slower than its tcp_listener_stats
+  # This uses the unix_diag facility of netlink (see
+  # unix_diag_listener_stats) when the kernel supports it and falls
+  # back to parsing /proc/net/unix otherwise.  If +sock+ is specified,
+  # it should be a Raindrops::InetDiagSocket object.
+  def unix_listener_stats(paths = nil, sock = nil)
+    if @@unix_diag && defined?(Raindrops::Linux.unix_diag_listener_stats)
+      begin
+        return Raindrops::Linux.unix_diag_listener_stats(paths, sock)
+      rescue *UNIX_DIAG_UNSUPPORTED
+        @@unix_diag = false
+      end
+    end
+    proc_net_unix_listener_stats(paths)
+  end
+  module_function :unix_listener_stats
+
+  # :stopdoc:
+  # errors from kernels built without (or not yet loaded) unix_diag
+  UNIX_DIAG_UNSUPPORTED = [ Errno::ENOENT, Errno::EINVAL, Errno::EOPNOTSUPP,
+                            Errno::EPROTONOSUPPORT, Errno::EAFNOSUPPORT ]
+  @@unix_diag = true
+  # :startdoc:
+
+  # Same as unix_listener_stats, but always parses /proc/net/unix.
+  # This may be significantly slower than its tcp_listener_stats
   # counterpart due to the latter being able to use inet_diag via netlink.
-  # This parses /proc/net/unix as there is no other (known) way
-  # to expose Unix domain socket statistics over netlink.
-  def unix_listener_stats(paths = nil)
+  def proc_net_unix_listener_stats(paths = nil)
     rv = Hash.new { |h,k| h[k.freeze] = Raindrops::ListenStats.new(0, 0) }
     if nil == paths
       paths = [ '[^\n]+' ]
@@ -59,6 +81,6 @@ module Raindrops::Linux
 
     rv
   end
-  module_function :unix_listener_stats
+  module_function :proc_net_unix_listener_stats
 
 end # Raindrops::Linux
@@ -1,5 +1,6 @@
 # -*- encoding: binary -*-
 require 'raindrops'
+require 'thread'
 
 # Raindrops::Middleware is Rack middleware that allows snapshotting
 # current activity from an HTTP request.  For all operating systems,
@@ -59,6 +60,56 @@ require 'raindrops'
 # * active - total number of active clients on that listener
 # * queued - total number of queued (pre-accept()) clients on that listener
 #
+# Every request for listener stats does its own netlink dump unless
+# +:listener_ttl+ is given.  With it, results are cached in shared
+# memory for that many seconds and concurrent requests in all forked
+# workers share a single dump, see Raindrops::Middleware::ListenerCache.
+#
+#    use Raindrops::Middleware, :listener_ttl => 0.5
+#
+# === Request queue time
+#
+# If a Raindrops::Histogram is given as +:queue_time+, the time each
+# request spent between the front end proxy and the application is
+# recorded in microseconds, using the header named by
+# +:queue_time_header+ (default: "HTTP_X_REQUEST_START").  For nginx:
+#
+#    proxy_set_header X-Request-Start "t=${msec}";
+#
+# See Raindrops::Histogram#record_request_start for the formats
+# understood.  The stats endpoint then includes:
+#
+#    queue_time_us: count=100 p50=95 p90=1023 p99=8191 max=9002
+#
+# === Latency
+#
+# Per-route latency histograms are recorded if a
+# Raindrops::Middleware::Latency object is given as +:latency+.  The
+# stats endpoint then includes the count and percentiles of every
+# route in microseconds:
+#
+#    api app_us: count=100 p50=1023 p90=2047 p99=8191 max=9002
+#    api total_us: count=100 p50=1151 p90=2303 p99=8191 max=9231
+#
+# === Response sizes and drain times
+#
+# If a Raindrops::Middleware::Transfer object is given as +:transfer+,
+# the number of body bytes and the time from the first body chunk until
+# the body is closed are recorded for every response, broken out by
+# status class and content type.  The stats endpoint then includes:
+#
+#    2xx text/html bytes: count=100 p50=4095 p90=16383 p99=65535 max=70000
+#    2xx text/html drain_us: count=100 p50=63 p90=511 p99=131071 max=150000
+#
+# === OpenMetrics
+#
+# The same statistics are available in the OpenMetrics text format used
+# by Prometheus at the +:metrics_path+ endpoint.  It is disabled unless
+# +:metrics_path+ is given (e.g. "/_raindrops/metrics").  To keep
+# frequent scrapes cheap, the response is only rebuilt once every
+# +:metrics_interval+ seconds (default: 1), scrapes in between are
+# served the same bytes.
+#
 # = Demo Server
 #
 # There is a server running this middleware (and Watcher) at
@@ -70,7 +121,7 @@ require 'raindrops'
 # by using the /tail/ endpoint too much.
 #
 class Raindrops::Middleware
-  attr_accessor :app, :stats, :path, :tcp, :unix # :nodoc:
+  attr_accessor :app, :stats, :path, :metrics_path, :tcp, :unix # :nodoc:
 
   # A Raindrops::Struct used to count the number of :calling and :writing
   # clients.  This struct is intended to be shared across multiple processes
@@ -83,6 +134,9 @@ class Raindrops::Middleware
   # :stopdoc:
   PATH_INFO = "PATH_INFO"
   require "raindrops/middleware/proxy"
+  require "raindrops/middleware/latency"
+  require "raindrops/middleware/transfer"
+  require "raindrops/middleware/listener_cache"
   # :startdoc:
 
   # +app+ may be any Rack application, this middleware wraps it.
@@ -91,10 +145,28 @@ class Raindrops::Middleware
   # * :stats - Raindrops::Middleware::Stats struct (default: Stats.new)
   # * :path - HTTP endpoint used for reading the stats (default: "/_raindrops")
   # * :listeners - array of host:port or socket paths (default: from Unicorn)
+  # * :metrics_path - OpenMetrics endpoint (default: nil, disabled)
+  # * :metrics_interval - seconds to cache OpenMetrics output (default: 1)
+  # * :latency - Raindrops::Middleware::Latency object (default: none)
+  # * :transfer - Raindrops::Middleware::Transfer object (default: none)
+  # * :queue_time - Raindrops::Histogram for request queue times (default: none)
+  # * :queue_time_header - Rack env key of the request start time
+  #   (default: "HTTP_X_REQUEST_START")
+  # * :listener_ttl - seconds to cache listener stats for (default: none)
+  # * :listener_cache - Raindrops::Middleware::ListenerCache to use
+  #   instead of creating one for +:listener_ttl+
   def initialize(app, opts = {})
     @app = app
     @stats = opts[:stats] || Stats.new
+    @latency = opts[:latency]
+    @transfer = opts[:transfer]
+    @queue_time = opts[:queue_time]
+    @queue_time_header = (opts[:queue_time_header] ||
+                          "HTTP_X_REQUEST_START").dup.freeze
     @path = opts[:path] || "/_raindrops"
+    @metrics_path = opts[:metrics_path]
+    @metrics_interval = opts[:metrics_interval] || 1
+    @metrics = nil
     tmp = opts[:listeners]
     if tmp.nil? && defined?(Unicorn) && Unicorn.respond_to?(:listener_names)
       tmp = Unicorn.listener_names
@@ -107,39 +179,76 @@ class Raindrops::Middleware
       @tcp = nil if @tcp.empty?
       @unix = nil if @unix.empty?
     end
+    @socket = @socket_pid = nil
+    @socket_lock = Mutex.new
+    @listener_cache = opts[:listener_cache]
+    if ttl = opts[:listener_ttl]
+      @listener_cache ||= ListenerCache.new((@tcp || []) + (@unix || []), ttl)
+    end
   end
 
   # standard Rack endpoint
   def call(env) # :nodoc:
-    env[PATH_INFO] == @path and return stats_response
+    case env[PATH_INFO]
+    when @path then return stats_response
+    when @metrics_path then return metrics_response if @metrics_path
+    end
+    @queue_time.record_request_start(env[@queue_time_header]) if @queue_time
+    if latency = @latency
+      route = latency.classify(env)
+      start = Latency.now
+    end
     begin
       @stats.incr_calling
 
       status, headers, body = @app.call(env)
-      rv = [ status, headers, Proxy.new(body, @stats) ]
+      transfer = @transfer and transfer = transfer.for(status, headers)
+      rv = [ status, headers,
+             Proxy.new(body, @stats, latency && latency.total(route), start,
+                       transfer) ]
 
       # the Rack server will start writing headers soon after this method
       @stats.incr_writing
       rv
     ensure
       @stats.decr_calling
+      latency.app(route) << Latency.now - start if latency
+    end
+  end
+
+  HIST_PCT = [ 50, 90, 99 ] # :nodoc:
+
+  def hist_stats(body, label, hist) # :nodoc:
+    body << "#{label}: count=#{hist.count}"
+    HIST_PCT.each { |pct| body << " p#{pct}=#{hist.percentile(pct).to_i}" }
+    body << " max=#{hist.max.to_i}\n"
+  end
+
+  def latency_stats(body) # :nodoc:
+    @latency.names.each do |name|
+      hist_stats(body, "#{name} app_us", @latency.app(name))
+      hist_stats(body, "#{name} total_us", @latency.total(name))
+    end
+  end
+
+  def transfer_stats(body) # :nodoc:
+    @transfer.each do |status, type, bytes, drain|
+      hist_stats(body, "#{status} #{type} bytes", bytes)
+      hist_stats(body, "#{status} #{type} drain_us", drain)
     end
   end
 
   def stats_response  # :nodoc:
     body = "calling: #{@stats.calling}\n" \
            "writing: #{@stats.writing}\n"
+    hist_stats(body, "queue_time_us", @queue_time) if @queue_time
 
-    if defined?(Raindrops::Linux.tcp_listener_stats)
-      Raindrops::Linux.tcp_listener_stats(@tcp).each do |addr,stats|
-        body << "#{addr} active: #{stats.active}\n" \
-                "#{addr} queued: #{stats.queued}\n"
-      end if @tcp
-      Raindrops::Linux.unix_listener_stats(@unix).each do |addr,stats|
-        body << "#{addr} active: #{stats.active}\n" \
-                "#{addr} queued: #{stats.queued}\n"
-      end if @unix
+    listener_stats.each do |addr,stats|
+      body << "#{addr} active: #{stats.active}\n" \
+              "#{addr} queued: #{stats.queued}\n"
     end
+    latency_stats(body) if @latency
+    transfer_stats(body) if @transfer
 
     headers = {
       "Content-Type" => "text/plain",
@@ -147,4 +256,101 @@ class Raindrops::Middleware
     }
     [ 200, headers, [ body ] ]
   end
+
+  def listener_stats # :nodoc:
+    return {} unless defined?(Raindrops::Linux.tcp_listener_stats)
+    return listener_dump unless @listener_cache && (@tcp || @unix)
+    @listener_cache.fetch { listener_dump }
+  end
+
+  # replies to concurrent dumps on one netlink socket would get mixed
+  # up, so threads in a process take turns
+  def listener_dump # :nodoc:
+    @socket_lock.synchronize do
+      rv = {}
+      sock = diag_socket
+      rv.merge!(Raindrops::Linux.tcp_listener_stats(@tcp, sock)) if @tcp
+      rv.merge!(Raindrops::Linux.unix_listener_stats(@unix, sock)) if @unix
+      rv
+    end
+  end
+
+  # the socket is reused, but not across fork
+  def diag_socket # :nodoc:
+    if @socket_pid != $$
+      @socket.close if @socket # our copy of the parent's socket
+      @socket, @socket_pid = Raindrops::InetDiagSocket.new, $$
+    end
+    @socket
+  end
+
+  def render_metrics # :nodoc:
+    om = Raindrops::OpenMetrics
+    body = ""
+    om.gauge(body, "raindrops_calling",
+             "number of application dispatchers",
+             [ [ {}, @stats.calling ] ])
+    om.gauge(body, "raindrops_writing",
+             "number of clients being written to",
+             [ [ {}, @stats.writing ] ])
+    if @queue_time
+      om.histogram(body, "raindrops_request_queue_microseconds",
+                   "time between the front end proxy and the application",
+                   [ [ {}, @queue_time ] ])
+    end
+    all = listener_stats
+    om.gauge(body, "raindrops_listener_active",
+             "number of active connections",
+             all.map { |addr,stats| [ { "listener" => addr }, stats.active ] })
+    om.gauge(body, "raindrops_listener_queued",
+             "number of queued connections",
+             all.map { |addr,stats| [ { "listener" => addr }, stats.queued ] })
+    if @latency
+      om.histogram(body, "raindrops_route_app_microseconds",
+                   "time spent in the application",
+                   @latency.names.map { |n| [ { "route" => n }, @latency.app(n) ] })
+      om.histogram(body, "raindrops_route_total_microseconds",
+                   "time until the response body was closed",
+                   @latency.names.map { |n| [ { "route" => n }, @latency.total(n) ] })
+    end
+    if @transfer
+      bytes, drain = [], []
+      @transfer.each do |status, type, b, d|
+        l = { "status" => status, "type" => type }
+        bytes << [ l, b ]
+        drain << [ l, d ]
+      end
+      om.histogram(body, "raindrops_response_bytes",
+                   "response body sizes", bytes)
+      om.histogram(body, "raindrops_response_drain_microseconds",
+                   "time from the first body chunk until close", drain)
+    end
+    om.finish(body).freeze
+  end
+
+  # the body is rebuilt at most once per @metrics_interval, concurrent
+  # requests may race to rebuild it but will never see a partial body
+  def metrics_response # :nodoc:
+    now = Raindrops::Middleware.clock
+    expires, body = @metrics
+    unless expires && now < expires
+      body = render_metrics
+      @metrics = [ now + @metrics_interval, body ]
+    end
+    headers = {
+      "Content-Type" => Raindrops::OpenMetrics::CONTENT_TYPE,
+      "Content-Length" => body.size.to_s,
+    }
+    [ 200, headers, [ body ] ]
+  end
+
+  if defined?(Process::CLOCK_MONOTONIC)
+    def self.clock # :nodoc:
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  else
+    def self.clock # :nodoc:
+      Time.now.to_f
+    end
+  end
 end
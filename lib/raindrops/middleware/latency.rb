@@ -0,0 +1,99 @@
+# -*- encoding: binary -*-
+
+# Per-route latency histograms recorded by Raindrops::Middleware.  Two
+# Raindrops::Histogram objects are kept for every route, in microseconds:
+#
+# * app - time spent in the +call+ method of the application
+# * total - time until the Rack server closed the response body,
+#   which includes writing the response to the client
+#
+# Routes are classified by a Hash of names and Regexps matched against
+# PATH_INFO in order, or by any object responding to +call+ which takes
+# the Rack env and returns one of the names given in +:names+.
+# Requests matching no route are recorded under "other".
+#
+#    $latency ||= Raindrops::Middleware::Latency.new(
+#                   "api" => %r{\A/api/}, "assets" => %r{\A/assets/})
+#    use Raindrops::Middleware, :latency => $latency
+#
+# Like Raindrops::Middleware::Stats, the histograms live in shared
+# memory and must be created before forking workers so every worker
+# records into the same histograms.  Recording only does integer
+# arithmetic and atomic updates, so it does not allocate memory.
+class Raindrops::Middleware::Latency
+  # name for requests matching no route
+  OTHER = "other"
+
+  # frozen array of route names, including OTHER
+  attr_reader :names
+
+  # +routes+ is a Hash of names to Regexps or a callable classifier.
+  # +opts+ is a hash that understands the following members:
+  #
+  # * :names - array of route names the classifier returns
+  # * :bits - precision of the histograms, see Raindrops::Histogram.new
+  def initialize(routes = {}, opts = {})
+    if routes.respond_to?(:call)
+      @classifier, @patterns = routes, nil
+      names = opts[:names] or
+        raise ArgumentError, ":names is required with a classifier"
+    else
+      @classifier = nil
+      @patterns = routes.map { |name, re| [ name.to_s.freeze, re ] }.freeze
+      names = routes.keys
+    end
+    @names = (names.map { |name| name.to_s.freeze } | [ OTHER ]).freeze
+    hopts = opts[:bits] ? { :bits => opts[:bits] } : {}
+    @app, @total = {}, {}
+    @names.each do |name|
+      @app[name] = Raindrops::Histogram.new(hopts)
+      @total[name] = Raindrops::Histogram.new(hopts)
+      # classifiers may return Symbols, too
+      @app[name.to_sym] = @app[name]
+      @total[name.to_sym] = @total[name]
+    end
+  end
+
+  if Regexp.method_defined?(:match?)
+    def match(re, path) # :nodoc:
+      re.match?(path)
+    end
+  else
+    def match(re, path) # :nodoc:
+      re =~ path
+    end
+  end
+
+  # returns the route name for the Rack +env+
+  def classify(env)
+    return @classifier.call(env) if @classifier
+    path = env[Raindrops::Middleware::PATH_INFO] or return OTHER
+    i = 0
+    # no block, a non-local return from one allocates
+    while pair = @patterns[i]
+      return pair[0] if match(pair[1], path)
+      i += 1
+    end
+    OTHER
+  end
+
+  # returns the Raindrops::Histogram of application latencies for +name+
+  def app(name)
+    @app[name] || @app[OTHER]
+  end
+
+  # returns the Raindrops::Histogram of total latencies for +name+
+  def total(name)
+    @total[name] || @total[OTHER]
+  end
+
+  if defined?(Process::CLOCK_MONOTONIC)
+    def self.now # :nodoc:
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+    end
+  else
+    def self.now # :nodoc:
+      (Time.now.to_f * 1000000).to_i
+    end
+  end
+end
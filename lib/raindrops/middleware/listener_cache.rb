@@ -0,0 +1,143 @@
+# -*- encoding: binary -*-
+
+# Caches listener stats in shared memory so concurrent requests for
+# them across all forked workers share a single netlink dump per +ttl+.
+# Only one process refreshes an expired cache at a time, others are
+# served the previous (at most one refresh old) result meanwhile.
+#
+#    $listener_cache ||= Raindrops::Middleware::ListenerCache.new(
+#                          %w(0.0.0.0:80 /tmp/.sock), 0.5)
+#    use Raindrops::Middleware, :listener_cache => $listener_cache
+#
+# Like Raindrops::Middleware::Stats, it must be created before forking
+# workers to be shared by them.  It is normally created by
+# Raindrops::Middleware when +:listener_ttl+ is given.
+class Raindrops::Middleware::ListenerCache
+  # :stopdoc:
+  SEQ = 0 # odd while the values are being written
+  EXPIRES = 1 # monotonic clock in milliseconds, zero if never filled
+  FLIGHT = 2 # lease of the refreshing process, zero if none
+  TOKENS = 3 # counter making every lease unique
+  NR_FIELDS = 4
+
+  # a lease is the clock when it was taken and a unique token, in a
+  # single slot so both are swapped together by Raindrops#cas
+  TOKEN_BITS = 16
+  TOKEN_MASK = (1 << TOKEN_BITS) - 1
+  CLOCK_MASK = Raindrops::MAX >> TOKEN_BITS
+  # :startdoc:
+
+  # frozen array of listener addresses cached
+  attr_reader :addrs
+
+  # +addrs+ are the TCP and UNIX listener addresses whose stats will be
+  # cached for +ttl+ seconds.  A refresh running longer than +lease+
+  # seconds is assumed to have died with its process and is taken over.
+  def initialize(addrs, ttl, lease = 1)
+    @addrs = addrs.map { |addr| addr.dup.freeze }.freeze
+    @ttl = (ttl * 1000).to_i
+    @lease = (lease * 1000).to_i
+    @rd = Raindrops.new(NR_FIELDS + 2 * @addrs.size)
+  end
+
+  # returns a hash of addresses to ListenStats, calling the block to
+  # get fresh stats if the cache expired and no other process is
+  # already refreshing it
+  def fetch
+    now = self.class.clock
+    vals, expires = read
+    return vals if vals && now < expires
+
+    if lease = acquire(now)
+      begin
+        fresh = yield
+        # our lease may have been taken over if we were too slow, and
+        # write gives up if the new holder is already writing
+        write(fresh, now + @ttl) if @rd[FLIGHT] == lease
+        return fresh
+      ensure
+        @rd.cas(FLIGHT, lease, 0)
+      end
+    end
+
+    # somebody else is refreshing it, stale stats are fine meanwhile
+    return vals if vals
+    deadline = now + @lease
+    begin
+      sleep(0.001)
+      vals, _ = read
+      return vals if vals
+    end while self.class.clock < deadline
+    yield
+  end
+
+  # expires the cache, the next +fetch+ will refresh it
+  def expire!
+    @rd[EXPIRES] = 1
+  end
+
+  # returns a lease if we may refresh the cache, nil otherwise.  Only
+  # the holder of a lease releases it, so a lease taken over from a
+  # process which died while refreshing is never released twice.
+  def acquire(now) # :nodoc:
+    lease = ((now & CLOCK_MASK) << TOKEN_BITS) |
+            (@rd.incr(TOKENS) & TOKEN_MASK)
+    lease = 1 if lease == 0 # zero means nobody holds it
+    return lease if @rd.cas(FLIGHT, 0, lease)
+
+    # the process refreshing may have died holding its lease
+    owner = @rd[FLIGHT]
+    owner != 0 && ((now - (owner >> TOKEN_BITS)) & CLOCK_MASK) > @lease &&
+      @rd.cas(FLIGHT, owner, lease) ? lease : nil
+  end
+
+  # returns [ stats_hash, expires ], or nil if the cache was never
+  # filled or was being written to
+  def read # :nodoc:
+    raw = @rd.seqlock_read(SEQ) or return
+    expires = raw[EXPIRES]
+    return if expires == 0
+    rv = {}
+    i = NR_FIELDS
+    @addrs.each do |addr|
+      rv[addr] = Raindrops::ListenStats.new(raw[i], raw[i + 1])
+      i += 2
+    end
+    [ rv, expires ]
+  end
+
+  # called by the lease holder, returns false without writing if
+  # another writer got in first.  cas and incr are full memory barriers.
+  def write(stats, expires) # :nodoc:
+    seq = @rd[SEQ]
+    if seq.odd?
+      # a holder was killed halfway through its write (e.g. by a
+      # timeout), we hold its expired lease so restore even parity
+      @rd.cas(SEQ, seq, seq + 1) or return false
+      seq += 1
+    end
+
+    # taking SEQ from even to odd makes us the only writer
+    @rd.cas(SEQ, seq, seq + 1) or return false
+    i = NR_FIELDS
+    @addrs.each do |addr|
+      s = stats[addr]
+      @rd[i] = s ? s.active : 0
+      @rd[i + 1] = s ? s.queued : 0
+      i += 2
+    end
+    @rd[EXPIRES] = expires
+    @rd.incr(SEQ)
+    true
+  end
+
+  if defined?(Process::CLOCK_MONOTONIC)
+    def self.clock # :nodoc:
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :millisecond)
+    end
+  else
+    def self.clock # :nodoc:
+      (Time.now.to_f * 1000).to_i
+    end
+  end
+end
@@ -3,19 +3,41 @@
 # This class is by Raindrops::Middleware to proxy application response
 # bodies.  There should be no need to use it directly.
 class Raindrops::Middleware::Proxy
-  def initialize(body, stats)
-    @body, @stats = body, stats
+  # +hist+ is a Raindrops::Histogram the body lifetime is recorded
+  # into, counting from +start+ (see Raindrops::Middleware::Latency.now).
+  # +transfer+ is the [ bytes, drain ] pair of histograms from
+  # Raindrops::Middleware::Transfer#for
+  def initialize(body, stats, hist = nil, start = nil, transfer = nil)
+    @body, @stats, @hist, @start = body, stats, hist, start
+    @transfer, @bytes, @first = transfer, 0, nil
   end
 
   # yield to the Rack server here for writing
   def each
-    @body.each { |x| yield x }
+    if @transfer
+      @body.each do |x|
+        @first ||= Raindrops::Middleware::Latency.now
+        @bytes += x.bytesize
+        yield x
+      end
+    else
+      @body.each { |x| yield x }
+    end
   end
 
   # the Rack server should call this after #each (usually ensure-d)
   def close
     @stats.decr_writing
-    @body.close if @body.respond_to?(:close)
+    @hist << Raindrops::Middleware::Latency.now - @start if @hist
+    # bodies sent with sendfile via +to_path+ never reach #each, we
+    # know neither their size nor drain time so nothing is recorded
+    if (transfer = @transfer) && (@first || ! @body.respond_to?(:to_path))
+      transfer[0] << @bytes
+      transfer[1] << (@first ? Raindrops::Middleware::Latency.now - @first : 0)
+    end
+    ensure
+      # never leak the app body because a histogram raised
+      @body.close if @body.respond_to?(:close)
   end
 
   # Some Rack servers can optimize response processing if it responds
@@ -0,0 +1,103 @@
+# -*- encoding: binary -*-
+
+# Response size and drain time histograms recorded by
+# Raindrops::Middleware::Proxy, broken out by status class ("2xx",
+# "4xx", ...) and content type.  For every combination, two
+# Raindrops::Histogram objects are kept:
+#
+# * bytes - number of body bytes yielded to the Rack server
+# * drain - microseconds from the first body chunk until the Rack
+#   server closed the body, this is how long the client took to read
+#   the response (minus what fit in socket buffers)
+#
+# Only the content types given to +new+ are tracked separately, matched
+# by prefix so parameters such as "; charset=utf-8" are ignored.  All
+# other responses are recorded under "other".
+#
+#    $transfer ||= Raindrops::Middleware::Transfer.new(%w(text/html
+#                                                          application/json))
+#    use Raindrops::Middleware, :transfer => $transfer
+#
+# Like Raindrops::Middleware::Stats, the histograms live in shared
+# memory and must be created before forking workers.  Bodies served
+# with +to_path+ (sendfile) are not seen by the Proxy and are not
+# recorded at all, unless the Rack server falls back to +each+.
+class Raindrops::Middleware::Transfer
+  # type for responses matching no content type
+  OTHER = "other"
+
+  # status classes, responses with invalid statuses are "other"
+  STATUSES = %w(other 1xx 2xx 3xx 4xx 5xx).map { |s| s.freeze }.freeze
+
+  # :stopdoc:
+  CONTENT_TYPE = "Content-Type".freeze
+  CONTENT_TYPE_LC = "content-type".freeze # Rack 3
+  # :startdoc:
+
+  # frozen array of content types, including OTHER
+  attr_reader :types
+
+  # +types+ is an array of content types to track separately.
+  # +opts+ is a hash that understands the following members:
+  #
+  # * :bits - precision of the histograms, see Raindrops::Histogram.new
+  def initialize(types = %w(text/html application/json), opts = {})
+    @types = (types.map { |t| t.to_s.freeze } | [ OTHER ]).freeze
+    @match = (@types - [ OTHER ]).freeze
+    hopts = opts[:bits] ? { :bits => opts[:bits] } : {}
+    @table = STATUSES.map do
+      rv = {}
+      @types.each do |t|
+        rv[t] = [ Raindrops::Histogram.new(hopts),
+                  Raindrops::Histogram.new(hopts) ].freeze
+      end
+      rv.freeze
+    end.freeze
+  end
+
+  # returns the frozen [ bytes, drain ] histogram pair for a response,
+  # this does not allocate memory
+  def for(status, headers)
+    status = status.to_i / 100
+    status = 0 if status < 1 || status > 5
+    type = headers[CONTENT_TYPE] || headers[CONTENT_TYPE_LC]
+    @table[status][type ? content_type(type) : OTHER]
+  end
+
+  def content_type(type) # :nodoc:
+    i = 0
+    while t = @match[i]
+      return t if type.start_with?(t)
+      i += 1
+    end
+    OTHER
+  end
+
+  # returns the Raindrops::Histogram of body sizes for a status class
+  # and content type
+  def bytes(status, type)
+    pair(status, type)[0]
+  end
+
+  # returns the Raindrops::Histogram of drain times for a status class
+  # and content type
+  def drain(status, type)
+    pair(status, type)[1]
+  end
+
+  def pair(status, type) # :nodoc:
+    i = STATUSES.index(status) or raise ArgumentError, "bad status: #{status}"
+    @table[i][type] or raise ArgumentError, "bad type: #{type}"
+  end
+
+  # yields every status class and content type combination which has
+  # recorded at least one response
+  def each # :yields: status, type, bytes, drain
+    STATUSES.each_with_index do |status, i|
+      @types.each do |type|
+        bytes, drain = @table[i][type]
+        yield status, type, bytes, drain if bytes.count > 0
+      end
+    end
+  end
+end
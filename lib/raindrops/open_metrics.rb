@@ -0,0 +1,62 @@
+# -*- encoding: binary -*-
+
+# Raindrops::OpenMetrics renders the text exposition format understood
+# by Prometheus and other OpenMetrics scrapers.  It is used by the
+# "/metrics" endpoints of Raindrops::Middleware and Raindrops::Watcher
+# and is not expected to be used directly.
+module Raindrops::OpenMetrics
+  # :stopdoc:
+  CONTENT_TYPE = "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+  def escape(value)
+    value.to_s.gsub(/[\\"\n]/) { |c| c == "\n" ? "\\n" : "\\#{c}" }
+  end
+
+  def labels(hash)
+    hash.empty? and return ""
+    "{#{hash.map { |k,v| %Q(#{k}="#{escape(v)}") }.join(',')}}"
+  end
+
+  def header(buf, name, type, help)
+    buf << "# TYPE #{name} #{type}\n# HELP #{name} #{help}\n"
+  end
+
+  # +samples+ is an array of [ labels_hash, value ] pairs
+  def gauge(buf, name, help, samples)
+    header(buf, name, "gauge", help)
+    samples.each { |l, value| buf << "#{name}#{labels(l)} #{value}\n" }
+    buf
+  end
+
+  # +hists+ is an array of [ labels_hash, Raindrops::Histogram ] pairs.
+  # Buckets have "le" bounds of 2**k - 1, which are always bucket
+  # boundaries of Raindrops::Histogram so counts are exact.
+  def histogram(buf, name, help, hists)
+    header(buf, name, "histogram", help)
+    hists.each do |l, hist|
+      counts = []
+      hist.each_nonzero do |lo, hi, n|
+        k = 0
+        k += 1 while (1 << k) - 1 < hi
+        counts[k] = (counts[k] || 0) + n
+      end
+      total = 0
+      counts.each_with_index do |n, k|
+        total += n || 0
+        le = l.merge("le" => ((1 << k) - 1).to_f)
+        buf << "#{name}_bucket#{labels(le)} #{total}\n"
+      end
+      buf << "#{name}_bucket#{labels(l.merge("le" => "+Inf"))} #{total}\n" \
+             "#{name}_count#{labels(l)} #{total}\n" \
+             "#{name}_sum#{labels(l)} #{hist.sum}\n"
+    end
+    buf
+  end
+
+  def finish(buf)
+    buf << "# EOF\n"
+  end
+
+  module_function :escape, :labels, :header, :gauge, :histogram, :finish
+  # :startdoc:
+end
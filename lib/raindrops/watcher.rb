@@ -3,13 +3,10 @@ require "thread"
 require "time"
 require "socket"
 require "rack"
-require "aggregate"
 
 # Raindrops::Watcher is a stand-alone Rack application for watching
 # any number of TCP and UNIX listeners (all of them by default).
 #
-# It depends on the {Aggregate RubyGem}[http://rubygems.org/gems/aggregate]
-#
 # In your Rack config.ru:
 #
 #    run Raindrops::Watcher(options = {})
@@ -18,6 +15,22 @@ require "aggregate"
 #
 # - :listeners - an array of listener names, (e.g. %w(0.0.0.0:80 /tmp/sock))
 # - :delay - interval between stats updates in seconds (default: 1)
+# - :interval - sample TCP listeners every +:interval+ seconds from the
+#   native thread of Raindrops::Linux::Sampler instead of once per
+#   +:delay+, where that is supported.  Only the listeners given in
+#   +:listeners+ (or those listening when the first request is served)
+#   are sampled, UNIX listeners are always sampled once per +:delay+.
+#   The optional Aggregate is still only updated once per +:delay+.
+# - :history - number of samples kept per listener for the /history/
+#   endpoint (default: 900, 15 minutes at the default :delay).  Samples
+#   are one +:delay+ apart, or one +:interval+ apart for listeners
+#   sampled with +:interval+.
+# - :tail_buffer - number of lines buffered for each /tail/ client
+#   before it is considered too slow and disconnected (default: 16)
+# - :aggregate - also keep an Aggregate of every listener for the
+#   X-Std-Dev and X-Outliers-* headers, this requires the
+#   {Aggregate RubyGem}[http://rubygems.org/gems/aggregate] (default: false)
+# - :agg_class - class used instead of Aggregate, implies :aggregate
 #
 # Raindrops::Watcher is compatible any thread-safe/thread-aware Rack
 # middleware.  It does not work well with multi-process web servers
@@ -58,6 +71,34 @@ require "aggregate"
 #
 # e.g.: curl http://raindrops-demo.bogomips.org/queued/0.0.0.0%3A80.html
 #
+# === GET /metrics
+#
+# Returns the current active and queued counts of every listener along
+# with histograms of all samples in the OpenMetrics text format used by
+# Prometheus.
+#
+# === GET /history/$LISTENER.csv?since=-30
+#
+# Returns the samples kept in the Raindrops::History of the listener,
+# oldest first, as CSV:
+#
+#   time,active,queued
+#   1325376000.1,3,0
+#
+# Query parameters:
+#
+# - since - only return samples taken at or after this time
+# - until - only return samples taken at or before this time
+#
+# Both are seconds since the Epoch, negative values are relative to
+# the current time (e.g. "since=-30" for the last 30 seconds).
+#
+# === GET /history/$LISTENER.bin
+#
+# Like the CSV endpoint, but returns the binary records of
+# Raindrops::History#dump as application/octet-stream.  The byte order
+# is given in the X-Byte-Order response header.
+#
 # === POST /reset/$LISTENER
 #
 # Resets the active and queued statistics for the given listener.
@@ -76,6 +117,29 @@ require "aggregate"
 # - active_min - do not stream a line until this active count is reached
 # - queued_min - do not stream a line until this queued count is reached
 #
+# === GET /tail/$LISTENER.sse?active_min=1&queued_min=1
+#
+# Like the plain text endpoint, but streams Server-Sent Events (for
+# EventSource in browsers) with JSON data:
+#
+#   id: MILLISECONDS_SINCE_EPOCH
+#   data: {"time":"ISO8601_TIMESTAMP","active":ACTIVE_COUNT,"queued":QUEUED_COUNT}
+#
+# Every tick is formatted once per listener by the background thread
+# and pushed to all clients tailing it, so each client only costs a
+# queue and the server thread writing to it.  Clients which fall more
+# than +:tail_buffer+ lines behind are disconnected (SSE clients get a
+# "dropped" event first) instead of slowing down the others.
+#
+# == Caching
+#
+# "/", "/metrics" and the /active/ and /queued/ endpoints are rendered
+# once per +:delay+ by the background thread.  Requests for them are
+# served from the last rendering without taking any locks, with +ETag+
+# and +Last-Modified+ headers, and conditional GETs receive a
+# "304 Not Modified" response.  /history/ reads Raindrops::History on
+# every request and /tail/ is streamed, neither is cached.
+#
 # == Response headers (mostly the same names as Raindrops::LastDataRecv)
 #
 # - X-Count   - number of samples polled
@@ -86,12 +150,18 @@ require "aggregate"
 # - X-Min     - lowest number of connections recorded
 # - X-Max     - highest number of connections recorded
 # - X-Mean    - mean number of connections recorded
-# - X-Std-Dev - standard deviation of connection count
-# - X-Outliers-Low - number of low outliers (hopefully many for queued)
-# - X-Outliers-High - number of high outliers (hopefully zero for queued)
 # - X-Current - current number of connections
 # - X-First-Peak-At - date of when X-Max was first reached
 # - X-Last-Peak-At - date of when X-Max was last reached
+# - X-P50, X-P90, X-P99, X-P999 - percentiles of the connection count
+#
+# These come from a Raindrops::Histogram kept for each listener, which
+# uses a fixed amount of memory and is read without copying it.  The
+# following headers are only present with the +:aggregate+ option:
+#
+# - X-Std-Dev - standard deviation of connection count
+# - X-Outliers-Low - number of low outliers (hopefully many for queued)
+# - X-Outliers-High - number of high outliers (hopefully zero for queued)
 #
 # = Demo Server
 #
@@ -108,6 +178,7 @@ class Raindrops::Watcher
   include Raindrops::Linux
   DOC_URL = "http://raindrops.bogomips.org/Raindrops/Watcher.html"
   Peak = Struct.new(:first, :last)
+  QUANTILES = [ %w(X-P50 50), %w(X-P90 90), %w(X-P99 99), %w(X-P999 99.9) ]
 
   def initialize(opts = {})
     @tcp_listeners = @unix_listeners = nil
@@ -120,15 +191,29 @@ class Raindrops::Watcher
       end
     end
 
-    @agg_class = opts[:agg_class] || Aggregate
+    if (@agg_class = opts[:agg_class]).nil? && opts[:aggregate]
+      require "aggregate"
+      @agg_class = Aggregate
+    end
     @start_time = Time.now.utc
     @active = Hash.new { |h,k| h[k] = @agg_class.new }
     @queued = Hash.new { |h,k| h[k] = @agg_class.new }
+    @active_q = Hash.new { |h,k| h[k] = Raindrops::Histogram.new }
+    @queued_q = Hash.new { |h,k| h[k] = Raindrops::Histogram.new }
+    @history_capa = history = opts[:history] || 900
+    @history = Hash.new { |h,k| h[k] = Raindrops::History.new(history) }
     @resets = Hash.new { |h,k| h[k] = @start_time }
     @peak_active = Hash.new { |h,k| h[k] = Peak.new(@start_time, @start_time) }
     @peak_queued = Hash.new { |h,k| h[k] = Peak.new(@start_time, @start_time) }
     @snapshot = [ @start_time, {} ]
+    @rendered = nil
+    @generation = 0
     @delay = opts[:delay] || 1
+    @interval = opts[:interval]
+    @sampler = nil
+    @tail_buffer = opts[:tail_buffer] || 16
+    @subscribers = {}.freeze
+    @sub_lock = Mutex.new
     @lock = Mutex.new
     @start = Mutex.new
     @cond = ConditionVariable.new
@@ -152,62 +237,194 @@ class Raindrops::Watcher
     end
   end
 
-  def aggregate!(agg_hash, peak_hash, addr, number, now)
-    agg = agg_hash[addr]
-    if (max = agg.max) && number > 0 && number >= max
-      peak = peak_hash[addr]
+  # +record+ is false for listeners recorded by @sampler
+  def aggregate!(sketches, aggs, peaks, addr, number, now, record)
+    sketch = sketches[addr]
+    if (max = sketch.max) && number > 0 && number >= max
+      peak = peaks[addr]
       peak.first = now if number > max
       peak.last = now
     end
-    agg << number
+    sketch << number if record
+    aggs[addr] << number if @agg_class
+  end
+
+  # returns a Raindrops::Linux::Sampler for the TCP listeners if the
+  # +:interval+ option was given and it is supported, nil otherwise
+  def sampler(sock) # :nodoc:
+    @interval && defined?(Raindrops::Linux::Sampler) or return
+    addrs = @tcp_listeners || tcp_listener_stats(nil, sock).keys
+    addrs.empty? and return
+    Raindrops::Linux::Sampler.new(addrs, @interval, :history => @history_capa)
   end
 
   def aggregator_thread(logger) # :nodoc:
     @socket = sock = Raindrops::InetDiagSocket.new
+    @sampler = sampler(sock)
     thr = Thread.new do
       begin
-        combined = tcp_listener_stats(@tcp_listeners, sock)
-        combined.merge!(unix_listener_stats(@unix_listeners))
-        @lock.synchronize do
-          now = Time.now.utc
+        if @sampler
+          sampled = @sampler.stats
+          combined = sampled.merge(unix_listener_stats(@unix_listeners))
+        else
+          sampled = {}
+          combined = tcp_listener_stats(@tcp_listeners, sock)
+          combined.merge!(unix_listener_stats(@unix_listeners))
+        end
+        now = Time.now.utc
+        views = @lock.synchronize do
           combined.each do |addr,stats|
-            aggregate!(@active, @peak_active, addr, stats.active, now)
-            aggregate!(@queued, @peak_queued, addr, stats.queued, now)
+            record = ! sampled.include?(addr)
+            aggregate!(@active_q, @active, @peak_active, addr,
+                       stats.active, now, record)
+            aggregate!(@queued_q, @queued, @peak_queued, addr,
+                       stats.queued, now, record)
+            record and @history[addr].record(stats.active, stats.queued, now)
+          end
+          if @sampler # only copies, the sampler has no Ruby objects
+            @sampler.active_histograms(@active_q)
+            @sampler.queued_histograms(@queued_q)
           end
           @snapshot = [ now, combined ]
-          @cond.broadcast
+          views(combined)
         end
+        @rendered = render_all(now, combined, views)
+        @lock.synchronize { @cond.broadcast }
+        broadcast(now, combined)
       rescue => e
         logger.error "#{e.class} #{e.inspect}"
       end while sleep(@delay) && @socket
       sock.close
+      @sampler.stop if @sampler
     end
     wait_snapshot
     thr
   end
 
   def non_existent_stats(time)
-    [ time, @start_time, @agg_class.new, 0, Peak.new(@start_time, @start_time) ]
+    [ time, @start_time, nil, 0, Peak.new(@start_time, @start_time),
+      @empty ||= Raindrops::Histogram.new ]
+  end
+
+  # @lock must be held, the sketches are updated atomically so they are
+  # returned as-is.  Only the optional Aggregate needs to be copied.
+  def stats_for(addr, aggs, peaks, sketches, field) # :nodoc:
+    time, combined = @snapshot
+    stats = combined[addr] or return non_existent_stats(time)
+    [ time, @resets[addr], @agg_class ? aggs[addr] : nil,
+      stats.__send__(field), peaks[addr], sketches[addr] ]
+  end
+
+  # the optional Aggregate is modified by the aggregator thread, so
+  # request threads need a copy of it
+  def copy_agg(rv) # :nodoc:
+    rv[2] &&= rv[2].dup
+    rv
   end
 
   def active_stats(addr) # :nodoc:
     @lock.synchronize do
-      time, combined = @snapshot
-      stats = combined[addr] or return non_existent_stats(time)
-      tmp, peak = @active[addr], @peak_active[addr]
-      [ time, @resets[addr], tmp.dup, stats.active, peak ]
+      copy_agg(stats_for(addr, @active, @peak_active, @active_q, :active))
     end
   end
 
   def queued_stats(addr) # :nodoc:
     @lock.synchronize do
-      time, combined = @snapshot
-      stats = combined[addr] or return non_existent_stats(time)
-      tmp, peak = @queued[addr], @peak_queued[addr]
-      [ time, @resets[addr], tmp.dup, stats.queued, peak ]
+      copy_agg(stats_for(addr, @queued, @peak_queued, @queued_q, :queued))
+    end
+  end
+
+  # @lock must be held, returns the stats of every listener in
+  # +combined+ so they may be rendered after @lock is released.  Only
+  # the aggregator thread modifies the objects these refer to.
+  def views(combined) # :nodoc:
+    combined.keys.map do |addr|
+      [ addr, stats_for(addr, @active, @peak_active, @active_q, :active),
+        stats_for(addr, @queued, @peak_queued, @queued_q, :queued) ]
     end
   end
 
+  # called without @lock by the aggregator thread once per tick, the
+  # returned Hash is never modified so readers need no locking
+  def render_all(now, combined, views) # :nodoc:
+    etag = %Q("#{@start_time.to_i.to_s(16)}-#{(@generation += 1).to_s(16)}")
+    rv = { "/" => index, "/metrics" => metrics(now, combined, views) }
+    views.each do |addr, active, queued|
+      begin
+        rv["/active/#{addr}.txt"] = histogram_txt(active)
+        rv["/active/#{addr}.html"] = histogram_html(active, addr)
+        rv["/queued/#{addr}.txt"] = histogram_txt(queued)
+        rv["/queued/#{addr}.html"] = histogram_html(queued, addr)
+      rescue Errno::EDOM
+        # rendered on demand instead
+      end
+    end
+    rv.each_value do |status, headers, body|
+      headers["ETag"] = etag
+      headers["Last-Modified"] = now.httpdate
+      headers.freeze
+      body.each { |chunk| chunk.freeze }.freeze
+    end
+    [ now, rv.freeze ]
+  end
+
+  # +views+ comes from the views method, so this needs no lock
+  def metrics(now, combined, views) # :nodoc:
+    om = Raindrops::OpenMetrics
+    addrs = combined.keys
+    body = ""
+    om.gauge(body, "raindrops_listener_active",
+             "current number of active connections",
+             addrs.map { |a| [ { "listener" => a }, combined[a].active ] })
+    om.gauge(body, "raindrops_listener_queued",
+             "current number of queued connections",
+             addrs.map { |a| [ { "listener" => a }, combined[a].queued ] })
+    active, queued = [], []
+    views.each do |addr, a, q|
+      labels = { "listener" => addr }
+      active << [ labels, a[5] ]
+      queued << [ labels, q[5] ]
+    end
+    every = @sampler ? "#@interval seconds (TCP) or #@delay seconds (UNIX)" :
+                       "#@delay seconds"
+    om.histogram(body, "raindrops_listener_active_samples",
+                 "active connections sampled every #{every}", active)
+    om.histogram(body, "raindrops_listener_queued_samples",
+                 "queued connections sampled every #{every}", queued)
+    om.finish(body)
+    headers = {
+      "Content-Type" => om::CONTENT_TYPE,
+      "Expires" => (now + @delay).httpdate,
+      "Content-Length" => bytesize(body).to_s,
+    }
+    [ 200, headers, [ body ] ]
+  end
+
+  def not_modified?(env, updated_at, etag) # :nodoc:
+    if inm = env["HTTP_IF_NONE_MATCH"]
+      inm == "*" || inm.split(/\s*,\s*/).include?(etag)
+    elsif ims = env["HTTP_IF_MODIFIED_SINCE"]
+      ims = Time.httpdate(ims) rescue nil
+      ims && ims.to_i >= updated_at.to_i
+    end
+  end
+
+  # serves the last rendering of +key+, nil if there is none
+  def cached(env, key) # :nodoc:
+    updated_at, rendered = @rendered
+    rendered or return
+    res = rendered[key] or return
+    status, headers, body = res
+    if not_modified?(env, updated_at, headers["ETag"])
+      return [ 304, {
+          "ETag" => headers["ETag"],
+          "Last-Modified" => headers["Last-Modified"],
+          "Expires" => headers["Expires"],
+        }, [] ]
+    end
+    [ status, headers.dup, body ]
+  end
+
   def wait_snapshot
     @lock.synchronize do
       @cond.wait @lock
@@ -221,26 +438,41 @@ class Raindrops::Watcher
     "NaN"
   end
 
-  def agg_to_hash(reset_at, agg, current, peak)
-    {
-      "X-Count" => agg.count.to_s,
-      "X-Min" => agg.min.to_s,
-      "X-Max" => agg.max.to_s,
-      "X-Mean" => agg.mean.to_s,
-      "X-Std-Dev" => std_dev(agg),
-      "X-Outliers-Low" => agg.outliers_low.to_s,
-      "X-Outliers-High" => agg.outliers_high.to_s,
-      "X-Last-Reset" => reset_at.httpdate,
-      "X-Current" => current.to_s,
-      "X-First-Peak-At" => peak.first.httpdate,
-      "X-Last-Peak-At" => peak.last.httpdate,
+  def agg_to_hash(reset_at, agg, current, peak, sketch)
+    rv = {
+      "X-Count" => sketch.count.to_s,
+      "X-Min" => sketch.min.to_s,
+      "X-Max" => sketch.max.to_s,
+      "X-Mean" => sketch.mean.to_s,
     }
+    if agg
+      rv["X-Std-Dev"] = std_dev(agg)
+      rv["X-Outliers-Low"] = agg.outliers_low.to_s
+      rv["X-Outliers-High"] = agg.outliers_high.to_s
+    end
+    rv["X-Last-Reset"] = reset_at.httpdate
+    rv["X-Current"] = current.to_s
+    rv["X-First-Peak-At"] = peak.first.httpdate
+    rv["X-Last-Peak-At"] = peak.last.httpdate
+    sketch.count > 0 and QUANTILES.each do |header, pct|
+      rv[header] = sketch.percentile(pct.to_f).to_s
+    end
+    rv
+  end
+
+  # the Aggregate text if we have one, otherwise one line per bucket
+  # like Raindrops::LastDataRecv
+  def histogram_body(agg, sketch) # :nodoc:
+    agg and return agg.to_s
+    body = ""
+    sketch.each_nonzero { |lo, hi, n| body << "#{lo}..#{hi}\t#{n}\n" }
+    body
   end
 
   def histogram_txt(agg)
-    updated_at, reset_at, agg, current, peak = *agg
-    headers = agg_to_hash(reset_at, agg, current, peak)
-    body = agg.to_s
+    updated_at, reset_at, agg, current, peak, sketch = *agg
+    headers = agg_to_hash(reset_at, agg, current, peak, sketch)
+    body = histogram_body(agg, sketch)
     headers["Content-Type"] = "text/plain"
     headers["Expires"] = (updated_at + @delay).httpdate
     headers["Content-Length"] = bytesize(body).to_s
@@ -248,14 +480,15 @@ class Raindrops::Watcher
   end
 
   def histogram_html(agg, addr)
-    updated_at, reset_at, agg, current, peak = *agg
-    headers = agg_to_hash(reset_at, agg, current, peak)
+    updated_at, reset_at, agg, current, peak, sketch = *agg
+    headers = agg_to_hash(reset_at, agg, current, peak, sketch)
+    pre = escape_html histogram_body(agg, sketch)
     body = "<html>" \
       "<head><title>#{hostname} - #{escape_html addr}</title></head>" \
       "<body><table>" <<
       headers.map { |k,v|
         "<tr><td>#{k.gsub(/^X-/, '')}</td><td>#{v}</td></tr>"
-      }.join << "</table><pre>#{escape_html agg}</pre>" \
+      }.join << "</table><pre>#{pre}</pre>" \
       "<form action='/reset/#{escape addr}' method='post'>" \
       "<input type='submit' name='x' value='reset' /></form>" \
       "</body>"
@@ -266,11 +499,21 @@ class Raindrops::Watcher
   end
 
   def get(env)
+    case path = env["PATH_INFO"]
+    when "/", "/metrics"
+      rv = cached(env, path) and return rv
+    when %r{\A/(active|queued)/(.+)\.(txt|html)\z}
+      rv = cached(env, "/#$1/#{unescape($2)}.#$3") and return rv
+    end
+
     retried = false
     begin
-      case env["PATH_INFO"]
+      case path
       when "/"
         index
+      when "/metrics"
+        now, combined = snapshot
+        metrics(now, combined, @lock.synchronize { views(combined) })
       when %r{\A/active/(.+)\.txt\z}
         histogram_txt(active_stats(unescape($1)))
       when %r{\A/active/(.+)\.html\z}
@@ -281,8 +524,10 @@ class Raindrops::Watcher
       when %r{\A/queued/(.+)\.html\z}
         addr = unescape $1
         histogram_html(queued_stats(addr), addr)
-      when %r{\A/tail/(.+)\.txt\z}
-        tail(unescape($1), env)
+      when %r{\A/tail/(.+)\.(txt|sse)\z}
+        tail(unescape($1), $2, env)
+      when %r{\A/history/(.+)\.(csv|bin)\z}
+        history(unescape($1), $2, env)
       else
         not_found
       end
@@ -309,9 +554,14 @@ class Raindrops::Watcher
 
   def reset!(env, addr)
     @lock.synchronize do
-      @active.include?(addr) or return not_found
+      @active_q.include?(addr) or return not_found
+      if @sampler && @sampler.addresses.include?(addr)
+        @sampler.reset!(addr)
+      end
       @active.delete addr
       @queued.delete addr
+      @active_q.delete addr
+      @queued_q.delete addr
       @resets[addr] = Time.now.utc
       @cond.wait @lock
     end
@@ -362,34 +612,138 @@ class Raindrops::Watcher
     [ 200, headers, [ body ] ]
   end
 
-  def tail(addr, env)
-    Tailer.new(self, addr, env).finish
+  # never takes @lock, Raindrops::History may be read while it is written,
+  # listeners sampled by @sampler have their History kept by it
+  def history(addr, format, env)
+    sampled = @sampler && @sampler.addresses.include?(addr)
+    unless sampled
+      hist = @history.fetch(addr, nil) or return not_found
+    end
+    q = parse_query env["QUERY_STRING"]
+    now = Time.now.to_f
+    opts = {}
+    %w(since until).each do |key|
+      t = q[key] or next
+      begin
+        t = Float(t)
+      rescue ArgumentError
+        return bad_request("invalid #{key}=#{t}")
+      end
+      opts[key.to_sym] = t < 0 ? now + t : t
+    end
+    headers = { "Expires" => Time.at(0).httpdate }
+    buf = sampled ? @sampler.dump_history(addr, opts) : hist.dump(opts)
+    if format == "bin"
+      body = buf
+      headers["Content-Type"] = "application/octet-stream"
+      headers["X-Byte-Order"] = [1].pack("S") == [1].pack("v") ? "le" : "be"
+    else
+      body = "time,active,queued\n"
+      n = buf.bytesize / Raindrops::History::RECORD_SIZE
+      buf.unpack("QLL" * n).each_slice(3) do |msec, active, queued|
+        body << "#{msec / 1000.0},#{active},#{queued}\n"
+      end
+      headers["Content-Type"] = "text/csv"
+    end
+    headers["Content-Length"] = bytesize(body).to_s
+    [ 200, headers, [ body ] ]
   end
 
-  # This is the response body returned for "/tail/$ADDRESS.txt".  This
-  # must use a multi-threaded Rack server with streaming response support.
-  # It is an internal class and not expected to be used directly
+  def bad_request(msg)
+    Rack::Response.new([ msg ], 400).finish
+  end
+
+  def tail(addr, format, env)
+    Tailer.new(self, addr, env, format).finish
+  end
+
+  # subscribers are only added and removed with @sub_lock held, and
+  # @subscribers is replaced instead of modified so broadcast may read
+  # it without locking
+  def subscribe(addr) # :nodoc:
+    sub = Queue.new
+    @sub_lock.synchronize do
+      subs = @subscribers.dup
+      subs[addr] = ((subs[addr] || []) + [ sub ]).freeze
+      @subscribers = subs.freeze
+    end
+    sub
+  end
+
+  def unsubscribe(addr, sub) # :nodoc:
+    @sub_lock.synchronize do
+      list = @subscribers[addr] or return
+      list = list.reject { |s| s.equal?(sub) }
+      subs = @subscribers.dup
+      list.empty? ? subs.delete(addr) : subs[addr] = list.freeze
+      @subscribers = subs.freeze
+    end
+  end
+
+  # the line for every Tailer format, chunked and not
+  def tail_message(time, addr, stats) # :nodoc:
+    len = bytesize(addr)
+    len = 35 if len > 35
+    active, queued = stats.active, stats.queued
+    txt = sprintf("%20s % #{len}s % 10u % 10u\n", time.iso8601, addr,
+                  active, queued)
+    sse = "id: #{(time.to_f * 1000).round}\n" \
+          "data: {\"time\":\"#{time.iso8601}\"," \
+          "\"active\":#{active},\"queued\":#{queued}}\n\n"
+    [ active, queued, txt, Tailer.chunk(txt), sse, Tailer.chunk(sse) ].
+      each { |str| str.freeze }.freeze
+  end
+
+  # called by the aggregator thread once per tick, formats one message
+  # per listener and pushes it to every client tailing that listener
+  def broadcast(now, combined) # :nodoc:
+    @subscribers.each do |addr, list|
+      stats = combined[addr] or next
+      msg = tail_message(now, addr, stats)
+      list.each do |sub|
+        if sub.size < @tail_buffer
+          sub << msg
+        else # too slow, let Tailer#each finish the response
+          sub.clear
+          sub << nil
+          unsubscribe(addr, sub)
+        end
+      end
+    end
+  end
+
+  # This is the response body returned for "/tail/$ADDRESS.txt" and
+  # "/tail/$ADDRESS.sse".  This must use a multi-threaded Rack server with
+  # streaming response support.  It is an internal class and not
+  # expected to be used directly
   class Tailer
-    def initialize(rdmon, addr, env) # :nodoc:
+    DROPPED = "event: dropped\ndata: too slow\n\n" # :nodoc:
+
+    def self.chunk(body) # :nodoc:
+      "#{body.size.to_s(16)}\r\n#{body}\r\n"
+    end
+
+    def initialize(rdmon, addr, env, format = "txt") # :nodoc:
       @rdmon = rdmon
       @addr = addr
+      @sub = nil
       q = Rack::Utils.parse_query env["QUERY_STRING"]
       @active_min = q["active_min"].to_i
       @queued_min = q["queued_min"].to_i
-      len = Rack::Utils.bytesize(addr)
-      len = 35 if len > 35
-      @fmt = "%20s % #{len}s % 10u % 10u\n"
+      @sse = format == "sse"
       case env["HTTP_VERSION"]
       when "HTTP/1.0", nil
         @chunk = false
       else
         @chunk = true
       end
+      # index into the messages of Raindrops::Watcher#tail_message
+      @idx = (@sse ? 4 : 2) + (@chunk ? 1 : 0)
     end
 
     def finish
       headers = {
-        "Content-Type" => "text/plain",
+        "Content-Type" => @sse ? "text/event-stream" : "text/plain",
         "Cache-Control" => "no-transform",
         "Expires" => Time.at(0).httpdate,
       }
@@ -397,24 +751,33 @@ class Raindrops::Watcher
       [ 200, headers, self ]
     end
 
-    # called by the Rack server
+    # called by the Rack server, this only waits on our own queue
     def each # :nodoc:
-      begin
-        time, all = @rdmon.wait_snapshot
-        stats = all[@addr] or next
-        stats.queued >= @queued_min or next
-        stats.active >= @active_min or next
-        body = sprintf(@fmt, time.iso8601, @addr, stats.active, stats.queued)
-        body = "#{body.size.to_s(16)}\r\n#{body}\r\n" if @chunk
-        yield body
-      end while true
+      @sub ||= @rdmon.subscribe(@addr)
+      while msg = @sub.pop
+        msg[1] >= @queued_min or next
+        msg[0] >= @active_min or next
+        yield msg[@idx]
+      end
+      if @sse
+        yield(@chunk ? self.class.chunk(DROPPED) : DROPPED)
+      end
       yield "0\r\n\r\n" if @chunk
+    ensure
+      close
+    end
+
+    # called by the Rack server
+    def close # :nodoc:
+      sub, @sub = @sub, nil
+      @rdmon.unsubscribe(@addr, sub) if sub
     end
   end
 
   # shuts down the background thread, only for tests
   def shutdown
     @socket = nil
+    @subscribers.each_value { |list| list.each { |sub| sub << nil } }
     @thr.join if @thr
     @thr = nil
   end
@@ -38,6 +38,86 @@ class TestAggregatePMQ < Test::Unit::TestCase
     assert_equal agg.to_s, pmq.to_s
   end
 
+  def test_pack_unpack
+    klass = Raindrops::Aggregate::PMQ
+    hist = { 3 => [ 2, 20.0, 200.0 ], klass::LOW => [ 1, 0.5, 0.25 ] }
+    msg = klass.pack(hist, 0.5, 11)
+    size = klass::HEADER_SIZE + klass::MINMAX_SIZE + 2 * klass::BUCKET_SIZE
+    assert_equal size, msg.bytesize
+    min, max, buckets = klass.unpack(msg)
+    assert_equal 0.5, min
+    assert_kind_of Integer, max
+    assert_equal 11, max
+    assert_equal [ 3, 2, 20.0, 200.0, klass::LOW, 1, 0.5, 0.25 ], buckets
+    assert_nil klass.unpack(klass::STOP)
+    assert_equal false, klass.unpack(msg[0, msg.bytesize - 1])
+    assert_equal false, klass.unpack("")
+  end
+
+  def test_repeated_and_float_values
+    pmq = Raindrops::Aggregate::PMQ.new :queue => @queue,
+                                        :worker_interval => 100
+    thr = Thread.new { pmq.master_loop }
+    agg = Aggregate.new
+    vals = [ 5, 5, 5, 7, 1.5, 5, 7, 0.25, 1 << 20, 6 ]
+    vals.each { |i| pmq << i; agg << i }
+    pmq.flush
+    pmq.stop_master_loop
+    assert thr.join
+    assert_equal agg.count, pmq.count
+    assert_equal agg.min, pmq.min
+    assert_equal agg.max, pmq.max
+    assert_equal agg.mean, pmq.mean
+    assert_equal agg.std_dev, pmq.std_dev
+    assert_equal agg.outliers_low, pmq.outliers_low
+    assert_equal agg.outliers_high, pmq.outliers_high
+    assert_equal agg.to_s, pmq.to_s
+  end
+
+  def test_snapshot_consistent
+    agg = Aggregate.new
+    pmq = Raindrops::Aggregate::PMQ.new :queue => @queue, :aggregate => agg
+    rd, wr = IO.pipe
+    pid = fork do
+      rd.close
+      bad = 0
+      2000.times do
+        a = pmq.load_snapshot
+        bad += 1 if a.count != a.sum.to_i
+      end
+      wr.write(bad.to_s)
+    end
+    wr.close
+    writer = Thread.new { loop { agg << 1; pmq.flush_master } }
+    assert_equal "0", rd.read
+    assert Process.waitpid2(pid).last.success?
+    writer.kill.join
+    pmq.flush_master
+    assert_equal agg.count, pmq.load_snapshot.count
+    assert_equal agg.min, pmq.load_snapshot.min
+  end
+
+  def test_master_died_while_writing
+    agg = Aggregate.new
+    pmq = Raindrops::Aggregate::PMQ.new :queue => @queue, :aggregate => agg
+    agg << 1
+    pmq.flush_master
+    assert_equal 1, pmq.load_snapshot.count
+    seq = Raindrops::Aggregate::PMQ::SEQ
+    snapshot = pmq.instance_variable_get(:@snapshot)
+    snapshot.incr(seq) # killed inside flush_master
+    assert_equal 1, pmq.load_snapshot.count # the last good copy
+
+    fresh = Raindrops::Aggregate::PMQ.new :queue => @queue
+    fresh.instance_variable_get(:@snapshot).incr(seq)
+    assert_raises(RuntimeError) { fresh.load_snapshot }
+
+    agg << 2
+    pmq.flush_master
+    assert snapshot[seq].even?
+    assert_equal 2, pmq.load_snapshot.count
+  end
+
   def test_multi_process
     nr_workers = 4
     nr = 100
@@ -0,0 +1,148 @@
+# -*- encoding: binary -*-
+require 'test/unit'
+require 'raindrops'
+
+class TestHistogram < Test::Unit::TestCase
+
+  def test_empty
+    hist = Raindrops::Histogram.new
+    assert_equal 0, hist.count
+    assert_equal 0, hist.sum
+    assert_nil hist.min
+    assert_nil hist.max
+    assert_nil hist.mean
+    assert_nil hist.percentile(50)
+    assert_equal 5, hist.bits
+  end
+
+  def test_record
+    hist = Raindrops::Histogram.new
+    assert_equal hist, hist << 5
+    assert_equal hist, hist.record(100, 3)
+    assert_equal 4, hist.count
+    assert_equal 305, hist.sum
+    assert_equal 5, hist.min
+    assert_equal 100, hist.max
+    assert_in_delta 76.25, hist.mean, 0.001
+    assert_equal 5, hist.percentile(25)
+    assert_equal 100, hist.percentile(100)
+  end
+
+  def test_exact_small_values
+    hist = Raindrops::Histogram.new(:bits => 4)
+    (0..15).each { |i| hist << i }
+    rv = []
+    hist.each_nonzero { |lo, hi, n| rv << [ lo, hi, n ] }
+    assert_equal((0..15).map { |i| [ i, i, 1 ] }, rv)
+  end
+
+  def test_relative_error
+    bits = 5
+    hist = Raindrops::Histogram.new(:bits => bits)
+    vals = [ 33, 1000, 12345, 999999, 2 ** 40 + 12345, Raindrops::MAX ]
+    vals.each { |v| hist << v }
+    seen = []
+    hist.each_nonzero do |lo, hi, n|
+      assert_equal 1, n
+      assert lo <= hi
+      assert((hi - lo).to_f / lo <= 2.0 ** (1 - bits))
+      seen << [ lo, hi ]
+    end
+    assert_equal vals.size, seen.size
+    vals.each_with_index do |v, i|
+      assert seen[i][0] <= v && v <= seen[i][1], "#{v} not in #{seen[i]}"
+    end
+  end
+
+  def test_percentiles
+    hist = Raindrops::Histogram.new
+    (1..1000).each { |i| hist << i }
+    p50, p99 = hist.percentile(50), hist.percentile(99)
+    assert_in_delta 500, p50, 500 * 2.0 ** -4
+    assert_in_delta 990, p99, 990 * 2.0 ** -4
+    assert_equal 1000, hist.percentile(100)
+    assert_raises(ArgumentError) { hist.percentile(101) }
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) { Raindrops::Histogram.new(:bits => 0) }
+    assert_raises(ArgumentError) { Raindrops::Histogram.new(:bits => 11) }
+    assert_raises(ArgumentError) { Raindrops::Histogram.new << -1 }
+  end
+
+  def test_shared
+    hist = Raindrops::Histogram.new
+    pids = (1..4).map do |i|
+      fork { 1000.times { |j| hist << (i * 1000 + j) } }
+    end
+    pids.each do |pid|
+      _, status = Process.waitpid2(pid)
+      assert status.success?
+    end
+    assert_equal 4000, hist.count
+    assert_equal 1000, hist.min
+    assert_equal 4999, hist.max
+    total = 0
+    hist.each_nonzero { |_, _, n| total += n }
+    assert_equal 4000, total
+  end
+
+  def test_dup_and_reset
+    hist = Raindrops::Histogram.new
+    hist << 1
+    tmp = hist.dup
+    hist.reset!
+    assert_equal 0, hist.count
+    assert_nil hist.min
+    assert_equal 1, tmp.count
+    assert_equal 1, tmp.min
+  end
+
+  def test_merge
+    a = Raindrops::Histogram.new
+    b = Raindrops::Histogram.new
+    a << 1 << 100
+    b << 5 << 1000
+    assert_equal a, a.merge!(b)
+    assert_equal 4, a.count
+    assert_equal 1106, a.sum
+    assert_equal 1, a.min
+    assert_equal 1000, a.max
+    assert_equal 2, b.count
+
+    a.merge!(Raindrops::Histogram.new)
+    assert_equal 1, a.min
+    assert_raises(ArgumentError) { a.merge!(Raindrops::Histogram.new(:bits => 3)) }
+  end
+
+  def test_record_request_start
+    hist = Raindrops::Histogram.new
+    now = 1_300_000_001.0
+    assert_equal 500_000, hist.record_request_start("t=1300000000.5", now)
+    assert_equal 250_000, hist.record_request_start("1300000000750", now)
+    assert_equal 1_000_000,
+                 hist.record_request_start("1300000000000000", now)
+    assert_equal 0, hist.record_request_start("t=1300000002", now)
+    assert_equal 4, hist.count
+    assert_equal 1_000_000, hist.max
+
+    # fractions use the same unit as the integer part
+    assert_equal 249_500, hist.record_request_start("t=1300000000750.5", now)
+    assert_equal 1_000_000,
+                 hist.record_request_start("1300000000000000.9", now)
+
+    # too far in the future, but must not wrap around into the past
+    %w(9999999999999999999 9999999999999999999.9 t=999999999999.999999
+       t=18446744073709.551).each do |future|
+      assert_equal 0, hist.record_request_start(future, now), future
+    end
+    assert_equal 10, hist.count
+
+    [ nil, "", "t=", "x", "t=1.2.3", "123abc", "99999999999999999999" ].each do |bad|
+      assert_nil hist.record_request_start(bad, now), bad.inspect
+    end
+    assert_equal 10, hist.count
+
+    assert_kind_of Integer, hist.record_request_start("t=#{Time.now.to_i}")
+  end
+end
@@ -0,0 +1,74 @@
+# -*- encoding: binary -*-
+require 'test/unit'
+require 'raindrops'
+
+class TestHistory < Test::Unit::TestCase
+
+  def test_empty
+    hist = Raindrops::History.new(10)
+    assert_equal 10, hist.capacity
+    assert_equal 0, hist.size
+    assert_equal 0, hist.count
+    assert_equal "", hist.dump
+    assert_equal 16, Raindrops::History::RECORD_SIZE
+  end
+
+  def test_record
+    hist = Raindrops::History.new(10)
+    assert_equal hist, hist.record(1, 2, 1000)
+    hist.record(3, 4, Time.at(1001.5))
+    samples = []
+    hist.each { |*x| samples << x }
+    assert_equal [ [ 1000.0, 1, 2 ], [ 1001.5, 3, 4 ] ], samples
+    assert_equal [ 1000_000, 1, 2, 1001_500, 3, 4 ],
+                 hist.dump.unpack("QLL" * 2)
+  end
+
+  def test_default_time
+    hist = Raindrops::History.new(1)
+    hist.record(0, 0)
+    hist.each { |t,| assert_in_delta Time.now.to_f, t, 2.0 }
+  end
+
+  def test_wraparound
+    hist = Raindrops::History.new(3)
+    5.times { |i| hist.record(i, i * 2, 100 + i) }
+    assert_equal 3, hist.size
+    assert_equal 5, hist.count
+    active = []
+    hist.each { |_, a, _| active << a }
+    assert_equal [ 2, 3, 4 ], active
+  end
+
+  def test_range
+    hist = Raindrops::History.new(100)
+    10.times { |i| hist.record(i, 0, 100 + i) }
+    times = []
+    hist.each(:since => 103, :until => Time.at(105)) { |t,| times << t }
+    assert_equal [ 103.0, 104.0, 105.0 ], times
+    assert_equal 2 * Raindrops::History::RECORD_SIZE,
+                 hist.dump(:since => 108).bytesize
+  end
+
+  def test_shared
+    hist = Raindrops::History.new(4)
+    pid = fork { hist.record(7, 8, 1); exit!(0) }
+    Process.waitpid(pid)
+    assert_equal [ 1000, 7, 8 ], hist.dump.unpack("QLL")
+  end
+
+  def test_dup
+    hist = Raindrops::History.new(4)
+    hist.record(1, 1, 1)
+    copy = hist.dup
+    hist.record(2, 2, 2)
+    assert_equal 1, copy.size
+    assert_equal 2, hist.size
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) { Raindrops::History.new(0) }
+    hist = Raindrops::History.new(1)
+    assert_raises(ArgumentError) { hist.record(0, 0, -1) }
+  end
+end
@@ -2,6 +2,7 @@
 require 'test/unit'
 require 'raindrops'
 require 'fcntl'
+require 'socket'
 $stderr.sync = $stdout.sync = true
 
 class TestInetDiagSocket < Test::Unit::TestCase
@@ -13,4 +14,24 @@ class TestInetDiagSocket < Test::Unit::TestCase
     assert_equal Fcntl::FD_CLOEXEC, flags & Fcntl::FD_CLOEXEC
     assert_nil sock.close
   end
+
+  def test_buffer_size
+    sock = Raindrops::InetDiagSocket.new
+    assert_equal 32768, sock.buffer_size
+    sock.close
+    sock = Raindrops::InetDiagSocket.new(1)
+    assert_equal Raindrops::PAGE_SIZE, sock.buffer_size
+    s = TCPServer.new("127.0.0.1", 0)
+    addr = "127.0.0.1:#{s.addr[1]}"
+    clients = (1..200).map { TCPSocket.new("127.0.0.1", s.addr[1]) }
+    3.times do
+      stats = Raindrops::Linux.tcp_listener_stats(nil, sock)
+      assert_equal 0, stats[addr].active
+      assert stats[addr].queued > 0
+    end
+    ensure
+      clients.each { |io| io.close } if clients
+      s.close if s
+      sock.close if sock
+  end
 end if RUBY_PLATFORM =~ /linux/
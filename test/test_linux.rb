@@ -67,6 +67,77 @@ class TestLinux < Test::Unit::TestCase
     assert_equal 1, stats[tmp.path].queued
   end
 
+  def test_unix_diag
+    defined?(Raindrops::Linux.unix_diag_listener_stats) or return
+    nlsock = Raindrops::InetDiagSocket.new
+    tmp = Tempfile.new("\xde\xad\xbe\xef") # valid path, really :)
+    File.unlink(tmp.path)
+    us = UNIXServer.new(tmp.path)
+    missing = "#{tmp.path}.missing"
+    stats = unix_diag_listener_stats([tmp.path, missing], nlsock)
+    assert_equal 2, stats.size
+    assert_equal 0, stats[tmp.path].active
+    assert_equal 0, stats[tmp.path].queued
+    assert_equal 0, stats[missing].total
+
+    @to_close << UNIXSocket.new(tmp.path)
+    @to_close << UNIXSocket.new(tmp.path)
+    @to_close << us.accept
+    stats = unix_diag_listener_stats([tmp.path], nlsock)
+    assert_equal 1, stats[tmp.path].active
+    assert_equal 1, stats[tmp.path].queued
+
+    stats = unix_diag_listener_stats(nil, nlsock)
+    assert_equal 1, stats[tmp.path].active
+    assert_equal 1, stats[tmp.path].queued
+    ensure
+      nlsock.close if nlsock
+  end
+
+  def test_unix_diag_inode
+    defined?(Raindrops::Linux.unix_diag_listener_stats) or return
+    tmp = Tempfile.new("raindrops")
+    path = tmp.path
+    File.unlink(path)
+    old = UNIXServer.new(path)
+    @to_close << old
+    @to_close << UNIXSocket.new(path)
+    assert_equal 1, unix_diag_listener_stats([path])[path].queued
+
+    # a new listener took over the path, ignore the stale one
+    File.unlink(path)
+    us = UNIXServer.new(path)
+    @to_close << us
+    assert_equal 0, unix_diag_listener_stats([path])[path].queued
+    @to_close << UNIXSocket.new(path)
+    @to_close << UNIXSocket.new(path)
+    @to_close << us.accept
+    stats = unix_diag_listener_stats([path])
+    assert_equal 1, stats[path].active
+    assert_equal 1, stats[path].queued
+
+    # still found by inode after a rename
+    renamed = "#{path}.renamed"
+    File.rename(path, renamed)
+    stats = unix_diag_listener_stats([renamed])
+    assert_equal 1, stats[renamed].active
+    assert_equal 1, stats[renamed].queued
+    ensure
+      File.unlink(renamed) if renamed && File.exist?(renamed)
+  end
+
+  def test_unix_diag_abstract
+    defined?(Raindrops::Linux.unix_diag_listener_stats) or return
+    name = "\0raindrops-test-#$$"
+    us = Socket.new(:UNIX, :STREAM, 0)
+    us.bind(Socket.pack_sockaddr_un(name))
+    us.listen(5)
+    @to_close << us
+    stats = unix_diag_listener_stats(["@raindrops-test-#$$"])
+    assert_equal 0, stats["@raindrops-test-#$$"].total
+    assert stats.include?("@raindrops-test-#$$")
+  end
+
   def test_tcp
     s = TCPServer.new(TEST_ADDR, 0)
     port = s.addr[1]
@@ -178,6 +249,75 @@ class TestLinux < Test::Unit::TestCase
   end
 
   # tries to overflow buffers
+  def test_tcp_multi_many
+    s = TCPServer.new(TEST_ADDR, 0)
+    addr = "#{TEST_ADDR}:#{s.addr[1]}"
+    # long enough to need jumps beyond the 8-bit "yes" offset
+    addrs = (1..100).map { |i| "#{TEST_ADDR}:#{i}" } << addr
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    stats = tcp_listener_stats(addrs)
+    assert_equal 1, stats[addr].queued
+    assert_equal 0, stats[addr].active
+  end
+
+  def test_tcp_port_range
+    s1 = TCPServer.new(TEST_ADDR, 0)
+    s2 = TCPServer.new(TEST_ADDR, 0)
+    port1, port2 = [ s1.addr[1], s2.addr[1] ].sort
+    addr1, addr2 = "#{TEST_ADDR}:#{port1}", "#{TEST_ADDR}:#{port2}"
+    @to_close << TCPSocket.new(TEST_ADDR, port2)
+
+    stats = tcp_listener_stats("#{TEST_ADDR}:#{port1}-#{port2}")
+    assert_equal 0, stats[addr1].queued
+    assert_equal 1, stats[addr2].queued
+    assert ! stats.include?("#{TEST_ADDR}:#{port1}-#{port2}")
+
+    stats = tcp_listener_stats([ "#{TEST_ADDR}:#{port2}-#{port2}", addr1 ])
+    assert_equal [ addr1, addr2 ].sort, stats.keys.sort
+    assert_equal 1, stats[addr2].queued
+
+    assert_raises(ArgumentError) do
+      tcp_listener_stats([ "#{TEST_ADDR}:#{port2}-#{port1}", addr1 ])
+    end
+  end
+
+  def test_tcp_info_dump
+    s = TCPServer.new(TEST_ADDR, 0)
+    addr = "#{TEST_ADDR}:#{s.addr[1]}"
+    assert_equal "", Raindrops::Linux.tcp_info_dump(addr)
+
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    @to_close << s.accept
+    dump = Raindrops::Linux.tcp_info_dump(addr)
+    assert_equal 2 * Raindrops::Linux::TCP_INFO_SIZE, dump.bytesize
+
+    states = []
+    rv = Raindrops::Linux.tcp_info_dump([ addr ]) { |t| states << t.state }
+    assert_equal dump.bytesize, rv.bytesize
+    assert_equal [ 1, 1 ], states # TCP_ESTABLISHED
+  end
+
+  def test_tcp_listener_queue_ages
+    s = TCPServer.new(TEST_ADDR, 0)
+    addr = "#{TEST_ADDR}:#{s.addr[1]}"
+    ages = Raindrops::Linux.tcp_listener_queue_ages(addr)
+    assert_equal [ addr ], ages.keys
+    assert_equal Raindrops::QueueAges.new(0, nil, nil, nil), ages[addr]
+
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    sleep 0.1
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    @to_close << TCPSocket.new(TEST_ADDR, s.addr[1])
+    @to_close << s.accept
+    ages = Raindrops::Linux.tcp_listener_queue_ages([ addr ])[addr]
+    assert_kind_of Raindrops::QueueAges, ages
+    assert_equal 2, ages.count
+    assert_kind_of Integer, ages.max
+    assert ages.p50 <= ages.p99
+    assert ages.p99 <= ages.max
+  end
+
   def test_tcp_stress_test
     nr_proc = 32
     nr_sock = 500
@@ -61,4 +61,33 @@ class TestLinuxMiddleware < Test::Unit::TestCase
     assert_equal expect, response
   end
 
+  def test_listener_cache
+    srv = TCPServer.new("127.0.0.1", 0)
+    @to_close << srv
+    addr = "127.0.0.1:#{srv.addr[1]}"
+    app = Raindrops::Middleware.new(@app, :listeners => [ addr ],
+                                    :listener_ttl => 60)
+    body = app.call("PATH_INFO" => "/_raindrops").last.join
+    assert_match %r{^#{addr} queued: 0$}, body
+
+    @to_close << TCPSocket.new("127.0.0.1", srv.addr[1])
+    body = app.call("PATH_INFO" => "/_raindrops").last.join
+    assert_match %r{^#{addr} queued: 0$}, body, "cached"
+
+    # forked workers share the cache
+    rd, wr = IO.pipe
+    pid = fork do
+      rd.close
+      wr.write(app.call("PATH_INFO" => "/_raindrops").last.join)
+      exit!(0)
+    end
+    wr.close
+    assert_match %r{^#{addr} queued: 0$}, rd.read
+    Process.waitpid(pid)
+    rd.close
+
+    app.instance_variable_get(:@listener_cache).expire!
+    body = app.call("PATH_INFO" => "/_raindrops").last.join
+    assert_match %r{^#{addr} queued: 1$}, body
+  end
 end if RUBY_PLATFORM =~ /linux/
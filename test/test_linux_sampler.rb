@@ -0,0 +1,142 @@
+# -*- encoding: binary -*-
+require 'test/unit'
+require 'raindrops'
+require 'socket'
+$stderr.sync = $stdout.sync = true
+
+class TestLinuxSampler < Test::Unit::TestCase
+  TEST_ADDR = ENV['UNICORN_TEST_ADDR'] || '127.0.0.1'
+
+  def setup
+    @to_close = []
+  end
+
+  def teardown
+    @to_close.each { |io| io.close unless io.closed? }
+  end
+
+  def test_sample
+    s = TCPServer.new(TEST_ADDR, 0)
+    port = s.addr[1]
+    addr = "#{TEST_ADDR}:#{port}"
+    @to_close << s
+    2.times { @to_close << TCPSocket.new(TEST_ADDR, port) }
+    @to_close << s.accept
+
+    sampler = Raindrops::Linux::Sampler.new(addr, 0.005)
+    assert sampler.running?
+    assert_equal [ addr ], sampler.addresses
+    assert sampler.addresses.frozen?
+    assert_in_delta 0.005, sampler.interval, 0.0001
+    sleep 0.01 until sampler.ticks >= 3
+
+    stats = sampler.stats[addr]
+    assert_equal 1, stats.active
+    assert_equal 1, stats.queued
+
+    queued = sampler.queued_histograms[addr]
+    assert_kind_of Raindrops::Histogram, queued
+    assert queued.count >= 3
+    assert_equal 1, queued.max
+    assert_equal 1, sampler.active_histograms[addr].min
+    assert_equal 0, sampler.errors
+    assert_nil sampler.last_error
+    assert_kind_of Integer, sampler.missed
+
+    assert_nil sampler.stop
+    assert ! sampler.running?
+    ticks = sampler.ticks
+    sleep 0.02
+    assert_equal ticks, sampler.ticks
+    assert_nil sampler.stop
+  end
+
+  def test_histograms_are_copies
+    s = TCPServer.new(TEST_ADDR, 0)
+    @to_close << s
+    addr = "#{TEST_ADDR}:#{s.addr[1]}"
+    sampler = Raindrops::Linux::Sampler.new([addr], 0.005, :bits => 3)
+    sleep 0.01 until sampler.ticks >= 1
+    sampler.stop
+    hist = sampler.active_histograms[addr]
+    assert_equal 3, hist.bits
+    hist << 1000
+    assert_not_equal 1000, sampler.active_histograms[addr].max
+  end
+
+  def test_histograms_into_and_reset
+    s = TCPServer.new(TEST_ADDR, 0)
+    @to_close << s
+    port = s.addr[1]
+    addr = "#{TEST_ADDR}:#{port}"
+    @to_close << TCPSocket.new(TEST_ADDR, port)
+    sampler = Raindrops::Linux::Sampler.new([addr], 0.005)
+    sleep 0.01 until sampler.ticks >= 2
+
+    dst = {}
+    assert_same dst, sampler.queued_histograms(dst)
+    hist = dst[addr]
+    assert hist.count >= 2
+    assert_same hist, sampler.queued_histograms(dst)[addr]
+    assert_raises(ArgumentError) do
+      sampler.queued_histograms(addr => Raindrops::Histogram.new(:bits => 3))
+    end
+
+    sampler.stop
+    assert_same sampler, sampler.reset!(addr)
+    assert_equal 0, sampler.queued_histograms(dst)[addr].count
+    assert_nil hist.max
+    assert_raises(ArgumentError) { sampler.reset!("127.0.0.1:1") }
+  end
+
+  def test_dump_history
+    s = TCPServer.new(TEST_ADDR, 0)
+    @to_close << s
+    port = s.addr[1]
+    addr = "#{TEST_ADDR}:#{port}"
+    @to_close << TCPSocket.new(TEST_ADDR, port)
+    sampler = Raindrops::Linux::Sampler.new(addr, 0.005, :history => 4)
+    sleep 0.01 until sampler.ticks >= 6
+    sampler.stop
+
+    buf = sampler.dump_history(addr)
+    n = buf.bytesize / Raindrops::History::RECORD_SIZE
+    assert_equal 4, n
+    recs = buf.unpack("QLL" * n).each_slice(3).to_a
+    recs.each { |_, active, queued| assert_equal [ 0, 1 ], [ active, queued ] }
+    assert_equal recs.sort, recs
+    assert_in_delta Time.now.to_f * 1000, recs[-1][0], 5000
+    since = recs[-1][0] / 1000.0
+    assert_equal Raindrops::History::RECORD_SIZE,
+                 sampler.dump_history(addr, :since => since).bytesize
+    assert_raises(ArgumentError) { sampler.dump_history("127.0.0.1:1") }
+
+    sampler = Raindrops::Linux::Sampler.new(addr, 1)
+    assert_nil sampler.dump_history(addr)
+    sampler.stop
+  end
+
+  def test_invalid
+    assert_raises(ArgumentError) do
+      Raindrops::Linux::Sampler.new([], 1)
+    end
+    assert_raises(ArgumentError) do
+      Raindrops::Linux::Sampler.new("127.0.0.1:80", 0)
+    end
+    assert_raises(ArgumentError) do
+      Raindrops::Linux::Sampler.new("127.0.0.1:80-90", 1)
+    end
+    assert_raises(ArgumentError) do
+      Raindrops::Linux::Sampler.new("127.0.0.1:80", 1, :bits => 99)
+    end
+  end
+
+  def test_gc
+    s = TCPServer.new(TEST_ADDR, 0)
+    @to_close << s
+    addr = "#{TEST_ADDR}:#{s.addr[1]}"
+    10.times { Raindrops::Linux::Sampler.new(addr, 0.001) }
+    GC.start
+  end
+end if RUBY_PLATFORM =~ /linux/ &&
+       defined?(Raindrops::Linux::Sampler)
@@ -29,10 +29,87 @@ class TestLinuxTCP_Info < Test::Unit::TestCase
       s.close
   end
 
+  def test_record_last_data_recv
+    s = TCPServer.new TEST_ADDR, 0
+    c = TCPSocket.new TEST_ADDR, s.addr[1]
+    c.write "."
+    a = s.accept
+    sleep 0.05
+    hist = Raindrops::Histogram.new
+    ms = hist.record_last_data_recv(a)
+    assert_kind_of Integer, ms
+    assert ms >= 40, "last_data_recv=#{ms}"
+    assert_equal 1, hist.count
+    assert_equal ms, hist.max
+
+    Raindrops::Aggregate::LastDataRecv.default_aggregate = hist
+    s.extend Raindrops::Aggregate::LastDataRecv
+    c2 = TCPSocket.new TEST_ADDR, s.addr[1]
+    c2.write "." # TCP_DEFER_ACCEPT is enabled by extend
+    a2 = s.accept
+    assert_equal 2, hist.count
+    ensure
+      c.close if c
+      a.close if a
+      c2.close if c2
+      a2.close if a2
+      s.close
+      Raindrops::Aggregate::LastDataRecv.default_aggregate = nil
+  end
+
+  def test_packed_string
+    tmp = Raindrops::TCP_Info.new [ 10, 0, 0, 0 ].pack("C*")
+    assert_equal 10, tmp.state # TCP_LISTEN
+    assert_equal 0, tmp.rtt
+  end
+
+  def test_refresh
+    s = TCPServer.new TEST_ADDR, 0
+    tmp = Raindrops::TCP_Info.new s
+    c = TCPSocket.new TEST_ADDR, s.addr[1]
+    TCP_INFO_useful_listenq and assert_equal 1, tmp.refresh!(s).unacked
+    a = s.accept
+    assert_equal 1, tmp.refresh!(a).state # TCP_ESTABLISHED
+    ensure
+      c.close if c
+      a.close if a
+      s.close
+  end
+
+  def test_to_a_values_at
+    s = TCPServer.new TEST_ADDR, 0
+    tmp = Raindrops::TCP_Info.new s
+    ary = tmp.to_a
+    assert_equal Raindrops::TCP_Info::FIELDS.size, ary.size
+    assert_equal Raindrops::TCP_Info::FIELDS.map { |f| tmp.__send__(f) }, ary
+    assert_equal [ tmp.rtt, tmp.state ], tmp.values_at(:rtt, "state")
+    assert_raises(ArgumentError) { tmp.values_at(:foo) }
+    ensure
+      s.close
+  end
+
+  def test_sample
+    s = TCPServer.new TEST_ADDR, 0
+    c = TCPSocket.new TEST_ADDR, s.addr[1]
+    a = s.accept
+    size = Raindrops::TCP_Info::SIZE
+    packed = Raindrops::TCP_Info.sample([ s, a ])
+    assert_equal 2 * size, packed.bytesize
+    assert_equal 10, Raindrops::TCP_Info.new(packed[0, size]).state
+    assert_equal 1, Raindrops::TCP_Info.new(packed[size, size]).state
+    assert_equal "", Raindrops::TCP_Info.sample([])
+    assert_raises(TypeError) { Raindrops::TCP_Info.sample([ s, :bad ]) }
+    ensure
+      c.close if c
+      a.close if a
+      s.close
+  end
+
   def test_accessors
     s = TCPServer.new TEST_ADDR, 0
     tmp = Raindrops::TCP_Info.new s
     tcp_info_methods = tmp.methods - Object.new.methods
+    tcp_info_methods.reject! { |m| %w(refresh! to_a values_at).include?(m.to_s) }
     assert tcp_info_methods.size >= 32
     tcp_info_methods.each do |m|
       val = tmp.__send__ m
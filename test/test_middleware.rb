@@ -66,6 +66,246 @@ class TestMiddleware < Test::Unit::TestCase
     assert_equal expect, response
   end
 
+  def test_metrics_endpoint
+    stats = Raindrops::Middleware::Stats.new
+    app = Raindrops::Middleware.new(@app, :stats => stats)
+    assert_nil app.metrics_path
+    response = app.call("PATH_INFO" => "/_raindrops/metrics")
+    assert_kind_of Raindrops::Middleware::Proxy, response.last # disabled
+    response.last.close
+    app = Raindrops::Middleware.new(@app, :stats => stats,
+                                    :metrics_path => "/_raindrops/metrics",
+                                    :metrics_interval => 60)
+    status, headers, body = app.call("PATH_INFO" => "/_raindrops/metrics")
+    assert_equal 200, status
+    assert_match %r{\Aapplication/openmetrics-text}, headers["Content-Type"]
+    body = body.join
+    assert_equal body.size.to_s, headers["Content-Length"]
+    assert_match %r{^# TYPE raindrops_calling gauge$}, body
+    assert_match %r{^raindrops_calling 0$}, body
+    assert_match %r{^raindrops_writing 0$}, body
+    assert_match %r{^# EOF\n\z}, body
+
+    # cached until :metrics_interval expires
+    stats.incr_calling
+    _, _, cached = app.call("PATH_INFO" => "/_raindrops/metrics")
+    assert_equal body, cached.join
+
+    app = Raindrops::Middleware.new(@app, :stats => stats,
+                                    :metrics_path => "/metrics",
+                                    :metrics_interval => 0)
+    _, _, body = app.call("PATH_INFO" => "/metrics")
+    assert_match %r{^raindrops_calling 1$}, body.join
+  end
+
+  def test_latency
+    latency = Raindrops::Middleware::Latency.new("api" => %r{\A/api/})
+    assert_equal %w(api other), latency.names
+    app = Raindrops::Middleware.new(@app, :latency => latency,
+                                    :metrics_path => "/_raindrops/metrics")
+    response = app.call("PATH_INFO" => "/api/foo")
+    assert_equal 1, latency.app("api").count
+    assert_equal 0, latency.total("api").count
+    response.last.close
+    assert_equal 1, latency.total("api").count
+    assert latency.total("api").max >= latency.app("api").max
+
+    app.call("PATH_INFO" => "/").last.close
+    app.call({}).last.close
+    assert_equal 2, latency.app("other").count
+
+    _, _, body = app.call("PATH_INFO" => "/_raindrops")
+    body = body.join
+    assert_match %r{^api app_us: count=1 p50=\d+ p90=\d+ p99=\d+ max=\d+$}, body
+    assert_match %r{^other total_us: count=2 }, body
+
+    _, _, body = app.call("PATH_INFO" => "/_raindrops/metrics")
+    body = body.join
+    assert_match %r{^raindrops_route_app_microseconds_count\{route="api"\} 1$},
+                 body
+  end
+
+  def test_latency_classifier
+    latency = Raindrops::Middleware::Latency.new(lambda { |env| :slow },
+                                                 :names => %w(slow))
+    app = Raindrops::Middleware.new(@app, :latency => latency)
+    app.call({}).last.close
+    assert_equal 1, latency.app("slow").count
+    assert_raises(ArgumentError) do
+      Raindrops::Middleware::Latency.new(lambda { |env| "x" })
+    end
+  end
+
+  def test_latency_no_alloc
+    latency = Raindrops::Middleware::Latency.new("api" => %r{\A/api/})
+    env = { "PATH_INFO" => "/api/x" }
+    record = lambda do
+      route = latency.classify(env)
+      start = Raindrops::Middleware::Latency.now
+      latency.app(route) << Raindrops::Middleware::Latency.now - start
+    end
+    record.call
+    before = GC.stat(:total_allocated_objects)
+    1000.times { record.call }
+    # GC.stat itself may allocate a few objects
+    assert_operator GC.stat(:total_allocated_objects) - before, :<, 10
+  end if GC.respond_to?(:stat) && Regexp.method_defined?(:match?) &&
+         defined?(Process::CLOCK_MONOTONIC)
+
+  def test_transfer
+    transfer = Raindrops::Middleware::Transfer.new(%w(text/html))
+    assert_equal %w(text/html other), transfer.types
+    app = Raindrops::Middleware.new(lambda { |env|
+      [ 200, { "Content-Type" => "text/html; charset=utf-8" }, %w(hello world) ]
+    }, :transfer => transfer)
+    body = app.call({}).last
+    body.each { |x| }
+    body.close
+    bytes = transfer.bytes("2xx", "text/html")
+    assert_equal 1, bytes.count
+    assert_equal 10, bytes.max
+    assert_equal 1, transfer.drain("2xx", "text/html").count
+
+    app = Raindrops::Middleware.new(lambda { |env|
+      [ 404, { "content-type" => "application/json" }, [ "{}" ] ]
+    }, :transfer => transfer, :metrics_path => "/_raindrops/metrics")
+    app.call({}).last.close # never iterated
+    assert_equal 0, transfer.bytes("4xx", "other").max
+    assert_equal [ %w(2xx text/html), %w(4xx other) ],
+                 transfer.to_enum(:each).map { |s, t,| [ s, t ] }
+
+    _, _, body = app.call("PATH_INFO" => "/_raindrops")
+    body = body.join
+    assert_match %r{^2xx text/html bytes: count=1 p50=\d+ p90=\d+ p99=10 max=10$},
+                 body
+    assert_match %r{^4xx other drain_us: count=1 }, body
+    _, _, body = app.call("PATH_INFO" => "/_raindrops/metrics")
+    assert_match %r{^raindrops_response_bytes_count\{status="2xx",type="text/html"\} 1$},
+                 body.join
+
+    file = Struct.new(:to_path) { def each; yield "sendfile"; end }
+    app = Raindrops::Middleware.new(lambda { |env|
+      [ 200, { "content-type" => "text/html" }, file.new(__FILE__) ]
+    }, :transfer => transfer)
+    body = app.call({}).last
+    assert_equal __FILE__, body.to_path
+    body.close # sent with sendfile, never iterated
+    assert_equal 1, transfer.bytes("2xx", "text/html").count
+    body = app.call({}).last
+    body.each { |x| } # no sendfile support in the server
+    body.close
+    assert_equal 2, transfer.bytes("2xx", "text/html").count
+  end
+
+  def test_close_body_if_recording_fails
+    hist = Object.new
+    def hist.<<(x); raise "recording failed"; end
+    body = [ "hello" ]
+    def body.close; @closed = true; end
+    def body.closed?; @closed; end
+    stats = Raindrops::Middleware::Stats.new
+    stats.incr_writing
+    proxy = Raindrops::Middleware::Proxy.new(body, stats, hist,
+                                             Raindrops::Middleware::Latency.now)
+    assert_raises(RuntimeError) { proxy.close }
+    assert body.closed?
+    assert_equal 0, stats.writing
+  end
+
+  def test_queue_time
+    hist = Raindrops::Histogram.new
+    app = Raindrops::Middleware.new(@app, :queue_time => hist,
+                                    :metrics_path => "/_raindrops/metrics")
+    start = Time.now.to_f - 0.05
+    app.call("HTTP_X_REQUEST_START" => "t=%0.3f" % start).last.close
+    app.call({}).last.close
+    app.call("HTTP_X_REQUEST_START" => "garbage").last.close
+    assert_equal 1, hist.count
+    assert_operator hist.max, :>=, 49_000
+
+    _, _, body = app.call("PATH_INFO" => "/_raindrops")
+    assert_match %r{\Acalling: 0\nwriting: 0\nqueue_time_us: count=1 }, body.join
+    _, _, body = app.call("PATH_INFO" => "/_raindrops/metrics")
+    assert_match %r{^raindrops_request_queue_microseconds_count 1$}, body.join
+
+    app = Raindrops::Middleware.new(@app, :queue_time => hist,
+                                    :queue_time_header => "HTTP_X_QUEUE_START")
+    app.call("HTTP_X_QUEUE_START" => (start * 1000).to_i.to_s).last.close
+    assert_equal 2, hist.count
+  end
+
+  def test_listener_cache_single_flight
+    cache = Raindrops::Middleware::ListenerCache.new(%w(/a /b), 60)
+    calls = Raindrops.new(1)
+    rd, wr = IO.pipe
+    pids = (1..4).map do
+      fork do
+        rd.close
+        rv = cache.fetch do
+          calls.incr(0)
+          sleep 0.1
+          { "/a" => Raindrops::ListenStats.new(1, 2) }
+        end
+        wr.write("#{rv['/a'].active},#{rv['/a'].queued}\n")
+        exit!(0)
+      end
+    end
+    wr.close
+    lines = rd.read.split(/\n/)
+    pids.each { |pid| Process.waitpid(pid) }
+    assert_equal 1, calls[0]
+    assert_equal [ "1,2" ] * 4, lines
+    rv = cache.fetch { flunk "not cached" }
+    assert_equal 2, rv["/a"].queued
+    assert_equal 0, rv["/b"].queued
+  end
+
+  def test_listener_cache_lease_takeover
+    klass = Raindrops::Middleware::ListenerCache
+    cache = klass.new(%w(/a), 60, 0.05)
+    rd = cache.instance_variable_get(:@rd)
+    dead = cache.acquire(klass.clock)
+    assert dead
+    assert_nil cache.acquire(klass.clock)
+    sleep 0.1
+    rv = cache.fetch { { "/a" => Raindrops::ListenStats.new(3, 4) } }
+    assert_equal 4, rv["/a"].queued
+    assert_equal 0, rd[klass::FLIGHT]
+
+    # the old holder can no longer release a lease it lost
+    assert_equal false, rd.cas(klass::FLIGHT, dead, 0)
+    assert_equal 0, rd[klass::FLIGHT]
+    assert_equal 4, cache.fetch { flunk "not cached" }["/a"].queued
+  end
+
+  def test_listener_cache_killed_writer
+    klass = Raindrops::Middleware::ListenerCache
+    cache = klass.new(%w(/a), 60, 0.05)
+    rd = cache.instance_variable_get(:@rd)
+    assert cache.acquire(klass.clock)
+    rd.incr(klass::SEQ) # killed halfway through write
+    sleep 0.1
+    rv = cache.fetch { { "/a" => Raindrops::ListenStats.new(5, 6) } }
+    assert_equal 6, rv["/a"].queued
+    assert rd[klass::SEQ].even?
+    assert_equal 6, cache.fetch { flunk "not cached" }["/a"].queued
+  end
+
+  def test_listener_cache_exclusive_write
+    klass = Raindrops::Middleware::ListenerCache
+    cache = klass.new(%w(/a), 60)
+    rd = cache.instance_variable_get(:@rd)
+    stats = { "/a" => Raindrops::ListenStats.new(1, 1) }
+    assert_equal true, cache.write(stats, klass.clock + 60000)
+    seq = rd[klass::SEQ]
+    assert seq.even?
+    assert rd.cas(klass::SEQ, seq, seq + 1) # another writer, mid-write
+    assert rd.cas(klass::SEQ, seq + 1, seq + 2) # and it finished
+    assert rd.cas(klass::SEQ, seq + 2, seq + 3) # and started again
+    # parity is restored, but the other writer's stores are not touched
+    assert_equal true, cache.write(stats, klass.clock + 60000)
+  end
+
   def test_concurrent
     rda, wra = IO.pipe
     rdb, wrb = IO.pipe
@@ -1,6 +1,7 @@
 # -*- encoding: binary -*-
 require 'test/unit'
 require 'raindrops'
+require 'tmpdir'
 
 class TestRaindrops < Test::Unit::TestCase
 
@@ -162,4 +163,274 @@ class TestRaindrops < Test::Unit::TestCase
     assert status.success?
     assert_equal [ 1, 2 ], tmp.to_ary
   end
+
+  def test_shards
+    rd = Raindrops.new(4, :shards => 3)
+    assert_equal 3, rd.shards
+    assert_equal 4, rd.size
+    assert rd.capa >= rd.size
+    assert_equal [0, 0, 0, 0], rd.to_ary
+    assert_nil rd.incr(1)
+    assert_nil rd.incr(3, 6)
+    assert_equal [0, 1, 0, 6], rd.to_ary
+    assert_nil rd.decr(3, 2)
+    assert_equal 4, rd[3]
+    rd[1] = 5
+    assert_equal 5, rd[1]
+    assert_raises(ArgumentError) { rd.incr(4) }
+  end
+
+  def test_shards_cpu
+    rd = Raindrops.new(2, :shards => :cpu)
+    assert rd.shards >= 1
+    assert_equal [0, 0], rd.to_ary
+    assert_equal 1, Raindrops.new(1).shards
+    assert_raises(ArgumentError) { Raindrops.new(1, :shards => 0) }
+  end
+
+  def test_size_overflow
+    max = (1 << (8 * [ 0 ].pack("J").bytesize)) - 1 # SIZE_MAX
+    assert_raises(RangeError) { Raindrops.new(1, :shards => max) }
+    assert_raises(RangeError) { Raindrops.new(max / 2, :shards => 4) }
+    assert_raises(RangeError) { Raindrops.new(max) }
+    rd = Raindrops.new(1, :shards => 2)
+    assert_raises(RangeError) { rd.size = max / 4 }
+  end
+
+  def test_shards_incr_decr_shared
+    rd = Raindrops.new(2, :shards => :cpu)
+    pids = (1..4).map do
+      fork { 10000.times { rd.incr(0); rd.incr(1, 2); rd.decr(0) } }
+    end
+    10000.times { rd.incr(0) }
+    pids.each do |pid|
+      _, status = Process.waitpid2(pid)
+      assert status.success?
+    end
+    assert_equal [10000, 80000], rd.to_ary
+  end
+
+  def test_shards_dup
+    rd = Raindrops.new(1, :shards => 2)
+    rd.incr(0, 3)
+    tmp = rd.dup
+    assert_equal 2, tmp.shards
+    rd.incr(0)
+    assert_equal 3, tmp[0]
+    assert_equal 4, rd[0]
+  end
+
+  def test_apply_ary
+    rd = Raindrops.new(4)
+    rd[2] = 5
+    assert_nil rd.apply([[0, 1], [2, -2], [3, 7], [0, 1]])
+    assert_equal [2, 0, 3, 7], rd.to_ary
+    assert_nil rd.apply([])
+    assert_equal [2, 0, 3, 7], rd.to_ary
+  end
+
+  def test_apply_ary_invalid
+    rd = Raindrops.new(2)
+    assert_raises(ArgumentError) { rd.apply([[0, 1], [2, 1]]) }
+    assert_raises(ArgumentError) { rd.apply([[0, 1], [1]]) }
+    assert_raises(TypeError) { rd.apply([[0, 1], 1]) }
+    assert_raises(TypeError) { rd.apply(1) }
+    assert_equal [0, 0], rd.to_ary
+  end
+
+  def test_apply_packed
+    rd = Raindrops.new(3)
+    buf = ""
+    buf << [ 0, 3 ].pack("L!l!")
+    buf << [ 2, 1 ].pack("L!l!")
+    buf << [ 0, -1 ].pack("L!l!")
+    assert_nil rd.apply(buf)
+    assert_equal [2, 0, 1], rd.to_ary
+    assert_raises(ArgumentError) { rd.apply(buf[0, buf.size - 1]) }
+    assert_raises(ArgumentError) { rd.apply([ 3, 1 ].pack("L!l!")) }
+    assert_equal [2, 0, 1], rd.to_ary
+  end
+
+  def test_apply_ary_hostile
+    rd = Raindrops.new(2)
+    assert_raises(TypeError) { rd.apply([[0.5, 1]]) }
+    assert_raises(ArgumentError) { rd.apply([[-1, 1]]) }
+    assert_raises(ArgumentError) { rd.apply([[1 << 70, 1]]) }
+
+    ary = [[0, 1], [1, 1]]
+    evil = Object.new
+    evil.define_singleton_method(:to_int) { ary[1] = [ 1 << 62, 1 ]; 1 }
+    ary[0][1] = evil
+    assert_raises(ArgumentError) { rd.apply(ary) }
+    assert_equal [0, 0], rd.to_ary
+  end
+
+  def test_apply_packed_unaligned
+    rd = Raindrops.new(2)
+    buf = "." << [ 1, 2 ].pack("L!l!") << [ 0, 1 ].pack("L!l!")
+    assert_nil rd.apply(buf[1, buf.size - 1])
+    assert_equal [1, 2], rd.to_ary
+  end
+
+  def test_apply_shards
+    rd = Raindrops.new(2, :shards => 4)
+    rd.apply([[0, 2], [1, 3]])
+    rd.apply([ 1, -1 ].pack("L!l!"))
+    assert_equal [2, 2], rd.to_ary
+  end
+
+  def test_max_min
+    rd = Raindrops.new(2)
+    assert_equal 5, rd.max!(0, 5)
+    assert_equal 5, rd.max!(0, 3)
+    assert_equal 5, rd[0]
+    rd[1] = Raindrops::MAX
+    assert_equal 7, rd.min!(1, 7)
+    assert_equal 7, rd.min!(1, 9)
+    assert_equal 2, rd.min!(1, 2)
+  end
+
+  def test_max_shared
+    rd = Raindrops.new(1)
+    pids = (1..4).map do |i|
+      fork { (1..10000).each { |j| rd.max!(0, j * 4 + i) } }
+    end
+    pids.each { |pid| assert Process.waitpid2(pid).last.success? }
+    assert_equal 40004, rd[0]
+  end
+
+  def test_cas
+    rd = Raindrops.new(1)
+    assert_equal true, rd.cas(0, 0, 3)
+    assert_equal false, rd.cas(0, 0, 4)
+    assert_equal 3, rd[0]
+  end
+
+  def test_swap_shared
+    rd = Raindrops.new(2)
+    pid = fork { 100000.times { rd.incr(0) } }
+    total = 0
+    total += rd.swap(0, 0) until Process.waitpid(pid, Process::WNOHANG)
+    total += rd.swap(0, 0)
+    assert_equal 100000, total
+    assert_equal 0, rd[0]
+  end
+
+  def test_cas_shards
+    rd = Raindrops.new(1, :shards => 2)
+    assert_raises(ArgumentError) { rd.max!(0, 1) }
+    assert_raises(ArgumentError) { rd.min!(0, 1) }
+    assert_raises(ArgumentError) { rd.cas(0, 0, 1) }
+    assert_raises(ArgumentError) { rd.swap(0, 1) }
+    assert_raises(ArgumentError) { rd.seqlock_read(0) }
+  end
+
+  def test_seqlock_read
+    rd = Raindrops.new(3)
+    assert_equal [ 0, 0, 0 ], rd.seqlock_read(0)
+    rd.incr(0)
+    rd[1] = 1
+    assert_nil rd.seqlock_read(0)
+    rd[2] = 1
+    rd.incr(0)
+    assert_equal [ 2, 1, 1 ], rd.seqlock_read(0)
+    assert_raises(ArgumentError) { rd.seqlock_read(3) }
+  end
+
+  def test_seqlock_read_shared
+    rd = Raindrops.new(3)
+    pid = fork do
+      1.upto(100000) do |i|
+        rd.incr(0)
+        rd[1] = i
+        rd[2] = i
+        rd.incr(0)
+      end
+    end
+    nr = 0
+    until Process.waitpid(pid, Process::WNOHANG)
+      vals = rd.seqlock_read(0) or next
+      assert_equal vals[1], vals[2]
+      nr += 1
+    end
+    assert_equal [ 200000, 100000, 100000 ], rd.seqlock_read(0)
+    assert nr > 0
+  end
+
+  def test_open
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/rd"
+      rd = Raindrops.open(path, 4)
+      assert_equal 4, rd.size
+      assert rd.capa >= rd.size
+      assert_equal [0, 0, 0, 0], rd.to_ary
+      assert_equal 5, rd.incr(3, 5)
+      pid = fork { rd.incr(0) }
+      _, status = Process.waitpid2(pid)
+      assert status.success?
+      assert_equal [1, 0, 0, 5], rd.to_ary
+
+      # reopening reuses existing counters
+      tmp = Raindrops.open(path, 2)
+      assert_equal [1, 0], tmp.to_ary
+      tmp.incr(1)
+      assert_equal [1, 1, 0, 5], rd.to_ary
+      assert_nil tmp.evaporate!
+      assert_nil rd.evaporate!
+    end
+  end
+
+  def test_open_header
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/rd"
+      rd = Raindrops.open(path, 2, :shards => 2)
+      rd.incr(1, 7)
+      magic, version, slot_size, offset, capa, shards =
+        File.read(path, 40, 0).unpack("a8LLQQQ")
+      assert_equal "RAINDROP", magic
+      assert_equal 1, version
+      assert_equal Raindrops::SIZE, slot_size
+      assert_equal Raindrops::PAGE_SIZE, offset
+      assert_equal rd.capa, capa
+      assert_equal 2, shards
+      assert_equal File.size(path), offset + capa * shards * slot_size
+      vals = (0..3).map do |i|
+        File.read(path, 8, offset + i * slot_size).unpack("Q")[0]
+      end
+      assert_equal 7, vals.inject(0) { |sum,x| sum + x }
+      assert_equal 2, Raindrops.open(path, 1).shards
+    end
+  end
+
+  def test_open_mismatch
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/rd"
+      rd = Raindrops.open(path, 1)
+      assert_raises(ArgumentError) { Raindrops.open(path, 1, :shards => 2) }
+      assert_raises(ArgumentError) { Raindrops.open(path, rd.capa + 1) }
+      assert_raises(RangeError) { rd.size = rd.capa + 1 }
+      File.open("#{dir}/bad", "w") { |fp| fp.write("hello world" * 10) }
+      assert_raises(ArgumentError) { Raindrops.open("#{dir}/bad", 1) }
+      assert_raises(Errno::ENOENT) { Raindrops.open("#{dir}/x/y", 1) }
+    end
+  end
+
+  def test_open_corrupt_header
+    Dir.mktmpdir do |dir|
+      path = "#{dir}/rd"
+      Raindrops.open(path, 1).evaporate!
+      hdr = File.read(path, 40, 0)
+      magic, version, slot_size, offset, capa, shards = hdr.unpack("a8LLQQQ")
+      [ [ offset, 1 << 62, shards ], # capa * slot size overflows
+        [ offset, capa, 1 << 62 ], # shards * slot size overflows
+        [ (1 << 64) - 1, capa, shards ], # offset + capa overflows
+        [ 0, capa, shards ], # counters overlap the header
+        [ offset, capa + 1, shards ], # larger than the file
+      ].each do |off, c, n|
+        bad = [ magic, version, slot_size, off, c, n ].pack("a8LLQQQ")
+        File.open(path, "r+") { |fp| fp.write(bad) }
+        assert_raises(ArgumentError) { Raindrops.open(path, 1) }
+      end
+    end
+  end
 end
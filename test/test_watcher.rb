@@ -6,8 +6,7 @@ require "raindrops"
 class TestWatcher < Test::Unit::TestCase
   TEST_ADDR = ENV['UNICORN_TEST_ADDR'] || '127.0.0.1'
   def check_headers(headers)
-    %w(X-Count X-Std-Dev X-Min X-Max X-Mean
-       X-Outliers-Low X-Outliers-Low X-Last-Reset).each { |x|
+    %w(X-Count X-Min X-Max X-Mean X-Last-Reset).each { |x|
       assert_kind_of String, headers[x], "#{x} missing"
     }
   end
@@ -43,6 +42,81 @@ class TestWatcher < Test::Unit::TestCase
     check_headers(resp.headers)
   end
 
+  def test_conditional_get
+    @req.get "/"
+    @app.wait_snapshot
+    resp = @req.get "/active/#@addr.txt"
+    assert_equal 200, resp.status.to_i
+    etag = resp.headers["ETag"]
+    assert etag, resp.headers.inspect
+    last_modified = resp.headers["Last-Modified"]
+    assert_nothing_raised { Time.httpdate(last_modified) }
+
+    resp = @req.get "/active/#@addr.txt", "HTTP_IF_NONE_MATCH" => etag
+    if resp.status.to_i == 304
+      assert_equal "", resp.body
+      assert_equal etag, resp.headers["ETag"]
+    else # a new snapshot was published in the meantime
+      assert etag != resp.headers["ETag"]
+    end
+
+    resp = @req.get "/active/#@addr.txt",
+                    "HTTP_IF_MODIFIED_SINCE" => (Time.now + 60).httpdate
+    assert_equal 304, resp.status.to_i
+
+    resp = @req.get "/", "HTTP_IF_NONE_MATCH" => '"bogus"'
+    assert_equal 200, resp.status.to_i
+  end
+
+  def test_metrics
+    @req.get "/"
+    @app.wait_snapshot
+    resp = @req.get "/metrics"
+    assert_equal 200, resp.status.to_i
+    assert_match %r{\Aapplication/openmetrics-text}, resp.headers["Content-Type"]
+    body = resp.body
+    label = %Q({listener="#@addr"})
+    assert_match %r{^raindrops_listener_active#{Regexp.escape label} 0$}, body
+    assert_match %r{^raindrops_listener_queued#{Regexp.escape label} 1$}, body
+    assert_match %r{^# TYPE raindrops_listener_queued_samples histogram$}, body
+    inf = %Q({listener="#@addr",le="+Inf"})
+    assert_match %r{^raindrops_listener_queued_samples_bucket#{Regexp.escape inf} \d+$}, body
+    assert_match %r{^# EOF\n\z}, body
+  end
+
+  def test_history
+    @req.get "/"
+    @app.wait_snapshot
+    resp = @req.get "/history/#@addr.csv?since=-60"
+    assert_equal 200, resp.status.to_i
+    assert_equal "text/csv", resp.headers["Content-Type"]
+    lines = resp.body.split(/\n/)
+    assert_equal "time,active,queued", lines.shift
+    assert lines.size >= 1
+    lines.each { |line| assert_match %r{\A\d+\.\d+,0,1\z}, line }
+
+    resp = @req.get "/history/#@addr.bin"
+    assert_equal 200, resp.status.to_i
+    assert_equal 0, resp.body.bytesize % Raindrops::History::RECORD_SIZE
+    assert_match %r{\A(?:le|be)\z}, resp.headers["X-Byte-Order"]
+
+    resp = @req.get "/history/#@addr.csv?since=#{Time.now.to_i + 3600}"
+    assert_equal "time,active,queued\n", resp.body
+    assert_equal 400, @req.get("/history/#@addr.csv?until=x").status.to_i
+    assert_equal 404, @req.get("/history/0.0.0.0:1.csv").status.to_i
+  end
+
+  def test_quantile_headers
+    @req.get "/queued/#@addr.txt"
+    @ios << TCPSocket.new(TEST_ADDR, @port)
+    @app.wait_snapshot
+    resp = @req.get "/queued/#@addr.txt"
+    %w(X-P50 X-P90 X-P99 X-P999).each do |x|
+      assert_match %r{\A\d+\z}, resp.headers[x], "#{x} missing"
+    end
+    assert_equal "2", resp.headers["X-P999"]
+  end
+
   def test_invalid
     assert_nothing_raised do
       @req.get("/active/666.666.666.666%3A666.txt")
@@ -52,7 +126,8 @@ class TestWatcher < Test::Unit::TestCase
     end
     addr = @app.instance_eval do
       @peak_active.keys + @peak_queued.keys +
-         @resets.keys + @active.keys + @queued.keys
+         @resets.keys + @active.keys + @queued.keys +
+         @active_q.keys + @queued_q.keys
     end
     assert addr.grep(/666\.666\.666\.666/).empty?, addr.inspect
   end
@@ -64,6 +139,57 @@ class TestWatcher < Test::Unit::TestCase
     check_headers(resp.headers)
   end
 
+  def test_histogram_body
+    @req.get "/"
+    @app.wait_snapshot
+    resp = @req.get "/queued/#@addr.txt"
+    assert_match %r{\A1\.\.1\t\d+\n\z}, resp.body
+    assert_nil resp.headers["X-Std-Dev"]
+    assert ! @app.instance_variable_get(:@active).include?(@addr)
+  end
+
+  def test_aggregate
+    require "aggregate"
+    @app.shutdown
+    @app = Raindrops::Watcher.new :delay => 0.001, :aggregate => true
+    @req = Rack::MockRequest.new @app
+    @req.get "/"
+    @app.wait_snapshot
+    %w(active queued).each do |field|
+      resp = @req.get "/#{field}/#@addr.txt"
+      assert_equal 200, resp.status.to_i
+      check_headers(resp.headers)
+      %w(X-Std-Dev X-Outliers-Low X-Outliers-High).each do |x|
+        assert_kind_of String, resp.headers[x], "#{x} missing"
+      end
+    end
+  rescue LoadError
+    warn "Aggregate RubyGem not available, skipping #{__method__}"
+  end
+
+  def test_interval
+    @app.shutdown
+    @app = Raindrops::Watcher.new :delay => 0.01, :interval => 0.001,
+                                  :listeners => [ @addr ]
+    @req = Rack::MockRequest.new @app
+    @req.get "/"
+    sampler = @app.instance_variable_get(:@sampler)
+    assert sampler.running?
+    3.times { @app.wait_snapshot }
+    resp = @req.get "/queued/#@addr.txt"
+    assert_equal "1", resp.headers["X-Current"]
+    assert_equal "1", resp.headers["X-Max"]
+    assert resp.headers["X-Count"].to_i > 3, resp.headers.inspect
+    resp = @req.get "/history/#@addr.csv"
+    lines = resp.body.split(/\n/)
+    assert_equal "time,active,queued", lines.shift
+    assert lines.size > 3, lines.inspect
+    lines.each { |line| assert_match %r{\A\d+\.\d+,0,1\z}, line }
+    assert_equal 302, @req.post("/reset/#@addr").status.to_i
+    @app.shutdown
+    assert ! sampler.running?
+  end if defined?(Raindrops::Linux::Sampler)
+
   def test_queued_txt
     resp = @req.get "/queued/#@addr.txt"
     assert_equal 200, resp.status.to_i
@@ -111,6 +237,44 @@ class TestWatcher < Test::Unit::TestCase
     end
   end
 
+  def test_tail_sse
+    env = @req.class.env_for "/tail/#@addr.sse"
+    status, headers, body = @app.call env
+    assert_equal "text/event-stream", headers["Content-Type"]
+    assert_equal 200, status.to_i
+    body.each do |x|
+      assert_match %r{\A\h+\r\nid: \d+\ndata: \{"time":"[^"]+","active":0,"queued":1\}\n\n\r\n\z}, x
+      break
+    end
+  end
+
+  def test_tail_broadcast
+    bodies = (1..3).map do
+      env = @req.class.env_for "/tail/#@addr.txt"
+      @app.call(env)[2]
+    end
+    lines = bodies.map do |body|
+      Thread.new { body.each { |x| break x } }
+    end.map { |thr| thr.value }
+    assert_equal 3, lines.size
+    lines.each { |x| assert_match %r{\b1\n\r\n\z}, x }
+    assert_equal 1, lines.map { |x| x.object_id }.uniq.size, "formatted once"
+  end
+
+  def test_tail_drops_slow_client
+    @app.shutdown
+    @app = Raindrops::Watcher.new :delay => 0.001, :tail_buffer => 2
+    @req = Rack::MockRequest.new @app
+    @req.get "/"
+    sub = @app.subscribe(@addr)
+    begin
+      @app.wait_snapshot
+    end until sub.size >= 2
+    @app.wait_snapshot
+    @app.wait_snapshot
+    assert_nil sub.pop, "dropped subscriber gets nil"
+  end
+
   def test_x_current_header
     env = @req.class.env_for "/active/#@addr.txt"
     status, headers, body = @app.call(env)